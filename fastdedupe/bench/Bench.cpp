@@ -0,0 +1,367 @@
+/*
+ * Bench.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Database.h"
+#include "File.h"
+#include "FileCatalog.h"
+#include "FilesystemHelper.h"
+#include "Hasher.h"
+#include "HashStore.h"
+#include "LogDatabase.h"
+#include "NullDatabase.h"
+#include "Snapshot.h"
+#include "TreeGenerator.h"
+
+using std::cerr;
+using std::cout;
+using std::exception;
+using std::function;
+using std::list;
+using std::map;
+using std::runtime_error;
+using std::set;
+using std::setw;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+struct BenchOptions {
+	TreeSpec tree;
+	size_t scale = 1000000;
+	size_t records = 200000;
+	string directory;
+	vector<string> filters;
+};
+
+//What a benchmark needs: the generated tree and where to write
+struct BenchContext {
+	const BenchOptions & options;
+	const string root;
+	const string scratch;
+};
+
+typedef function<void(BenchContext &)> BenchFunction;
+
+static volatile uint64_t benchSink;
+
+static uint64_t mixBits(uint64_t value) {
+	value += 0x9e3779b97f4a7c15ULL;
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+//Runs body once and prints a row, operations and bytes as it counted
+static void measure(const string & name,
+		const function<void(uint64_t & operations, uint64_t & bytes)> & body) {
+	uint64_t operations = 0, bytes = 0;
+	auto start = steady_clock::now();
+
+	body(operations, bytes);
+
+	double seconds = duration<double>(steady_clock::now() - start).count();
+
+	cout << std::left << setw(24) << name << std::right
+			<< setw(12) << operations
+			<< setw(12) << seconds
+			<< setw(14) << (seconds > 0 ? operations / seconds : 0)
+			<< setw(12) << (seconds > 0 ? bytes / seconds / (1 << 20) : 0)
+			<< "\n";
+}
+
+static void benchHash(BenchContext & context) {
+	const size_t length = 64 * 1024 * 1024;
+	unique_ptr<char[]> data(new char[length]);
+
+	for (size_t i = 0; i < length / sizeof(uint64_t); i++)
+		((uint64_t *) data.get())[i] = mixBits(i);
+
+	measure("hash.bytes", [&] (uint64_t & operations, uint64_t & bytes) {
+		for (; operations < 16; operations++) {
+			benchSink = Hasher::getHasher().hashFromBytes(data.get(),
+					length).getValue();
+			bytes += length;
+		}
+	});
+
+	//Files were just written, so this is mostly the page cache
+	measure("hash.file", [&] (uint64_t & operations, uint64_t & bytes) {
+		const TreeSpec & spec = context.options.tree;
+
+		for (; operations < spec.files; operations++) {
+			string filename = TreeGenerator::getPath(context.root, spec,
+					operations);
+
+			benchSink = Hasher::getHasher().hashFromFile(filename)
+					.getValue();
+			bytes += FilesystemHelper::getFilesystemHelper()
+					.getInfo(filename).size;
+		}
+	});
+}
+
+static void benchWalk(BenchContext & context) {
+	FilesystemHelper & fsHelper = FilesystemHelper::getFilesystemHelper();
+	long int minSize = fsHelper.getMinSize();
+
+	fsHelper.setMinSize(0);
+	measure("walk.recursive_read",
+			[&] (uint64_t & operations, uint64_t & bytes) {
+		set<string> patterns;
+		list<IgnoredFile> ignored;
+
+		fsHelper.recursiveRead({context.root},
+				[&operations, &bytes] (const FileInfo & info) {
+			operations++;
+			bytes += info.size;
+		}, patterns, ignored);
+	});
+	fsHelper.setMinSize(minSize);
+}
+
+/*
+ * Same shape as the standalone HashStore benchmark: every fourth file
+ * shares extents with the previous one and every pair of extents
+ * hashes shares data.
+ */
+static void benchHashStore(BenchContext & context) {
+	const size_t count = context.options.scale;
+	NullDatabase db;
+	FileCatalog catalog;
+
+	catalog.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		catalog.add("/bench/" + std::to_string(i / 1000) + "/f" +
+				std::to_string(i), 1, 1024 * 1024);
+
+	HashStore hs(&db, &catalog);
+
+	measure("hashstore.insert", [&] (uint64_t & operations, uint64_t &) {
+		for (FileId id = 0; id < count; id++, operations++) {
+			uint64_t extents = id % 4 == 3 ? id - 1 : id;
+
+			File(hs, id).update(1, Hash(mixBits(extents)),
+					Hash(mixBits(extents / 2 + count)), HASH_VERSION);
+		}
+	});
+
+	measure("hashstore.lookup", [&] (uint64_t & operations, uint64_t &) {
+		size_t found = 0;
+
+		for (; operations < count; operations++)
+			found += hs.hasExtentsHash(Hash(mixBits(mixBits(operations)
+					% count)));
+		benchSink = found;
+	});
+
+	measure("hashstore.candidates", [&] (uint64_t & operations, uint64_t &) {
+		map<FileId, vector<FileId>> candidates;
+
+		hs.getDedupeCandidates(candidates);
+		operations = candidates.size();
+	});
+
+	//What a daemon maps at startup instead of the database rows
+	const string snapshotFile = context.scratch + "/bench" +
+			SNAPSHOT_EXTENSION;
+
+	measure("hashstore.snapshot_save", [&] (uint64_t & operations,
+			uint64_t &) {
+		SnapshotWriter snapshot(snapshotFile, "bench");
+
+		catalog.save(snapshot);
+		hs.save(snapshot);
+		snapshot.commit();
+		operations = count;
+	});
+
+	measure("hashstore.snapshot_load", [&] (uint64_t & operations,
+			uint64_t &) {
+		SnapshotReader snapshot(snapshotFile);
+		FileCatalog loadedCatalog;
+		HashStore loadedStore(&db, &loadedCatalog);
+
+		loadedCatalog.load(snapshot);
+		loadedStore.load(snapshot);
+		operations = loadedCatalog.size();
+	});
+
+	//A file deleted and created again, as a daemon sees it
+	measure("hashstore.recreate", [&] (uint64_t & operations, uint64_t &) {
+		for (FileId id = 0; id < count; id += 1000, operations++) {
+			string filename = catalog.getFilename(id);
+
+			hs.removeFile(id);
+			catalog.remove(id);
+			if (catalog.find(filename) != NO_FILE)
+				throw runtime_error(filename + " found once removed");
+			if (catalog.add(filename, 2, 1024 * 1024) != id ||
+					catalog.find(filename) != id ||
+					! catalog.hasFlag(id, FileCatalog::NEW_FILE))
+				throw runtime_error(filename + " not revived");
+		}
+		if (catalog.size() != count)
+			throw runtime_error("Catalog grew on recreated files");
+	});
+}
+
+static FileRecord makeRecord(size_t i) {
+	FileRecord record{"/bench/" + std::to_string(i / 1000) + "/f" +
+			std::to_string(i), 1, 1024 * 1024, Hash(mixBits(i)),
+			Hash(mixBits(i / 2)), {}, BlockHashes{0, {}}};
+
+	record.extents.push_back(FiemapData{0, mixBits(i) & ~4095ULL,
+		1024 * 1024});
+	return record;
+}
+
+static void benchDatabase(BenchContext & context, const string & name,
+		const string & extension) {
+	const size_t count = context.options.records;
+	const string filename = context.scratch + "/bench" + extension;
+
+	{
+		unique_ptr<Database> db(Database::open(filename));
+
+		measure(name + ".insert", [&] (uint64_t & operations, uint64_t &) {
+			for (; operations < count; operations++)
+				db->storeRecord(makeRecord(operations), true);
+			db->flush();
+		});
+	}
+
+	unique_ptr<Database> db(Database::open(filename));
+
+	measure(name + ".load", [&] (uint64_t & operations, uint64_t &) {
+		db->loadFiles("", [&operations] (const FileRecord &) {
+			operations++;
+		});
+	});
+}
+
+static int removeEntry(const char * path, const struct stat *, int,
+		struct FTW *) {
+	return remove(path);
+}
+
+static int showError(const char * name) {
+	cerr << "Usage: " << name << " [--files n] [--scale n] [--records n]"
+			" [--dir path] [filter...]\n"
+			"Filters select benchmarks by prefix: hash, walk, hashstore,"
+			" sqlite, log.\n";
+	return 1;
+}
+
+int main(int argc, char ** argv) {
+	BenchOptions options;
+	const vector<std::pair<string, BenchFunction>> benchmarks = {
+		{"hash", benchHash},
+		{"walk", benchWalk},
+		{"hashstore", benchHashStore},
+		{"sqlite", [] (BenchContext & context) {
+			benchDatabase(context, "sqlite", ".sqlite");
+		}},
+		{"log", [] (BenchContext & context) {
+			benchDatabase(context, "log", LOG_DATABASE_EXTENSION);
+		}}
+	};
+
+	options.tree.files = 200;
+	options.tree.minSize = 64 * 1024;
+	options.tree.maxSize = 4 * 1024 * 1024;
+
+	for (int i = 1; i < argc; i++) {
+		string argument(argv[i]);
+
+		if (argument.substr(0, 1) != "-") {
+			options.filters.push_back(argument);
+			continue;
+		} else if (i + 1 >= argc) {
+			cerr << argument << " requires an argument.\n";
+			return showError(argv[0]);
+		}
+
+		if (argument == "--files")
+			options.tree.files = std::stoull(argv[++i]);
+		else if (argument == "--scale")
+			options.scale = std::stoull(argv[++i]);
+		else if (argument == "--records")
+			options.records = std::stoull(argv[++i]);
+		else if (argument == "--dir")
+			options.directory = argv[++i];
+		else {
+			cerr << "Unrecognized option '" << argument << "'.\n";
+			return showError(argv[0]);
+		}
+	}
+
+	string scratch = options.directory;
+	if (scratch.empty()) {
+		char temp[] = "/tmp/fastdedupe_bench.XXXXXX";
+
+		if (mkdtemp(temp) == NULL) {
+			cerr << "Could not create a scratch directory.\n";
+			return 1;
+		}
+		scratch = temp;
+	}
+
+	int result = 0;
+
+	try {
+		BenchContext context{options, scratch + "/tree", scratch};
+
+		TreeGenerator(options.tree).generate(context.root);
+
+		cout << std::fixed << std::setprecision(2)
+				<< std::left << setw(24) << "benchmark" << std::right
+				<< setw(12) << "ops"
+				<< setw(12) << "seconds"
+				<< setw(14) << "ops/s"
+				<< setw(12) << "MiB/s" << "\n";
+
+		for (auto & benchmark : benchmarks) {
+			bool selected = options.filters.empty();
+
+			for (const string & filter : options.filters)
+				selected |= benchmark.first.compare(0, filter.size(),
+						filter) == 0;
+
+			if (selected)
+				benchmark.second(context);
+		}
+	} catch (exception & e) {
+		cerr << e.what() << "\n";
+		result = 1;
+	}
+
+	//A given directory keeps the tree and databases for a look
+	if (options.directory.empty())
+		nftw(scratch.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return result;
+}
@@ -0,0 +1,110 @@
+/*
+ * GenTree.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "TreeGenerator.h"
+
+using std::cerr;
+using std::cout;
+using std::exception;
+using std::invalid_argument;
+using std::string;
+
+static uint64_t parseBytes(const string & value) {
+	size_t end;
+	uint64_t bytes = std::stoull(value, &end);
+	string suffix = value.substr(end);
+	const string units = "KMGT";
+
+	if (suffix.empty())
+		return bytes;
+	if (suffix.size() != 1 || units.find(suffix[0]) == string::npos)
+		throw invalid_argument("Invalid size '" + value + "'");
+
+	return bytes << (10 * (units.find(suffix[0]) + 1));
+}
+
+static TreeSpec::Distribution parseDistribution(const string & value) {
+	if (value == "fixed")
+		return TreeSpec::FIXED;
+	else if (value == "uniform")
+		return TreeSpec::UNIFORM;
+	else if (value == "log")
+		return TreeSpec::LOG_UNIFORM;
+
+	throw invalid_argument("Invalid size distribution '" + value + "'");
+}
+
+static int showError(const char * name) {
+	cerr << "Usage: " << name << " [--seed n] [--files n]"
+			" [--per-directory n] [--sizes fixed|uniform|log]"
+			" [--min-size bytes] [--max-size bytes]"
+			" [--duplicates ratio] root\n";
+	return 1;
+}
+
+int main(int argc, char ** argv) {
+	TreeSpec spec;
+	string root;
+
+	try {
+		for (int i = 1; i < argc; i++) {
+			string argument(argv[i]);
+
+			if (argument.substr(0, 1) != "-") {
+				if (! root.empty())
+					return showError(argv[0]);
+				root = argument;
+				continue;
+			} else if (i + 1 >= argc) {
+				cerr << argument << " requires an argument.\n";
+				return showError(argv[0]);
+			}
+
+			string value(argv[++i]);
+
+			if (argument == "--seed")
+				spec.seed = std::stoull(value);
+			else if (argument == "--files")
+				spec.files = std::stoull(value);
+			else if (argument == "--per-directory")
+				spec.filesPerDirectory = std::stoull(value);
+			else if (argument == "--sizes")
+				spec.sizes = parseDistribution(value);
+			else if (argument == "--min-size")
+				spec.minSize = parseBytes(value);
+			else if (argument == "--max-size")
+				spec.maxSize = parseBytes(value);
+			else if (argument == "--duplicates")
+				spec.duplicateRatio = std::stod(value);
+			else {
+				cerr << "Unrecognized option '" << argument << "'.\n";
+				return showError(argv[0]);
+			}
+		}
+
+		if (root.empty())
+			return showError(argv[0]);
+
+		TreeSummary summary = TreeGenerator(spec).generate(root);
+
+		cout << summary.files << " files (" << summary.bytes
+				<< " bytes) in " << summary.directories << " directories, "
+				<< summary.duplicates << " duplicates ("
+				<< summary.duplicateBytes << " bytes)\n";
+	} catch (exception & e) {
+		cerr << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
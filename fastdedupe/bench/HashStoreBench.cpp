@@ -0,0 +1,126 @@
+/*
+ * HashStoreBench.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include <malloc.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "File.h"
+#include "FileCatalog.h"
+#include "HashStore.h"
+#include "NullDatabase.h"
+
+using std::cout;
+using std::map;
+using std::setw;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+static volatile size_t lookupSink;
+
+static uint64_t mixBits(uint64_t value) {
+	value += 0x9e3779b97f4a7c15ULL;
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+static size_t heapInUse() {
+	struct mallinfo2 info = mallinfo2();
+
+	//Large tables come straight from mmap
+	return info.uordblks + info.hblkhd;
+}
+
+static double seconds(steady_clock::time_point start) {
+	return duration<double>(steady_clock::now() - start).count();
+}
+
+/*
+ * Every fourth file shares extents with the previous one (a reflink)
+ * and every pair of extents hashes shares data, so about half the
+ * store ends up in dedupe candidate groups.
+ */
+static void runBenchmark(size_t count) {
+	NullDatabase db;
+
+	size_t heapBefore = heapInUse();
+	FileCatalog catalog;
+
+	catalog.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		catalog.add("/bench/" + std::to_string(i / 1000) + "/f" +
+				std::to_string(i), 1, 1024 * 1024);
+	size_t catalogBytes = heapInUse() - heapBefore;
+
+	heapBefore = heapInUse();
+	HashStore hs(&db, &catalog);
+
+	auto start = steady_clock::now();
+	for (FileId id = 0; id < count; id++) {
+		uint64_t extents = id % 4 == 3 ? id - 1 : id;
+
+		File(hs, id).update(1, Hash(mixBits(extents)),
+				Hash(mixBits(extents / 2 + count)), HASH_VERSION);
+	}
+	double insertTime = seconds(start);
+	size_t indexBytes = heapInUse() - heapBefore;
+
+	start = steady_clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = mixBits(mixBits(i) % count);
+		found += hs.hasExtentsHash(Hash(key));
+	}
+	double lookupTime = seconds(start);
+
+	start = steady_clock::now();
+	map<FileId, vector<FileId>> candidates;
+	hs.getDedupeCandidates(candidates);
+	double candidatesTime = seconds(start);
+
+	cout << setw(12) << count
+			<< setw(12) << (double) catalogBytes / count
+			<< setw(12) << (double) indexBytes / count
+			<< setw(14) << count / insertTime / 1e6
+			<< setw(14) << count / lookupTime / 1e6
+			<< setw(14) << candidatesTime
+			<< setw(12) << candidates.size() << "\n";
+
+	lookupSink = found;
+}
+
+int main(int argc, char ** argv) {
+	vector<size_t> counts;
+
+	for (int i = 1; i < argc; i++)
+		counts.push_back(std::stoull(argv[i]));
+
+	if (counts.empty())
+		counts = {10000000, 100000000};
+
+	cout << std::fixed << std::setprecision(2)
+			<< setw(12) << "files"
+			<< setw(12) << "catalog B/f"
+			<< setw(12) << "index B/f"
+			<< setw(14) << "insert M/s"
+			<< setw(14) << "lookup M/s"
+			<< setw(14) << "candidates s"
+			<< setw(12) << "groups" << "\n";
+
+	for (size_t count : counts)
+		runBenchmark(count);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * NullDatabase.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef NULLDATABASE_H_
+#define NULLDATABASE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "Database.h"
+
+//Keeps nothing, benchmarks measure the structures in front of it
+class NullDatabase : public Database {
+public:
+	void storeRecord(const FileRecord &, bool) {
+	}
+
+	void removeFile(const std::string &) {
+	}
+
+	void flush() {
+	}
+
+	size_t getBacklog() const {
+		return 0;
+	}
+
+	void loadFiles(const std::string &, const RecordCallback &) {
+	}
+
+	void loadExtents(const ExtentsCallback &) {
+	}
+
+	void loadBlocks(const BlocksCallback &) {
+	}
+
+	void storeExtentHash(const ExtentKey &, uint64_t) {
+	}
+
+	void loadExtentHashes(const ExtentHashCache::EntryCallback &) {
+	}
+
+	void cleanHashes() {
+	}
+
+	void storeGeneration(const std::string &, const BtrfsGeneration &) {
+	}
+
+	bool loadGeneration(const std::string &, BtrfsGeneration &) {
+		return false;
+	}
+
+	void storeVerified(const std::string &, std::time_t) {
+	}
+
+	void loadVerified(const std::string &, const VerifiedCallback &) {
+	}
+
+	std::string getVersion() {
+		return "";
+	}
+};
+
+#endif /* NULLDATABASE_H_ */
@@ -0,0 +1,157 @@
+/*
+ * TreeGenerator.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "TreeGenerator.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+using std::ofstream;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+#define GENERATOR_BUFFER_SIZE 1024*1024
+
+TreeGenerator::TreeGenerator(const TreeSpec & spec) :
+	spec(spec),
+	state(spec.seed) {
+	if (spec.files && (spec.filesPerDirectory == 0 ||
+			spec.directoriesPerDirectory == 0 ||
+			spec.minSize > spec.maxSize))
+		throw std::invalid_argument("Invalid tree spec");
+}
+
+TreeGenerator::~TreeGenerator() {
+}
+
+//splitmix64, small and the same everywhere
+uint64_t TreeGenerator::next() {
+	uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+double TreeGenerator::nextUnit() {
+	return (next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+uint64_t TreeGenerator::nextSize() {
+	uint64_t range = spec.maxSize - spec.minSize;
+
+	switch (spec.sizes) {
+	case TreeSpec::UNIFORM:
+		return spec.minSize + (range ? next() % (range + 1) : 0);
+	case TreeSpec::LOG_UNIFORM:
+		return std::llround(std::exp(std::log((double) spec.minSize + 1) +
+				nextUnit() * (std::log((double) spec.maxSize + 1) -
+						std::log((double) spec.minSize + 1)))) - 1;
+	default:
+		return spec.minSize;
+	}
+}
+
+string TreeGenerator::getPath(const string & root, const TreeSpec & spec,
+		size_t index) {
+	size_t directory = index / spec.filesPerDirectory;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/%04zu/%04zu/f%zu",
+			directory / spec.directoriesPerDirectory,
+			directory % spec.directoriesPerDirectory, index);
+
+	return root + name;
+}
+
+void TreeGenerator::writeFile(const string & filename, uint64_t seed,
+		uint64_t size) {
+	static thread_local vector<uint64_t> buffer(
+			GENERATOR_BUFFER_SIZE / sizeof(uint64_t));
+	ofstream out(filename, std::ios::binary | std::ios::trunc);
+	uint64_t contents = seed;
+
+	if (! out.is_open())
+		throw runtime_error(filename + ": " + strerror(errno));
+
+	for (uint64_t written = 0; written < size; ) {
+		for (uint64_t & word : buffer) {
+			word = (contents += 0x9e3779b97f4a7c15ULL);
+			word = (word ^ (word >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			word = (word ^ (word >> 27)) * 0x94d049bb133111ebULL;
+			word ^= word >> 31;
+		}
+
+		uint64_t length = std::min<uint64_t>(GENERATOR_BUFFER_SIZE,
+				size - written);
+		out.write((const char *) buffer.data(), length);
+		written += length;
+	}
+
+	if (! out.good())
+		throw runtime_error(filename + ": write failed");
+}
+
+TreeSummary TreeGenerator::generate(const string & root) {
+	struct Contents {
+		uint64_t seed;
+		uint64_t size;
+	};
+
+	vector<Contents> originals;
+	TreeSummary summary{0, 0, 0, 0, 0};
+	string directory;
+
+	state = spec.seed;
+
+	if (mkdir(root.c_str(), 0755) == -1 && errno != EEXIST)
+		throw runtime_error(root + ": " + strerror(errno));
+
+	for (size_t i = 0; i < spec.files; i++) {
+		string filename = getPath(root, spec, i);
+		size_t slash = filename.rfind('/');
+		Contents contents;
+
+		if (filename.compare(0, slash, directory) != 0 ||
+				directory.size() != slash) {
+			directory = filename.substr(0, slash);
+
+			//Both levels, the parent is usually there already
+			for (size_t end : {directory.rfind('/'), directory.size()}) {
+				string path = directory.substr(0, end);
+
+				if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+					throw runtime_error(path + ": " + strerror(errno));
+			}
+			summary.directories++;
+		}
+
+		if (! originals.empty() && nextUnit() < spec.duplicateRatio) {
+			contents = originals[next() % originals.size()];
+			summary.duplicates++;
+			summary.duplicateBytes += contents.size;
+		} else {
+			contents = Contents{next(), nextSize()};
+			originals.push_back(contents);
+		}
+
+		writeFile(filename, contents.seed, contents.size);
+		summary.files++;
+		summary.bytes += contents.size;
+	}
+
+	return summary;
+}
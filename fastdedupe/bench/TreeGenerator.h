@@ -0,0 +1,73 @@
+/*
+ * TreeGenerator.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef TREEGENERATOR_H_
+#define TREEGENERATOR_H_
+
+#include <cstdint>
+#include <string>
+
+struct TreeSpec {
+	enum Distribution {
+		FIXED,
+		UNIFORM,
+		//Uniform over the logarithm of the size, most files small
+		LOG_UNIFORM
+	};
+
+	uint64_t seed = 1;
+	size_t files = 1000;
+	size_t filesPerDirectory = 100;
+	size_t directoriesPerDirectory = 16;
+	Distribution sizes = LOG_UNIFORM;
+	uint64_t minSize = 192 * 1024;
+	uint64_t maxSize = 8 * 1024 * 1024;
+	//Share of files that copy an earlier one
+	double duplicateRatio = 0.3;
+};
+
+struct TreeSummary {
+	size_t files;
+	size_t duplicates;
+	size_t directories;
+	uint64_t bytes;
+	uint64_t duplicateBytes;
+};
+
+/*
+ * Writes the same tree for the same spec: file contents, sizes and
+ * which files are copies all come from one seeded generator, so runs
+ * on different machines compare. Files go to root/aaaa/bbbb/f<index>,
+ * filesPerDirectory to a directory, directoriesPerDirectory to a
+ * parent.
+ */
+class TreeGenerator {
+private:
+	const TreeSpec spec;
+	uint64_t state;
+
+	uint64_t next();
+
+	double nextUnit();
+
+	uint64_t nextSize();
+
+	void writeFile(const std::string & filename, uint64_t seed,
+			uint64_t size);
+
+public:
+	TreeGenerator(const TreeSpec & spec);
+
+	virtual ~TreeGenerator();
+
+	static std::string getPath(const std::string & root,
+			const TreeSpec & spec, size_t index);
+
+	TreeSummary generate(const std::string & root);
+};
+
+#endif /* TREEGENERATOR_H_ */
@@ -0,0 +1,253 @@
+#!/bin/bash
+#
+# e2e.sh
+#
+#  Created on: Oct 18, 2026
+#      Author: adam
+#
+# End to end scenario on loopback filesystem images. For each filesystem
+# and each given build, a fresh image is made and filled with the same
+# generated tree plus hardlinks, sparse and fragmented files, then four
+# phases run: first scan, incremental rescan after some changes, dedupe by
+# a daemon of copies against the indexed files outside their directory,
+# and dedupe. Each phase reports wall time, bytes read from the device,
+# FIEMAP and dedupe ioctls issued and space reclaimed, one row per phase.
+# A daemon that misses a group of copies is reported as a failure.
+#
+# Compare two builds:
+#   sudo bench/e2e.sh old/fastdedupe new/fastdedupe
+#
+# Needs root, losetup and the mkfs of each filesystem. fastdedupe_gentree
+# is taken from next to the first build unless --gentree is given. Logs
+# and stats of the last scenario stay in the work directory.
+
+set -euo pipefail
+
+FILESYSTEMS="btrfs,xfs"
+IMAGE_SIZE="4G"
+FILES=2000
+SEED=1
+DUPLICATES=0.3
+GENTREE=""
+WORKDIR=""
+OUTPUT=""
+BUILDS=()
+
+usage() {
+	echo "Usage: $0 [--fs btrfs,xfs] [--image-size 4G] [--files n]" \
+		"[--seed n] [--duplicates ratio] [--gentree path]" \
+		"[--workdir dir] [--output file.tsv] build1 [build2...]" >&2
+	exit 1
+}
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	--fs) FILESYSTEMS="$2"; shift 2 ;;
+	--image-size) IMAGE_SIZE="$2"; shift 2 ;;
+	--files) FILES="$2"; shift 2 ;;
+	--seed) SEED="$2"; shift 2 ;;
+	--duplicates) DUPLICATES="$2"; shift 2 ;;
+	--gentree) GENTREE="$2"; shift 2 ;;
+	--workdir) WORKDIR="$2"; shift 2 ;;
+	--output) OUTPUT="$2"; shift 2 ;;
+	-*) usage ;;
+	*) BUILDS+=("$(realpath "$1")"); shift ;;
+	esac
+done
+
+[ ${#BUILDS[@]} -gt 0 ] || usage
+[ "$(id -u)" -eq 0 ] || { echo "$0 needs root for loop devices" >&2; exit 1; }
+[ -n "$GENTREE" ] || GENTREE="$(dirname "${BUILDS[0]}")/fastdedupe_gentree"
+[ -x "$GENTREE" ] || { echo "No generator at $GENTREE" >&2; exit 1; }
+
+WORKDIR="${WORKDIR:-$(mktemp -d /tmp/fastdedupe_e2e.XXXXXX)}"
+mkdir -p "$WORKDIR/mnt"
+IMAGE="$WORKDIR/image"
+MOUNT="$WORKDIR/mnt"
+LOOP=""
+
+cleanup() {
+	if mountpoint -q "$MOUNT"; then umount "$MOUNT"; fi
+	if [ -n "$LOOP" ]; then losetup -d "$LOOP"; fi
+	LOOP=""
+	rm -f "$IMAGE"
+}
+trap cleanup EXIT
+
+#Sectors read by the loop device, the page cache is dropped before each
+#phase so this is what the phase really read
+sectorsRead() {
+	awk '{print $3}' "/sys/block/$(basename "$LOOP")/stat"
+}
+
+usedBytes() {
+	sync -f "$MOUNT"
+	if [ "$1" = btrfs ]; then
+		btrfs filesystem sync "$MOUNT" >/dev/null
+	fi
+	df -B1 --output=used "$MOUNT" | tail -1 | tr -d ' '
+}
+
+makeFilesystem() {
+	local fs="$1"
+
+	truncate -s "$IMAGE_SIZE" "$IMAGE"
+	case "$fs" in
+	btrfs) mkfs.btrfs -q -f "$IMAGE" ;;
+	xfs) mkfs.xfs -q -f -m reflink=1 "$IMAGE" ;;
+	*) "mkfs.$fs" -q -F "$IMAGE" >/dev/null ;;
+	esac
+	LOOP="$(losetup -f --show "$IMAGE")"
+	mount "$LOOP" "$MOUNT"
+}
+
+#Same content for every build: the generated tree, then links, holes and
+#files written in small interleaved appends
+populate() {
+	local i
+
+	"$GENTREE" --seed "$SEED" --files "$FILES" \
+		--duplicates "$DUPLICATES" "$MOUNT/tree" >/dev/null
+
+	mkdir -p "$MOUNT/links" "$MOUNT/sparse" "$MOUNT/fragmented"
+	for ((i = 0; i < FILES / 20; i++)); do
+		ln "$MOUNT/tree/0000/0000/f$i" "$MOUNT/links/l$i" 2>/dev/null || true
+	done
+
+	for ((i = 0; i < 16; i++)); do
+		truncate -s 64M "$MOUNT/sparse/s$i"
+		dd if="$MOUNT/tree/0000/0000/f$((i % 4))" of="$MOUNT/sparse/s$i" \
+			bs=1M count=1 seek=$((i * 3)) conv=notrunc status=none
+	done
+
+	#Appends with fsync in turn keep the allocator from merging extents,
+	#pairs of files get the same data
+	for ((i = 0; i < 32; i++)); do
+		local file
+		for file in 0 1 2 3 4 5 6 7; do
+			head -c 65536 "$MOUNT/tree/0000/0000/f$(((file / 2 + i) % 10))" |
+				dd of="$MOUNT/fragmented/g$file" oflag=append conv=notrunc,fsync \
+					status=none
+		done
+	done
+}
+
+#Changes for the incremental rescan: a few files appended, some removed,
+#some added
+modify() {
+	local i
+
+	for ((i = 1; i < FILES; i += 97)); do
+		local file="$(find "$MOUNT/tree" -name "f$i" -print -quit)"
+		[ -z "$file" ] || head -c 4096 /dev/zero >>"$file"
+	done
+	for ((i = 2; i < FILES; i += 211)); do
+		rm -f "$(find "$MOUNT/tree" -name "f$i" -print -quit)"
+	done
+	"$GENTREE" --seed $((SEED + 1)) --files $((FILES / 50 + 1)) \
+		--duplicates "$DUPLICATES" "$MOUNT/added" >/dev/null
+}
+
+statsField() {
+	python3 -c 'import json,sys
+try:
+	stats = json.load(open(sys.argv[1]))["stages"]
+	print(stats["fiemap"]["count"] + stats["dedupe"]["count"])
+except Exception:
+	print("-")' "$1"
+}
+
+runPhase() {
+	local build="$1" fs="$2" phase="$3"
+	shift 3
+	local stats="$WORKDIR/$phase.json" start end sectors used
+
+	rm -f "$stats"
+	sync
+	echo 3 >/proc/sys/vm/drop_caches
+	used="$(usedBytes "$fs")"
+	sectors="$(sectorsRead)"
+	start="$(date +%s.%N)"
+
+	#Builds without --stats still run, their ioctl count shows as -
+	if grep -q -- --stats <("$build" 2>&1); then
+		set -- --stats "$stats" "$@"
+	fi
+	"$build" "$@" >"$WORKDIR/$phase.log" 2>&1 ||
+		echo "$phase failed with $build, see $WORKDIR/$phase.log" >&2
+
+	end="$(date +%s.%N)"
+	printf "%s\t%s\t%s\t%.3f\t%d\t%s\t%d\n" "$build" "$fs" "$phase" \
+		"$(awk "BEGIN {print $end - $start}")" \
+		$((($(sectorsRead) - sectors) * 512)) \
+		"$(statsField "$stats")" \
+		$((used - $(usedBytes "$fs")))
+}
+
+#Copies of indexed files, the daemon is asked to dedupe their directory
+#alone so the originals only take part as references. It runs as the
+#phase, the requests are sent from the background.
+runDaemonPhase() {
+	local build="$1" fs="$2" db="$3" socket="$WORKDIR/daemon.sock"
+	local answer="$WORKDIR/daemon-dedupe.answer" file sender groups i=0
+
+	grep -q -- --daemon <("$build" 2>&1) || return 0
+
+	mkdir -p "$MOUNT/copies"
+	for file in $(find "$MOUNT/tree" -type f -size +64k | sort | head -10); do
+		cp --reflink=never "$file" "$MOUNT/copies/c$((i++))"
+	done
+	rm -f "$socket" "$answer"
+
+	(
+		for ((i = 0; i < 600; i++)); do
+			[ -S "$socket" ] && break
+			sleep 0.1
+		done
+		"$build" --socket "$socket" --send "dedupe $MOUNT/copies" \
+			>"$answer" 2>&1 || true
+		"$build" --socket "$socket" --send shutdown >/dev/null 2>&1 || true
+	) &
+	sender=$!
+	runPhase "$build" "$fs" daemon-dedupe --db-file "$db" --daemon \
+		--socket "$socket" "$MOUNT/copies"
+	wait "$sender"
+
+	#Each copy has its original outside, so each content is a group
+	groups="$(md5sum "$MOUNT"/copies/* | cut -d' ' -f1 | sort -u | wc -l)"
+	grep -q "\"groups\":$groups," "$answer" ||
+		echo "daemon-dedupe did not find $groups groups with $build," \
+			"see $answer" >&2
+}
+
+runScenario() {
+	local build="$1" fs="$2" db="$WORKDIR/db.sqlite"
+
+	makeFilesystem "$fs"
+	populate
+	rm -f "$db"
+
+	runPhase "$build" "$fs" first-scan --db-file "$db" --recursive "$MOUNT"
+	modify
+	runPhase "$build" "$fs" rescan --db-file "$db" --recursive "$MOUNT"
+	runDaemonPhase "$build" "$fs" "$db"
+	runPhase "$build" "$fs" dedupe --db-file "$db" --dedupe --recursive "$MOUNT"
+
+	cleanup
+}
+
+#The scenarios run in a subshell of the pipeline, which has its own trap
+{
+	trap cleanup EXIT
+	printf "build\tfs\tphase\twall_s\tbytes_read\tioctls\treclaimed_bytes\n"
+	IFS=, read -ra fsList <<<"$FILESYSTEMS"
+	for fs in "${fsList[@]}"; do
+		for build in "${BUILDS[@]}"; do
+			runScenario "$build" "$fs"
+		done
+	done
+} | tee ${OUTPUT:+"$OUTPUT"} | if command -v column >/dev/null; then
+	column -t -s $'\t'
+else
+	cat
+fi
@@ -0,0 +1,77 @@
+/*
+ * Arena.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "Snapshot.h"
+
+#define ARENA_NONE UINT32_MAX
+
+/*
+ * Pool of T addressed by 32 bit index instead of pointer, so nodes
+ * can link to each other at half the size and survive the pool
+ * growing. Released slots are reused before the pool grows.
+ */
+template <typename T>
+class Arena {
+private:
+	std::vector<T> nodes;
+	std::vector<uint32_t> released;
+public:
+	uint32_t allocate() {
+		if (! released.empty()) {
+			uint32_t index = released.back();
+			released.pop_back();
+			nodes[index] = T();
+			return index;
+		}
+
+		nodes.emplace_back();
+		return nodes.size() - 1;
+	}
+
+	void release(uint32_t index) {
+		released.push_back(index);
+	}
+
+	T & operator[](uint32_t index) {
+		return nodes[index];
+	}
+
+	const T & operator[](uint32_t index) const {
+		return nodes[index];
+	}
+
+	void reserve(size_t size) {
+		nodes.reserve(size);
+	}
+
+	size_t size() const {
+		return nodes.size() - released.size();
+	}
+
+	size_t memoryUsage() const {
+		return nodes.capacity() * sizeof(T)
+				+ released.capacity() * sizeof(uint32_t);
+	}
+
+	void save(SnapshotWriter & snapshot) const {
+		snapshot.write(nodes);
+		snapshot.write(released);
+	}
+
+	void load(SnapshotReader & snapshot) {
+		snapshot.read(nodes);
+		snapshot.read(released);
+	}
+};
+
+#endif /* ARENA_H_ */
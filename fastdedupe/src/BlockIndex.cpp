@@ -0,0 +1,138 @@
+/*
+ * BlockIndex.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "BlockIndex.h"
+
+#include <algorithm>
+#include <string>
+
+#include "FlatHashMap.h"
+
+using std::string;
+using std::vector;
+
+BlockIndex::BlockIndex(FileCatalog & catalog, uint32_t blockSize) :
+	catalog(catalog),
+	blockSize(blockSize) {
+}
+
+BlockIndex::~BlockIndex() {
+}
+
+void BlockIndex::add(FileId file, const BlockHashes & blocks) {
+	if (blocks.blockSize != blockSize || blocks.hashes.empty())
+		return;
+
+	layouts.push_back(Layout{file, hashes.size(), blocks.hashes.size()});
+	hashes.insert(hashes.end(), blocks.hashes.begin(), blocks.hashes.end());
+}
+
+size_t BlockIndex::size() const {
+	return layouts.size();
+}
+
+void BlockIndex::match(vector<RangeAction> & ranges) const {
+	vector<uint32_t> order(layouts.size());
+	FlatHashMap<BlockRef> firstSeen;
+	vector<char> zeros(blockSize, 0);
+	uint64_t zeroHash = Hasher::getHasher()
+			.hashFromBytes(zeros.data(), zeros.size()).getValue();
+
+	for (uint32_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [this] (uint32_t a, uint32_t b) {
+		return catalog.getFilename(layouts[a].file) <
+				catalog.getFilename(layouts[b].file);
+	});
+
+	firstSeen.reserve(hashes.size());
+
+	for (uint32_t layout : order) {
+		const Layout & info = layouts[layout];
+		const Hash & dataHash = catalog.getDataHash(info.file);
+		//Source layout and next blocks of the open range
+		uint32_t openLayout = UINT32_MAX;
+		uint64_t openSource = 0, openDestination = 0;
+
+		for (size_t block = 0; block < info.count; block++) {
+			uint64_t blockHash = hashes[info.first + block];
+
+			if (blockHash == zeroHash) {
+				openLayout = UINT32_MAX;
+				continue;
+			}
+
+			BlockRef & ref = firstSeen[blockHash];
+			if (ref.layout == 0) {
+				ref = BlockRef{layout + 1, (uint32_t) block};
+				openLayout = UINT32_MAX;
+				continue;
+			}
+
+			uint32_t source = ref.layout - 1;
+			if (source == layout ||
+					catalog.getDataHash(layouts[source].file) == dataHash) {
+				openLayout = UINT32_MAX;
+				continue;
+			}
+
+			if (source == openLayout && ref.block == openSource &&
+					block == openDestination) {
+				ranges.back().length += blockSize;
+			} else {
+				ranges.push_back(RangeAction{layouts[source].file,
+					(uint64_t) ref.block * blockSize, info.file,
+					(uint64_t) block * blockSize, blockSize});
+				openLayout = source;
+			}
+
+			openSource = ref.block + 1;
+			openDestination = block + 1;
+		}
+	}
+}
+
+const FiemapData * BlockIndex::findExtent(const vector<FiemapData> & extents,
+		uint64_t logical) {
+	auto it = std::upper_bound(extents.begin(), extents.end(), logical,
+			[] (uint64_t offset, const FiemapData & extent) {
+		return offset < extent.logical;
+	});
+
+	if (it == extents.begin())
+		return NULL;
+
+	--it;
+	if (logical >= it->logical + it->length)
+		return NULL;
+
+	return &*it;
+}
+
+bool BlockIndex::isShared(const vector<FiemapData> & source,
+		uint64_t sourceOffset, const vector<FiemapData> & destination,
+		uint64_t destinationOffset, uint64_t length) {
+	for (uint64_t done = 0; done < length; ) {
+		const FiemapData * from = findExtent(source, sourceOffset + done);
+		const FiemapData * to = findExtent(destination,
+				destinationOffset + done);
+
+		if (from == NULL || to == NULL)
+			return false;
+
+		uint64_t fromSkip = sourceOffset + done - from->logical;
+		uint64_t toSkip = destinationOffset + done - to->logical;
+
+		if (from->physical + fromSkip != to->physical + toSkip)
+			return false;
+
+		done += std::min(std::min(from->length - fromSkip,
+				to->length - toSkip), length - done);
+	}
+
+	return true;
+}
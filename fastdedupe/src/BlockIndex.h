@@ -0,0 +1,75 @@
+/*
+ * BlockIndex.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef BLOCKINDEX_H_
+#define BLOCKINDEX_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "FileCatalog.h"
+#include "FilesystemHelper.h"
+#include "Hasher.h"
+
+//Byte range of destination holding the same data as one of source
+struct RangeAction {
+	FileId source;
+	uint64_t sourceOffset;
+	FileId destination;
+	uint64_t destinationOffset;
+	uint64_t length;
+};
+
+/*
+ * Matches the aligned blocks of files with different data. Every block
+ * hash remembers the first file it was seen in, files taken in path
+ * order; a later file holding the same block gets a range against it,
+ * consecutive blocks against the same file merged into one range.
+ * Blocks of zeros are left out, holes are best left alone.
+ */
+class BlockIndex {
+private:
+	struct Layout {
+		FileId file;
+		size_t first;
+		size_t count;
+	};
+
+	//Layout index stored off by one
+	struct BlockRef {
+		uint32_t layout;
+		uint32_t block;
+	};
+
+	FileCatalog & catalog;
+	const uint32_t blockSize;
+	std::vector<Layout> layouts;
+	std::vector<uint64_t> hashes;
+
+	static const FiemapData * findExtent(
+			const std::vector<FiemapData> & extents, uint64_t logical);
+
+public:
+	BlockIndex(FileCatalog & catalog, uint32_t blockSize);
+
+	virtual ~BlockIndex();
+
+	//Hashes of another block size are ignored
+	void add(FileId file, const BlockHashes & blocks);
+
+	size_t size() const;
+
+	void match(std::vector<RangeAction> & ranges) const;
+
+	//Whether both ranges already map to the same physical blocks
+	static bool isShared(const std::vector<FiemapData> & source,
+			uint64_t sourceOffset,
+			const std::vector<FiemapData> & destination,
+			uint64_t destinationOffset, uint64_t length);
+};
+
+#endif /* BLOCKINDEX_H_ */
@@ -0,0 +1,284 @@
+/*
+ * Daemon.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Daemon.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+
+using std::exception;
+using std::runtime_error;
+using std::string;
+using std::stringstream;
+
+#define DAEMON_TIMEOUT_SECONDS 30
+
+volatile sig_atomic_t Daemon::stopping = 0;
+
+static struct sockaddr_un getAddress(const string & socketPath) {
+	struct sockaddr_un address;
+
+	if (socketPath.size() >= sizeof(address.sun_path))
+		throw runtime_error("Socket path too long: '" + socketPath + "'");
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath.c_str());
+
+	return address;
+}
+
+static int connectTo(const string & socketPath) {
+	struct sockaddr_un address = getAddress(socketPath);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1)
+		throw runtime_error(string("socket: ") + strerror(errno));
+
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	return fd;
+}
+
+static void sendAll(int fd, const string & data) {
+	for (size_t sent = 0; sent < data.size(); ) {
+		ssize_t written = send(fd, data.data() + sent, data.size() - sent,
+				MSG_NOSIGNAL);
+
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written == -1)
+			throw runtime_error(string("send: ") + strerror(errno));
+		sent += written;
+	}
+}
+
+Daemon::Daemon(const string & socketPath) :
+	socketPath(socketPath),
+	listener(-1),
+	requests(0) {
+	struct sockaddr_un address = getAddress(socketPath);
+	int existing = connectTo(socketPath);
+
+	if (existing != -1) {
+		close(existing);
+		throw runtime_error("A daemon already listens on '" +
+				socketPath + "'");
+	}
+	//Left behind by a daemon that did not exit cleanly
+	unlink(socketPath.c_str());
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1)
+		throw runtime_error(string("socket: ") + strerror(errno));
+
+	//Only the owner may ask for scans and dedupes
+	mode_t mask = umask(0177);
+	int bound = bind(listener, (struct sockaddr *) &address,
+			sizeof(address));
+	umask(mask);
+
+	if (bound == -1 || listen(listener, 16) == -1) {
+		int error = errno;
+		close(listener);
+		throw runtime_error(socketPath + ": " + strerror(error));
+	}
+
+	on("shutdown", [] (const string &, JsonWriter & json) {
+		stopping = 1;
+		json.beginObject().key("ok").value(true).endObject();
+	});
+}
+
+Daemon::~Daemon() {
+	close(listener);
+	unlink(socketPath.c_str());
+}
+
+void Daemon::onSignal(int) {
+	stopping = 1;
+}
+
+void Daemon::on(const string & command, const Handler & handler) {
+	handlers[command] = handler;
+}
+
+void Daemon::onReadable(int fd, const Callback & callback) {
+	readable[fd] = callback;
+}
+
+void Daemon::onTick(const Callback & callback) {
+	ticks.push_back(callback);
+}
+
+size_t Daemon::getRequests() const {
+	return requests;
+}
+
+string Daemon::answer(const string & request) {
+	size_t separator = request.find(' ');
+	string command = request.substr(0, separator);
+	string argument = separator == string::npos ?
+			"" : request.substr(separator + 1);
+	stringstream out;
+
+	requests++;
+	try {
+		JsonWriter json(out);
+		auto handler = handlers.find(command);
+
+		if (handler == handlers.end())
+			throw std::invalid_argument("Unknown command '" + command + "'");
+		handler->second(argument, json);
+	} catch (exception & error) {
+		out.str("");
+		JsonWriter(out).beginObject().key("error").value(error.what())
+				.endObject();
+	} catch (int error) {
+		out.str("");
+		JsonWriter(out).beginObject().key("error").value(strerror(error))
+				.endObject();
+	}
+
+	//A top level object already ends its line
+	string response = out.str();
+	if (response.empty() || response.back() != '\n')
+		response += "\n";
+	return response;
+}
+
+void Daemon::serve(int connection) {
+	struct timeval timeout{DAEMON_TIMEOUT_SECONDS, 0};
+	string pending;
+	char buffer[4096];
+
+	//A client that stops talking does not hold the others up for long
+	setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			sizeof(timeout));
+	setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			sizeof(timeout));
+
+	while (! stopping) {
+		ssize_t count = recv(connection, buffer, sizeof(buffer), 0);
+
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			break;
+
+		pending.append(buffer, count);
+		for (size_t end = pending.find('\n'); end != string::npos;
+				end = pending.find('\n')) {
+			string request = pending.substr(0, end);
+
+			pending.erase(0, end + 1);
+			if (! request.empty())
+				sendAll(connection, answer(request));
+		}
+
+		if (pending.size() > DAEMON_MAX_REQUEST) {
+			stringstream out;
+
+			JsonWriter(out).beginObject().key("error")
+					.value("Request too long").endObject();
+			sendAll(connection, out.str());
+			return;
+		}
+	}
+
+	//The last request may come without its newline
+	if (! stopping && ! pending.empty())
+		sendAll(connection, answer(pending));
+}
+
+void Daemon::run() {
+	struct sigaction action;
+
+	//No SA_RESTART, poll() has to return for the flag to be seen
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	auto lastTick = std::chrono::steady_clock::now();
+
+	while (! stopping) {
+		std::vector<struct pollfd> waiting{{listener, POLLIN, 0}};
+
+		for (auto & descriptor : readable)
+			waiting.push_back({descriptor.first, POLLIN, 0});
+
+		if (poll(waiting.data(), waiting.size(), 1000) > 0) {
+			for (size_t i = 1; i < waiting.size(); i++)
+				if (waiting[i].revents)
+					readable[waiting[i].fd]();
+
+			int connection = waiting[0].revents ?
+					accept4(listener, NULL, NULL, SOCK_CLOEXEC) : -1;
+			if (connection != -1) {
+				try {
+					serve(connection);
+				} catch (exception & error) {
+					//The client went away, the next one is served anyway
+				}
+				close(connection);
+			}
+		}
+
+		if (std::chrono::steady_clock::now() - lastTick >=
+				std::chrono::seconds(1)) {
+			lastTick = std::chrono::steady_clock::now();
+			for (Callback & tick : ticks)
+				tick();
+		}
+	}
+}
+
+string Daemon::request(const string & socketPath, const string & line) {
+	int fd = connectTo(socketPath);
+	string response;
+	char buffer[4096];
+
+	if (fd == -1)
+		throw runtime_error("No daemon on '" + socketPath + "': " +
+				strerror(errno));
+
+	try {
+		sendAll(fd, line + "\n");
+		shutdown(fd, SHUT_WR);
+
+		for (ssize_t count; (count = recv(fd, buffer, sizeof(buffer), 0)); ) {
+			if (count == -1 && errno == EINTR)
+				continue;
+			if (count == -1)
+				throw runtime_error(string("recv: ") + strerror(errno));
+			response.append(buffer, count);
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+	return response;
+}
@@ -0,0 +1,74 @@
+/*
+ * Daemon.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#include <signal.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "JsonWriter.h"
+
+#define DAEMON_SOCKET_SUFFIX ".sock"
+#define DAEMON_MAX_REQUEST 65536
+
+/*
+ * Serves requests on a Unix socket, one connection at a time. A request
+ * is a line holding a command and, after the first space, its argument;
+ * the answer is one line of JSON, {"error": ...} when the handler
+ * throws. A connection may send several requests. Other descriptors and
+ * periodic work are served by the same loop, run() returns on SIGINT,
+ * SIGTERM or a "shutdown" request.
+ */
+class Daemon {
+public:
+	typedef std::function<void(const std::string & argument,
+			JsonWriter & json)> Handler;
+	typedef std::function<void()> Callback;
+private:
+	static volatile sig_atomic_t stopping;
+	const std::string socketPath;
+	int listener;
+	size_t requests;
+	std::map<std::string, Handler> handlers;
+	std::map<int, Callback> readable;
+	std::vector<Callback> ticks;
+
+	static void onSignal(int signal);
+
+	std::string answer(const std::string & request);
+
+	void serve(int connection);
+public:
+	Daemon(const std::string & socketPath);
+
+	Daemon(const Daemon &) = delete;
+
+	virtual ~Daemon();
+
+	void on(const std::string & command, const Handler & handler);
+
+	//Called from run() when fd has data, between connections
+	void onReadable(int fd, const Callback & callback);
+
+	//Called from run() about once a second
+	void onTick(const Callback & callback);
+
+	size_t getRequests() const;
+
+	void run();
+
+	//Sends one request to a running daemon and returns its answer
+	static std::string request(const std::string & socketPath,
+			const std::string & line);
+};
+
+#endif /* DAEMON_H_ */
@@ -8,93 +8,109 @@
 #ifndef DATABASE_H_
 #define DATABASE_H_
 
-#include <sqlite3.h>
-
 #include <ctime>
+#include <functional>
 #include <list>
-#include <map>
 #include <set>
 #include <string>
+#include <vector>
+
+#include "ExtentHashCache.h"
+#include "FilesystemHelper.h"
+#include "Hasher.h"
 
 class File;
-class Hash;
 class HashStore;
 
-class Database {
-private:
-	sqlite3 * conn;
-
-	sqlite3_stmt * upsertHashStmt;
-	sqlite3_stmt * insertFileStmt;
-	sqlite3_stmt * updateFileStmt;
-	sqlite3_stmt * removeHashStmt;
-	sqlite3_stmt * removeFileStmt;
-	sqlite3_stmt * getFilesStmt;
-
-	sqlite3_stmt * prepareStatement(
-			const std::string & query);
+struct FileRecord {
+	std::string filename;
+	std::time_t mTime;
+	size_t size;
+	Hash extentsHash;
+	Hash dataHash;
+	//Physical layout behind extentsHash, empty when unknown
+	std::vector<FiemapData> extents;
+	//Block hashes of the data, empty when not computed
+	BlockHashes blocks;
+	//Extents hash of the row being replaced, zero when none
+	Hash previousExtentsHash;
+	//HASH_VERSION the data hash was computed with
+	uint32_t hashVersion = HASH_VERSION;
+};
 
-	void reset(sqlite3_stmt * statement);
+class Database {
+public:
+	typedef std::function<void(const FileRecord &)> RecordCallback;
+	typedef std::function<void(const Hash &,
+			const std::vector<FiemapData> &)> ExtentsCallback;
+	typedef std::function<void(const Hash &,
+			const BlockHashes &)> BlocksCallback;
+	typedef std::function<void(const std::string &,
+			std::time_t)> VerifiedCallback;
 
-	void bind(sqlite3_stmt * statement, int index,
-			const char * raw_data, size_t length);
+	static Database * open(const std::string & filename);
 
-	template<size_t S>
-	void bind(sqlite3_stmt * statement, int index,
-			const char (&raw_data) [S]) {
-		bind(statement, index, raw_data, S);
-	}
+	virtual ~Database();
 
-	void bind(sqlite3_stmt * statement, int index,
-			const std::string & data);
+	virtual void storeRecord(const FileRecord & record,
+			bool storeHash) = 0;
 
-	void bind(sqlite3_stmt * statement, int index,
-			std::time_t data);
+	virtual void removeFile(const std::string & filename) = 0;
 
-	bool step(sqlite3_stmt * statement);
+	virtual void flush() = 0;
 
-	void blobColumn(sqlite3_stmt * statement, int index,
-			char * raw_data, size_t length);
+	virtual size_t getBacklog() const = 0;
 
-	template<size_t S>
-	void blobColumn(sqlite3_stmt * statement, int index,
-			char (&raw_data) [S]) {
-		blobColumn(statement, index, raw_data, S);
-	}
+	//Empty pattern loads every record
+	virtual void loadFiles(const std::string & pattern,
+			const RecordCallback & callback) = 0;
 
-	std::string stringColumn(sqlite3_stmt * statement,
-			int index);
+	//Every extents hash with a known physical layout
+	virtual void loadExtents(const ExtentsCallback & callback) = 0;
 
-	std::time_t timeColumn(sqlite3_stmt * statement,
-			int index);
+	//Every extents hash with known block hashes
+	virtual void loadBlocks(const BlocksCallback & callback) = 0;
 
-	void finalize(sqlite3_stmt * statement);
+	virtual void storeExtentHash(const ExtentKey & key, uint64_t hash) = 0;
 
-	void executeQuery(const std::string & query);
+	virtual void loadExtentHashes(
+			const ExtentHashCache::EntryCallback & callback) = 0;
 
-	void removeHash(const Hash & extentsHash);
-public:
-	Database(const std::string & filename);
-	virtual ~Database();
+	//Also forgets every extent hash
+	virtual void cleanHashes() = 0;
 
-	void beginTransaction();
+	//btrfs generation the files under root were last brought up to
+	virtual void storeGeneration(const std::string & root,
+			const BtrfsGeneration & generation) = 0;
 
-	void endTransaction();
+	virtual bool loadGeneration(const std::string & root,
+			BtrfsGeneration & generation) = 0;
 
-	void upsertHash(const Hash & extentsHash,
-			const Hash & dataHash);
+	//When path, a file or a whole subtree, was last checked; 0 forgets it
+	virtual void storeVerified(const std::string & path,
+			std::time_t time) = 0;
 
-	void insertFile(const File * file);
+	//Every path stored below root
+	virtual void loadVerified(const std::string & root,
+			const VerifiedCallback & callback) = 0;
 
-	void updateFile(const File * file);
+	/*
+	 * Stamp of the stored records, changing with every write. Empty once
+	 * another process wrote since the first call, what this one holds
+	 * in memory may then be behind.
+	 */
+	virtual std::string getVersion() = 0;
 
-	void removeFile(const std::string & filename);
+	void storeFile(const File & file, bool storeHash,
+			const std::vector<FiemapData> & extents,
+			const BlockHashes & blocks = BlockHashes{0, {}},
+			const Hash & previousExtentsHash = Hash());
 
-	void updateFiles(std::map <std::string, File> & files,
+	void updateFiles(HashStore & hs,
 			std::list<std::string> & ignored,
 			const std::set<std::string> & patterns);
 
-	void cleanHashes();
+	size_t copyTo(Database & destination);
 };
 
 #endif /* DATABASE_H_ */
@@ -0,0 +1,304 @@
+/*
+ * DedupePlanner.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "DedupePlanner.h"
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "FilesystemHelper.h"
+
+using std::exception;
+using std::string;
+using std::vector;
+
+DedupePlanner::DedupePlanner(HashStore & hs,
+		const ExtentsIndex * layouts) :
+	hs(hs),
+	catalog(hs.getCatalog()),
+	layouts(layouts) {
+}
+
+DedupePlanner::~DedupePlanner() {
+}
+
+bool DedupePlanner::lowerPriority(const HashStore::DuplicateHash & a,
+		const HashStore::DuplicateHash & b) {
+	if (a.bytes != b.bytes)
+		return a.bytes < b.bytes;
+	return b.dataHash < a.dataHash;
+}
+
+size_t DedupePlanner::getExtentCount(FileId file) const {
+	if (layouts) {
+		size_t count;
+
+		//Unknown layouts stay usable but lose every comparison
+		if (layouts->find(catalog.getExtentsHash(file), count) == NULL)
+			return SIZE_MAX - 1;
+
+		return count;
+	}
+
+	try {
+		return FilesystemHelper::getFilesystemHelper()
+				.getFiemapData(catalog.getFilename(file),
+						catalog.getSize(file)).size();
+	} catch (exception & error) {
+		return SIZE_MAX;
+	}
+}
+
+uint64_t DedupePlanner::getLayoutBytes(const Hash & extentsHash) const {
+	size_t count;
+	const FiemapData * ranges = layouts ?
+			layouts->find(extentsHash, count) : NULL;
+	uint64_t total = 0;
+
+	for (size_t i = 0; ranges && i < count; i++)
+		total += ranges[i].length;
+
+	return total;
+}
+
+FileId DedupePlanner::getSource(const vector<FileId> & files) const {
+	FileId source = files.front();
+	string sourceName = catalog.getFilename(source);
+
+	for (FileId file : files) {
+		string filename = catalog.getFilename(file);
+		if (filename < sourceName) {
+			source = file;
+			sourceName = filename;
+		}
+	}
+
+	return source;
+}
+
+bool DedupePlanner::isPinned(FileId file) const {
+	return catalog.hasFlag(file, FileCatalog::REFERENCE) ||
+			catalog.hasFlag(file, FileCatalog::SUBTREE_SOURCE);
+}
+
+bool DedupePlanner::planGroup(HashStore::DuplicateGroup & group,
+		DedupeAction & action) const {
+	//Copies planned with their directory are left to it
+	for (vector<FileId> & files : group)
+		files.erase(std::remove_if(files.begin(), files.end(),
+				[this] (FileId file) {
+			return catalog.hasFlag(file, FileCatalog::SUBTREE_COPY);
+		}), files.end());
+	group.erase(std::remove_if(group.begin(), group.end(),
+			[] (const vector<FileId> & files) {
+		return files.empty();
+	}), group.end());
+
+	if (group.size() < 2)
+		return false;
+
+	size_t reference = SIZE_MAX;
+	size_t referenceExtents = SIZE_MAX;
+	bool referencePinned = false;
+	FileId source = NO_FILE;
+
+	//Files sharing extents are equally fragmented, one probe each
+	for (size_t i = 0; i < group.size(); i++) {
+		FileId candidate = getSource(group[i]);
+		size_t extents = getExtentCount(candidate);
+		bool pinned = std::any_of(group[i].begin(), group[i].end(),
+				[this] (FileId file) {
+			return isPinned(file);
+		});
+
+		if (extents == SIZE_MAX)
+			continue;
+
+		bool better = pinned != referencePinned ? pinned :
+				extents < referenceExtents ||
+				(extents == referenceExtents &&
+						(group[i].size() > group[reference].size() ||
+						(group[i].size() == group[reference].size() &&
+						catalog.getFilename(candidate) <
+						catalog.getFilename(source))));
+
+		if (better) {
+			reference = i;
+			referenceExtents = extents;
+			referencePinned = pinned;
+			source = candidate;
+		}
+	}
+
+	if (reference == SIZE_MAX)
+		return false;
+
+	//The database does not always know sizes, the layout does
+	uint64_t size = catalog.getSize(source);
+	if (size == 0)
+		size = getLayoutBytes(catalog.getExtentsHash(source));
+
+	action = DedupeAction{source, {}, referenceExtents, 0, 0, false};
+
+	//Every other copy is freed once all of its files are deduped
+	for (size_t i = 0; i < group.size(); i++) {
+		bool freed = i != reference;
+
+		for (FileId file : group[i]) {
+			if (isPinned(file))
+				freed = false;
+			else if (i != reference)
+				action.destinations.push_back(file);
+		}
+
+		if (freed)
+			action.expectedBytes += size;
+	}
+	action.freedBytes = action.expectedBytes;
+
+	return ! action.destinations.empty();
+}
+
+void DedupePlanner::start() {
+	queue.clear();
+	hs.getDuplicateHashes(queue);
+	std::make_heap(queue.begin(), queue.end(), lowerPriority);
+}
+
+bool DedupePlanner::next(DedupeAction & action) {
+	HashStore::DuplicateGroup group;
+
+	while (! queue.empty()) {
+		std::pop_heap(queue.begin(), queue.end(), lowerPriority);
+		Hash dataHash = queue.back().dataHash;
+		queue.pop_back();
+
+		if (hs.getDuplicateGroup(dataHash, group) &&
+				planGroup(group, action))
+			return true;
+	}
+
+	return false;
+}
+
+size_t DedupePlanner::pending() const {
+	return queue.size();
+}
+
+void DedupePlanner::plan(vector<DedupeAction> & actions) {
+	DedupeAction action;
+
+	for (start(); next(action); )
+		actions.push_back(std::move(action));
+
+	std::sort(actions.begin(), actions.end(),
+			[this] (const DedupeAction & a, const DedupeAction & b) {
+		if (a.expectedBytes != b.expectedBytes)
+			return a.expectedBytes > b.expectedBytes;
+		return catalog.getFilename(a.source) <
+				catalog.getFilename(b.source);
+	});
+}
+
+/*
+ * Sweeps the physical ranges of every known layout in offset order. A
+ * byte is freed when every range covering it belongs to a copy that is
+ * going to be deduped; a reference copy or a layout outside the plan
+ * keeps it. Bytes shared by copies of several actions are credited to
+ * the first of them. Physical offsets are compared as they are, which
+ * assumes one filesystem per database.
+ */
+void DedupePlanner::estimateSavings(vector<DedupeAction> & actions) const {
+	struct Event {
+		uint64_t offset;
+		int32_t delta;
+		uint32_t action;
+	};
+
+	//Action index times two plus one for references, off by one
+	FlatHashMap<uint32_t> roles;
+	vector<uint64_t> freed(actions.size(), 0);
+	vector<Event> events;
+
+	for (size_t i = 0; i < actions.size(); i++) {
+		DedupeAction & action = actions[i];
+		size_t count;
+
+		action.exact = layouts->find(
+				catalog.getExtentsHash(action.source), count) != NULL;
+		roles[catalog.getExtentsHash(action.source).getValue()] =
+				i * 2 + 2;
+
+		for (FileId file : action.destinations) {
+			const Hash & extentsHash = catalog.getExtentsHash(file);
+
+			if (layouts->find(extentsHash, count) == NULL)
+				action.exact = false;
+			roles[extentsHash.getValue()] = i * 2 + 1;
+		}
+	}
+
+	//A copy still holding a reference file keeps its bytes
+	for (FileId file = 0; file < catalog.size(); file++)
+		if (catalog.hasFlag(file, FileCatalog::REFERENCE))
+			roles.erase(catalog.getExtentsHash(file).getValue());
+
+	layouts->forEach([&] (const Hash & extentsHash,
+			const FiemapData * ranges, size_t count) {
+		const uint32_t * role = roles.find(extentsHash.getValue());
+		uint32_t action = role && (*role - 1) % 2 == 0 ?
+				(*role - 1) / 2 : UINT32_MAX;
+
+		for (size_t i = 0; i < count; i++) {
+			if (ranges[i].length == 0)
+				continue;
+
+			events.push_back(Event{ranges[i].physical, 1, action});
+			events.push_back(Event{ranges[i].physical + ranges[i].length,
+				-1, action});
+		}
+	});
+
+	std::sort(events.begin(), events.end(),
+			[] (const Event & a, const Event & b) {
+		return a.offset < b.offset;
+	});
+
+	std::map<uint32_t, uint32_t> freeing;
+	size_t keeping = 0;
+
+	for (size_t i = 0; i < events.size(); ) {
+		uint64_t offset = events[i].offset;
+
+		for (; i < events.size() && events[i].offset == offset; i++) {
+			const Event & event = events[i];
+
+			if (event.action == UINT32_MAX) {
+				keeping += event.delta;
+			} else if (event.delta > 0) {
+				freeing[event.action]++;
+			} else if (--freeing[event.action] == 0) {
+				freeing.erase(event.action);
+			}
+		}
+
+		if (i < events.size() && keeping == 0 && ! freeing.empty())
+			freed[freeing.begin()->first] += events[i].offset - offset;
+	}
+
+	for (size_t i = 0; i < actions.size(); i++)
+		if (actions[i].exact)
+			actions[i].freedBytes = freed[i];
+
+	std::stable_sort(actions.begin(), actions.end(),
+			[] (const DedupeAction & a, const DedupeAction & b) {
+		return a.freedBytes > b.freedBytes;
+	});
+}
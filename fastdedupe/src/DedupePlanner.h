@@ -0,0 +1,89 @@
+/*
+ * DedupePlanner.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef DEDUPEPLANNER_H_
+#define DEDUPEPLANNER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "ExtentsIndex.h"
+#include "FileCatalog.h"
+#include "HashStore.h"
+
+struct DedupeAction {
+	FileId source;
+	std::vector<FileId> destinations;
+	size_t extentCount;
+	//Size times the number of other copies
+	uint64_t expectedBytes;
+	//Physical bytes released, see estimateSavings
+	uint64_t freedBytes;
+	bool exact;
+	//Index of the SubtreeAction it was expanded from
+	size_t subtree = SIZE_MAX;
+};
+
+/*
+ * Turns the duplicate groups of a HashStore into dedupe actions. The
+ * reference copy of each group is the least fragmented one, so every
+ * destination ends up sharing the fewest extents; ties go to the copy
+ * with most files, which needs the fewest ioctls, then to the lowest
+ * path so reruns pick the same source. Actions come ordered by the
+ * bytes they are expected to free, largest first. Files flagged as
+ * references or as the source of a subtree are never deduped, so a copy
+ * holding one is preferred as the reference copy over any other; files
+ * planned as the copy of a subtree are left out.
+ *
+ * start and next produce the same actions lazily: only the data hash
+ * and size of each duplicate group is kept, in a heap by bytes held by
+ * the extra copies, and a group is read from the HashStore and planned
+ * when it is reached. A bounded run can stop at any point without the
+ * whole plan ever being in memory.
+ *
+ * Given the stored layouts the planner works from the database alone:
+ * extent counts come from the layouts instead of FIEMAP, and the
+ * bytes freed can be computed exactly from the physical ranges.
+ */
+class DedupePlanner {
+private:
+	HashStore & hs;
+	FileCatalog & catalog;
+	const ExtentsIndex * layouts;
+	std::vector<HashStore::DuplicateHash> queue;
+
+	static bool lowerPriority(const HashStore::DuplicateHash & a,
+			const HashStore::DuplicateHash & b);
+
+	size_t getExtentCount(FileId file) const;
+
+	uint64_t getLayoutBytes(const Hash & extentsHash) const;
+
+	FileId getSource(const std::vector<FileId> & files) const;
+
+	bool isPinned(FileId file) const;
+
+	bool planGroup(HashStore::DuplicateGroup & group,
+			DedupeAction & action) const;
+
+public:
+	DedupePlanner(HashStore & hs, const ExtentsIndex * layouts = NULL);
+
+	virtual ~DedupePlanner();
+
+	void start();
+
+	bool next(DedupeAction & action);
+
+	size_t pending() const;
+
+	void plan(std::vector<DedupeAction> & actions);
+
+	void estimateSavings(std::vector<DedupeAction> & actions) const;
+};
+
+#endif /* DEDUPEPLANNER_H_ */
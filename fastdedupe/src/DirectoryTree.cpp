@@ -0,0 +1,266 @@
+/*
+ * DirectoryTree.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "DirectoryTree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <utility>
+
+#include "FilesystemHelper.h"
+
+using std::set;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#define NO_NODE UINT32_MAX
+
+DirectoryTree::DirectoryTree(FileCatalog & catalog,
+		const set<string> & roots) :
+	catalog(catalog) {
+	//Most files share their directory with the previous one
+	vector<uint32_t> byDirectory(catalog.getDirectoryCount(), NO_NODE);
+
+	for (FileId id = 0; id < catalog.size(); id++) {
+		if (catalog.hasFlag(id, FileCatalog::REMOVED) ||
+				catalog.hasFlag(id, FileCatalog::REFERENCE))
+			continue;
+
+		uint32_t & node = byDirectory[catalog.getDirectoryIndex(id)];
+		if (node == NO_NODE) {
+			const string & directory = catalog.getDirectory(id);
+
+			if (! FilesystemHelper::isUnder(directory, roots))
+				continue;
+			node = getNode(directory, roots);
+		}
+
+		nodes[node].files.push_back(id);
+	}
+
+	for (uint32_t node = 0; node < nodes.size(); node++)
+		if (nodes[node].parent == NO_NODE)
+			hashNode(node);
+}
+
+DirectoryTree::~DirectoryTree() {
+}
+
+uint32_t DirectoryTree::getNode(const string & path,
+		const set<string> & roots) {
+	auto it = byPath.find(path);
+
+	if (it != byPath.end())
+		return it->second;
+
+	uint32_t node = nodes.size();
+	byPath.emplace(path, node);
+	nodes.emplace_back(Node{path, NO_NODE, {}, {}, Hash(), Hash(),
+		0, 0, true});
+
+	size_t slash = path.rfind('/');
+	if (slash != string::npos && slash > 0) {
+		string parentPath = path.substr(0, slash);
+
+		if (FilesystemHelper::isUnder(parentPath, roots)) {
+			uint32_t parent = getNode(parentPath, roots);
+			nodes[node].parent = parent;
+			nodes[parent].children.push_back(node);
+		}
+	}
+
+	return node;
+}
+
+/*
+ * Entries are hashed in name order, files then subdirectories, each as
+ * its name, a terminating zero and the hash of its contents.
+ */
+void DirectoryTree::hashNode(uint32_t node) {
+	for (uint32_t child : nodes[node].children)
+		hashNode(child);
+
+	Node & info = nodes[node];
+	string dataBytes, extentsBytes;
+	char raw [HASH_LENGTH];
+
+	std::sort(info.files.begin(), info.files.end(),
+			[this] (FileId a, FileId b) {
+		return strcmp(catalog.getName(a), catalog.getName(b)) < 0;
+	});
+	std::sort(info.children.begin(), info.children.end(),
+			[this] (uint32_t a, uint32_t b) {
+		return nodes[a].path < nodes[b].path;
+	});
+
+	for (FileId file : info.files) {
+		const char * name = catalog.getName(file);
+
+		info.complete &= catalog.hasFlag(file, FileCatalog::CLEAN);
+		info.fileCount++;
+		info.bytes += catalog.getSize(file);
+
+		dataBytes.append(name, strlen(name) + 1);
+		catalog.getDataHash(file).getBinHash(raw);
+		dataBytes.append(raw, HASH_LENGTH);
+
+		extentsBytes.append(name, strlen(name) + 1);
+		catalog.getExtentsHash(file).getBinHash(raw);
+		extentsBytes.append(raw, HASH_LENGTH);
+	}
+
+	for (uint32_t child : info.children) {
+		const Node & childInfo = nodes[child];
+		const char * name = childInfo.path.c_str() +
+				childInfo.path.rfind('/') + 1;
+
+		info.complete &= childInfo.complete;
+		info.fileCount += childInfo.fileCount;
+		info.bytes += childInfo.bytes;
+
+		dataBytes.append(name, strlen(name) + 1);
+		childInfo.dataHash.getBinHash(raw);
+		dataBytes.append(raw, HASH_LENGTH);
+
+		extentsBytes.append(name, strlen(name) + 1);
+		childInfo.extentsHash.getBinHash(raw);
+		extentsBytes.append(raw, HASH_LENGTH);
+	}
+
+	Hasher & hasher = Hasher::getHasher();
+	info.dataHash = hasher.hashFromBytes(dataBytes.data(), dataBytes.size());
+	info.extentsHash = hasher.hashFromBytes(extentsBytes.data(),
+			extentsBytes.size());
+}
+
+size_t DirectoryTree::size() const {
+	return nodes.size();
+}
+
+const string & DirectoryTree::getPath(uint32_t node) const {
+	return nodes[node].path;
+}
+
+/*
+ * Only the topmost identical directories are planned: a member sitting
+ * in a directory that is itself duplicated is covered by the group
+ * above, it may be the source but never a destination, and a group of
+ * covered members only is left out. The source is then the copy whose
+ * extents most members already share, then the lowest path.
+ */
+void DirectoryTree::plan(vector<SubtreeAction> & actions) const {
+	unordered_map<uint64_t, vector<uint32_t>> byData;
+
+	for (uint32_t node = 0; node < nodes.size(); node++)
+		if (nodes[node].complete && nodes[node].fileCount)
+			byData[nodes[node].dataHash.getValue()].push_back(node);
+
+	auto isDuplicated = [this, &byData] (uint32_t node) {
+		if (node == NO_NODE || ! nodes[node].complete)
+			return false;
+
+		auto it = byData.find(nodes[node].dataHash.getValue());
+		return it != byData.end() && it->second.size() > 1;
+	};
+
+	for (auto & entry : byData) {
+		vector<uint32_t> group = entry.second;
+
+		auto isCovered = [this, &isDuplicated] (uint32_t node) {
+			return isDuplicated(nodes[node].parent);
+		};
+
+		if (group.size() < 2 ||
+				std::all_of(group.begin(), group.end(), isCovered))
+			continue;
+
+		std::sort(group.begin(), group.end(),
+				[this] (uint32_t a, uint32_t b) {
+			return nodes[a].path < nodes[b].path;
+		});
+
+		std::map<uint64_t, size_t> sharing;
+		uint32_t source = group.front();
+
+		for (uint32_t node : group)
+			sharing[nodes[node].extentsHash.getValue()]++;
+		for (uint32_t node : group)
+			if (isCovered(node) != isCovered(source) ? isCovered(node) :
+					sharing[nodes[node].extentsHash.getValue()] >
+					sharing[nodes[source].extentsHash.getValue()])
+				source = node;
+
+		SubtreeAction action{source, {}, nodes[source].fileCount, 0};
+		for (uint32_t node : group) {
+			if (nodes[node].extentsHash == nodes[source].extentsHash ||
+					isCovered(node))
+				continue;
+
+			action.destinations.push_back(node);
+			action.expectedBytes += nodes[node].bytes;
+		}
+
+		if (action.destinations.size())
+			actions.push_back(action);
+	}
+
+	std::sort(actions.begin(), actions.end(),
+			[this] (const SubtreeAction & a, const SubtreeAction & b) {
+		if (a.expectedBytes != b.expectedBytes)
+			return a.expectedBytes > b.expectedBytes;
+		return nodes[a.source].path < nodes[b.source].path;
+	});
+}
+
+//Identical directories list their entries in the same order
+void DirectoryTree::expand(uint32_t source,
+		const vector<uint32_t> & destinations,
+		vector<DedupeAction> & actions) const {
+	const Node & info = nodes[source];
+	vector<uint32_t> pending;
+
+	for (uint32_t destination : destinations)
+		if (nodes[destination].extentsHash != info.extentsHash)
+			pending.push_back(destination);
+
+	if (pending.empty())
+		return;
+
+	for (size_t i = 0; i < info.files.size(); i++) {
+		FileId file = info.files[i];
+		DedupeAction action{file, {}, 0, 0, 0, false};
+
+		for (uint32_t destination : pending) {
+			FileId copy = nodes[destination].files[i];
+
+			if (catalog.getExtentsHash(copy) != catalog.getExtentsHash(file)) {
+				action.destinations.push_back(copy);
+				action.expectedBytes += catalog.getSize(copy);
+			}
+		}
+
+		if (action.destinations.size()) {
+			action.freedBytes = action.expectedBytes;
+			actions.push_back(std::move(action));
+		}
+	}
+
+	vector<uint32_t> children(pending.size());
+	for (size_t i = 0; i < info.children.size(); i++) {
+		for (size_t j = 0; j < pending.size(); j++)
+			children[j] = nodes[pending[j]].children[i];
+
+		expand(info.children[i], children, actions);
+	}
+}
+
+void DirectoryTree::expand(const SubtreeAction & action,
+		vector<DedupeAction> & actions) const {
+	expand(action.source, action.destinations, actions);
+}
@@ -0,0 +1,84 @@
+/*
+ * DirectoryTree.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef DIRECTORYTREE_H_
+#define DIRECTORYTREE_H_
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DedupePlanner.h"
+#include "FileCatalog.h"
+#include "Hasher.h"
+
+//Identical directories deduped as one unit, nodes of a DirectoryTree
+struct SubtreeAction {
+	uint32_t source;
+	std::vector<uint32_t> destinations;
+	size_t files;
+	//Size of the subtree times the number of destinations
+	uint64_t expectedBytes;
+};
+
+/*
+ * Merkle hashes of the directories under a set of roots, built from the
+ * catalog. A directory hashes the names and data hashes of its files
+ * and the names and hashes of its subdirectories, so two directories
+ * with the same hash hold the same names with the same data all the way
+ * down. A second hash over the extents hashes tells apart the copies
+ * already sharing their extents.
+ *
+ * Only indexed files are part of the hashes: directories that differ in
+ * files too small to be indexed still match, dedupe stays per file.
+ */
+class DirectoryTree {
+private:
+	struct Node {
+		std::string path;
+		uint32_t parent;
+		std::vector<uint32_t> children;
+		std::vector<FileId> files;
+		Hash dataHash;
+		Hash extentsHash;
+		size_t fileCount;
+		uint64_t bytes;
+		//Every file below has its hashes
+		bool complete;
+	};
+
+	FileCatalog & catalog;
+	std::vector<Node> nodes;
+	std::unordered_map<std::string, uint32_t> byPath;
+
+	uint32_t getNode(const std::string & path,
+			const std::set<std::string> & roots);
+
+	void hashNode(uint32_t node);
+
+	void expand(uint32_t source, const std::vector<uint32_t> & destinations,
+			std::vector<DedupeAction> & actions) const;
+
+public:
+	DirectoryTree(FileCatalog & catalog,
+			const std::set<std::string> & roots);
+
+	virtual ~DirectoryTree();
+
+	size_t size() const;
+
+	const std::string & getPath(uint32_t node) const;
+
+	void plan(std::vector<SubtreeAction> & actions) const;
+
+	void expand(const SubtreeAction & action,
+			std::vector<DedupeAction> & actions) const;
+};
+
+#endif /* DIRECTORYTREE_H_ */
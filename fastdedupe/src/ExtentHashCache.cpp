@@ -0,0 +1,177 @@
+/*
+ * ExtentHashCache.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "ExtentHashCache.h"
+
+#include <linux/fiemap.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <exception>
+
+#include "FilesystemHelper.h"
+#include "Hasher.h"
+
+using std::exception;
+using std::string;
+using std::vector;
+
+//Extents whose physical range does not tell their content
+const uint32_t UNCACHEABLE_EXTENT = FIEMAP_EXTENT_UNKNOWN |
+		FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+		FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |
+		FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL |
+		FIEMAP_EXTENT_UNWRITTEN;
+
+ExtentHashCache::ExtentHashCache() {
+}
+
+ExtentHashCache::~ExtentHashCache() {
+}
+
+uint64_t ExtentHashCache::getSlot(const ExtentKey & key) {
+	return Hasher::getHasher().hashFromBytes((const char *) &key,
+			sizeof(key)).getValue();
+}
+
+void ExtentHashCache::getKeys(const string & filename,
+		vector<ExtentKey> & keys, vector<ExtentKey> * unshared) {
+	struct stat statData;
+	vector<uint32_t> flags;
+	vector<FiemapData> extents;
+
+	keys.clear();
+	if (unshared)
+		unshared->clear();
+
+	if (stat(filename.c_str(), &statData) != 0)
+		return;
+
+	try {
+		extents = FilesystemHelper::getFilesystemHelper()
+				.getFiemapData(filename, statData.st_size, &flags);
+	} catch (exception & error) {
+		return;
+	}
+
+	if (! unshared && std::none_of(flags.begin(), flags.end(),
+			[] (uint32_t flag) {
+		return flag & FIEMAP_EXTENT_SHARED;
+	}))
+		return;
+
+	uint64_t size = statData.st_size;
+	size_t extent = 0;
+
+	for (uint64_t offset = 0; offset < size; offset += HASHER_BUFFER_SIZE) {
+		uint64_t length = std::min<uint64_t>(HASHER_BUFFER_SIZE,
+				size - offset);
+		ExtentKey key{0, 0, 0};
+
+		while (extent < extents.size() &&
+				extents[extent].logical + extents[extent].length <= offset)
+			extent++;
+
+		if (extent < extents.size() &&
+				extents[extent].logical <= offset &&
+				offset + length <=
+				extents[extent].logical + extents[extent].length &&
+				! (flags[extent] & UNCACHEABLE_EXTENT))
+			key = ExtentKey{(uint64_t) statData.st_dev,
+				extents[extent].physical + offset - extents[extent].logical,
+				length};
+
+		if (key.length && ! (flags[extent] & FIEMAP_EXTENT_SHARED)) {
+			//Its blocks may have been freed and written again since
+			if (unshared)
+				unshared->push_back(key);
+			key = ExtentKey{0, 0, 0};
+		}
+		keys.push_back(key);
+	}
+
+	if (std::none_of(keys.begin(), keys.end(), [] (const ExtentKey & key) {
+		return key.length;
+	}))
+		keys.clear();
+}
+
+bool ExtentHashCache::find(const ExtentKey & key, uint64_t & hash) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	const Entry * entry = entries.find(getSlot(key));
+
+	if (entry == NULL || entry->key.device != key.device ||
+			entry->key.physical != key.physical ||
+			entry->key.length != key.length)
+		return false;
+
+	hash = entry->hash;
+	return true;
+}
+
+void ExtentHashCache::insert(const ExtentKey & key, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (hash)
+		entries[getSlot(key)] = Entry{key, hash};
+	else
+		entries.erase(getSlot(key));
+}
+
+void ExtentHashCache::remove(const ExtentKey & key) {
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t slot = getSlot(key);
+	const Entry * entry = entries.find(slot);
+
+	if (entry == NULL || entry->key.device != key.device ||
+			entry->key.physical != key.physical ||
+			entry->key.length != key.length)
+		return;
+
+	entries.erase(slot);
+	added.push_back(Entry{key, 0});
+}
+
+void ExtentHashCache::add(const ExtentKey & key, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	entries[getSlot(key)] = Entry{key, hash};
+	added.push_back(Entry{key, hash});
+}
+
+void ExtentHashCache::takeAdded(const EntryCallback & callback) {
+	vector<Entry> taken;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		taken.swap(added);
+	}
+
+	for (const Entry & entry : taken)
+		callback(entry.key, entry.hash);
+}
+
+void ExtentHashCache::forEach(const EntryCallback & callback) const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	entries.forEach([&callback] (uint64_t, const Entry & entry) {
+		callback(entry.key, entry.hash);
+	});
+}
+
+size_t ExtentHashCache::size() const {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return entries.size();
+}
+
+void ExtentHashCache::clear() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	entries = FlatHashMap<Entry>();
+	added.clear();
+}
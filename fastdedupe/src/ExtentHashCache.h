@@ -0,0 +1,86 @@
+/*
+ * ExtentHashCache.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef EXTENTHASHCACHE_H_
+#define EXTENTHASHCACHE_H_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FlatHashMap.h"
+
+//Where a chunk of data lives, length zero when it cannot be cached
+struct ExtentKey {
+	uint64_t device;
+	uint64_t physical;
+	uint64_t length;
+};
+
+/*
+ * Content hashes of chunks read from shared physical extents. Files are
+ * hashed in chunks of HASHER_BUFFER_SIZE, and a chunk lying inside one
+ * shared extent is looked up by its device and physical range before
+ * being read: reflink copies and snapshots with small edits only read
+ * what they do not share.
+ *
+ * Shared extents cannot be written in place, but their blocks may be
+ * freed and reused once no file shares them anymore. Entries of a range
+ * seen unshared are dropped, as are those of files a dedupe finds to
+ * differ; --gc drops the whole cache.
+ */
+class ExtentHashCache {
+public:
+	typedef std::function<void(const ExtentKey &, uint64_t)> EntryCallback;
+
+private:
+	struct Entry {
+		ExtentKey key;
+		uint64_t hash;
+	};
+
+	mutable std::mutex mutex;
+	FlatHashMap<Entry> entries;
+	//Added while hashing and not stored yet
+	std::vector<Entry> added;
+
+	static uint64_t getSlot(const ExtentKey & key);
+
+public:
+	ExtentHashCache();
+
+	virtual ~ExtentHashCache();
+
+	//Keys of every chunk of a file, empty when nothing is shared;
+	//unshared gets those of the chunks in extents not shared
+	static void getKeys(const std::string & filename,
+			std::vector<ExtentKey> & keys,
+			std::vector<ExtentKey> * unshared = NULL);
+
+	bool find(const ExtentKey & key, uint64_t & hash) const;
+
+	//Entries loaded from a database, hash 0 forgets one
+	void insert(const ExtentKey & key, uint64_t hash);
+
+	//Also handed to takeAdded with hash 0 when it was there
+	void remove(const ExtentKey & key);
+
+	//Entries found while hashing, also kept for takeAdded
+	void add(const ExtentKey & key, uint64_t hash);
+
+	void takeAdded(const EntryCallback & callback);
+
+	void forEach(const EntryCallback & callback) const;
+
+	size_t size() const;
+
+	void clear();
+};
+
+#endif /* EXTENTHASHCACHE_H_ */
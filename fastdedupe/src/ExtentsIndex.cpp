@@ -0,0 +1,52 @@
+/*
+ * ExtentsIndex.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "ExtentsIndex.h"
+
+using std::vector;
+
+ExtentsIndex::ExtentsIndex() {
+}
+
+ExtentsIndex::~ExtentsIndex() {
+}
+
+void ExtentsIndex::add(const Hash & extentsHash,
+		const vector<FiemapData> & extents) {
+	uint32_t & stored = byHash[extentsHash.getValue()];
+
+	if (stored != 0)
+		return;
+
+	layouts.push_back(Layout{extentsHash, ranges.size(),
+		(uint32_t) extents.size()});
+	stored = layouts.size();
+	ranges.insert(ranges.end(), extents.begin(), extents.end());
+}
+
+const FiemapData * ExtentsIndex::find(const Hash & extentsHash,
+		size_t & count) const {
+	const uint32_t * stored = byHash.find(extentsHash.getValue());
+
+	if (stored == NULL)
+		return NULL;
+
+	const Layout & layout = layouts[*stored - 1];
+	count = layout.count;
+
+	return ranges.data() + layout.first;
+}
+
+size_t ExtentsIndex::size() const {
+	return layouts.size();
+}
+
+size_t ExtentsIndex::memoryUsage() const {
+	return byHash.memoryUsage()
+			+ layouts.capacity() * sizeof(Layout)
+			+ ranges.capacity() * sizeof(FiemapData);
+}
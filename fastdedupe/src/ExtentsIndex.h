@@ -0,0 +1,57 @@
+/*
+ * ExtentsIndex.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef EXTENTSINDEX_H_
+#define EXTENTSINDEX_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "FilesystemHelper.h"
+#include "FlatHashMap.h"
+#include "Hasher.h"
+
+/*
+ * Physical layout of every extents hash loaded from the database, the
+ * ranges of all layouts packed in one array.
+ */
+class ExtentsIndex {
+private:
+	struct Layout {
+		Hash extentsHash;
+		uint64_t first;
+		uint32_t count;
+	};
+
+	FlatHashMap<uint32_t> byHash;
+	std::vector<Layout> layouts;
+	std::vector<FiemapData> ranges;
+public:
+	ExtentsIndex();
+
+	virtual ~ExtentsIndex();
+
+	//Layouts already known are kept
+	void add(const Hash & extentsHash,
+			const std::vector<FiemapData> & extents);
+
+	const FiemapData * find(const Hash & extentsHash,
+			size_t & count) const;
+
+	size_t size() const;
+
+	size_t memoryUsage() const;
+
+	template <typename F>
+	void forEach(F function) const {
+		for (const Layout & layout : layouts)
+			function(layout.extentsHash, ranges.data() + layout.first,
+					(size_t) layout.count);
+	}
+};
+
+#endif /* EXTENTSINDEX_H_ */
@@ -34,14 +34,14 @@ ostream & operator<<(ostream & out, const File & file) {
 	char fill = out.fill();
 
 	out
-		<<setw(30)<<left<<*file.filename<<" "
-		<<setw(10)<<right<<file.size<<" "
-		<<setw(10)<<file.mTime<<" ";
+		<<setw(30)<<left<<file.getFilename()<<" "
+		<<setw(10)<<right<<file.getSize()<<" "
+		<<setw(10)<<file.getMTime()<<" ";
 
-	if (file.clean)
+	if (file.catalog.hasFlag(file.id, FileCatalog::CLEAN))
 		out
-			<<setw(HASH_LENGTH*2)<<file.dataHash<<" "
-			<<setw(HASH_LENGTH*2)<<file.extentsHash<<"\n";
+			<<setw(HASH_LENGTH*2)<<file.getDataHash()<<" "
+			<<setw(HASH_LENGTH*2)<<file.getExtentsHash()<<"\n";
 	else
 		out
 			<<setw(HASH_LENGTH*2)<<setfill('?')<<""<<" "
@@ -53,61 +53,60 @@ ostream & operator<<(ostream & out, const File & file) {
 	return out;
 }
 
-File::File(HashStore &hs,
-		time_t mTime,
-		size_t size) :
-	hs(hs) {
-	this->mTime = mTime;
-	this->size = size;
-	clean = false;
-	newFile = true;
-	filename = NULL;
+File::File(HashStore &hs, FileId id) :
+	hs(hs),
+	catalog(hs.getCatalog()),
+	id(id) {
 }
 
-const string & File::getFilename() const {
-	return *filename;
+FileId File::getId() const {
+	return id;
 }
 
-void File::setFilename(const string & filename) {
-	this->filename = &filename;
+string File::getFilename() const {
+	return catalog.getFilename(id);
 }
 
 void File::update(std::time_t mTime,
 		const Hasher::hash & extentsHash,
-		const Hasher::hash & dataHash) {
-	newFile = false;
-	if (this->mTime == mTime) {
-		clean = true;
-		this->extentsHash = extentsHash;
-		this->dataHash = dataHash;
-
-		hs.addFileFromDb(this);
+		const Hasher::hash & dataHash,
+		uint32_t hashVersion) {
+	catalog.setFlag(id, FileCatalog::NEW_FILE, false);
+	if (catalog.getMTime(id) == mTime && hashVersion == HASH_VERSION) {
+		catalog.setFlag(id, FileCatalog::CLEAN, true);
+		catalog.setExtentsHash(id, extentsHash);
+		catalog.setDataHash(id, dataHash);
+
+		hs.addFileFromDb(id);
 	} else {
-		clean = false;
+		catalog.setFlag(id, FileCatalog::CLEAN, false);
+		//Where the stale row lives until it is replaced
+		catalog.setExtentsHash(id, extentsHash);
 	}
 }
 
 const Hash & File::getExtentsHash() const {
-	return extentsHash;
+	return catalog.getExtentsHash(id);
 }
 
 const Hash & File::getDataHash() const {
-	return dataHash;
+	return catalog.getDataHash(id);
 }
 
 time_t File::getMTime() const {
-	return mTime;
+	return catalog.getMTime(id);
 }
 
 size_t File::getSize() const {
-	return size;
+	return catalog.getSize(id);
 }
 
-hash File::getFiemapHash(string const & filename, size_t size) {
-	vector<FiemapData> extents =
-			FilesystemHelper::getFilesystemHelper()
-			.getFiemapData(filename, size);
+vector<FiemapData> File::fetchExtents() const {
+	return FilesystemHelper::getFilesystemHelper()
+			.getFiemapData(getFilename(), getSize());
+}
 
+hash File::hashExtents(const vector<FiemapData> & extents) {
 	return Hasher::getHasher()
 		.hashFromBytes(
 				(char *) &*extents.begin(),
@@ -115,59 +114,89 @@ hash File::getFiemapHash(string const & filename, size_t size) {
 }
 
 void File::update(bool updateExtents) {
-	if (!clean) {
-		extentsHash=getFiemapHash(*filename, size);
-
-		if (newFile)
-			hs.newFile(this);
+	if (!catalog.hasFlag(id, FileCatalog::CLEAN)) {
+		//Zero unless the file came from the database
+		Hash oldExtentsHash = getExtentsHash();
+		vector<FiemapData> extents = fetchExtents();
+		Hash extentsHash=hashExtents(extents);
+		catalog.setExtentsHash(id, extentsHash);
+
+		if (catalog.hasFlag(id, FileCatalog::NEW_FILE))
+			hs.newFile(id, extents);
 		else
-			hs.insertHash(this);
+			hs.insertHash(id, extents, oldExtentsHash);
 
-		dataHash=hs.getDataHash(extentsHash);
-		clean=true;
+		catalog.setDataHash(id, hs.getDataHash(extentsHash));
+		catalog.setFlag(id, FileCatalog::CLEAN, true);
 	} else if (updateExtents) {
-		Hash oldExtentsHash = extentsHash;
+		Hash oldExtentsHash = getExtentsHash();
 		try {
-			extentsHash=getFiemapHash(*filename, size);
+			vector<FiemapData> extents = fetchExtents();
+			Hash extentsHash=hashExtents(extents);
+			catalog.setExtentsHash(id, extentsHash);
 
 			if (oldExtentsHash!=extentsHash)
-				hs.updateFileExtentsOnly(this, oldExtentsHash);
+				hs.updateFileExtentsOnly(id, oldExtentsHash, extents);
 		} catch (invalid_argument & error) {
-			hs.removeFile(this);
+			hs.removeFile(id);
 			throw;
 		}
 	}
 }
 
-void File::dedupe(const set<File *> & dests,
+void File::dedupe(const vector<FileId> & dests,
 		map<string, string> & failures) {
 	set<string> filenames;
 
-	for (File * file : dests) {
-		filenames.insert(* file->filename);
+	//References come from the database, their extents may be stale
+	if (catalog.hasFlag(id, FileCatalog::REFERENCE))
+		update(true);
+
+	for (FileId dest : dests) {
+		filenames.insert(catalog.getFilename(dest));
 	}
 
 	FilesystemHelper::getFilesystemHelper()
-	.dedupe(* filename, filenames, size, failures);
+	.dedupe(getFilename(), filenames, getSize(), failures);
+
+	//Same data hash but other data: a cached chunk hash was stale, both
+	//sides are hashed again, the destinations by the check below
+	vector<FileId> rehash;
+	for (FileId dest : dests) {
+		auto failure = failures.find(catalog.getFilename(dest));
+
+		if (failure != failures.end() && failure->second == DEDUPE_DIFFERS)
+			hs.forgetData(dest, rehash);
+	}
+	if (! rehash.empty())
+		hs.forgetData(id, rehash);
+
+	set<FileId> checked(dests.begin(), dests.end());
+	for (FileId file : rehash) {
+		if (checked.count(file))
+			continue;
+		try {
+			File(hs, file).update(false);
+		} catch (invalid_argument &) {
+		}
+	}
+
+	for (FileId dest : dests) {
+		File file(hs, dest);
+		string filename = file.getFilename();
 
-	for (File * file : dests) {
 		try {
-			file->update(true);
-			if (file->extentsHash != extentsHash)
-				if (! failures.count(* file->filename))
-					failures.emplace(* file->filename,
+			file.update(true);
+			if (file.getExtentsHash() != getExtentsHash())
+				if (! failures.count(filename))
+					failures.emplace(filename,
 							"Check shows not deduped");
 
 		} catch (invalid_argument & error) {
-			if (! failures.count(* file->filename))
-				failures.emplace(* file->filename,
+			if (! failures.count(filename))
+				failures.emplace(filename,
 						"File removed");
 		}
 
 	}
 }
-
-int File::operator<(const File & b) const {
-	return filename < b.filename;
-}
-
@@ -12,38 +12,34 @@
 #include <map>
 #include <ostream>
 #include <string>
+#include <vector>
 
-
-#include "Database.h"
+#include "FileCatalog.h"
+#include "FilesystemHelper.h"
 #include "Hasher.h"
-#include "HashStore.h"
 
-class DedupeError;
 class HashStore;
 
+/*
+ * Handle on one catalog entry, the attributes themselves live in the
+ * FileCatalog columns.
+ */
 class File {
 public:
-	static Hash getFiemapHash(std::string const & filename,
-			size_t size);
+	static Hash hashExtents(const std::vector<FiemapData> & extents);
 private:
 	HashStore &hs;
+	FileCatalog &catalog;
 
-	const std::string * filename;
-	std::time_t mTime;
-	Hasher::hash extentsHash;
-	Hasher::hash dataHash;
+	FileId id;
 
-	size_t size;
-	bool clean;
-	bool newFile;
+	std::vector<FiemapData> fetchExtents() const;
 public:
-	File(HashStore &hs,
-			std::time_t mTime,
-			std::size_t size);
+	File(HashStore &hs, FileId id);
 
-	const std::string & getFilename() const;
+	FileId getId() const;
 
-	void setFilename(const std::string & filename);
+	std::string getFilename() const;
 
 	std::time_t getMTime() const;
 
@@ -53,31 +49,19 @@ public:
 
 	const Hash & getDataHash() const;
 
-	int operator<(const File & b) const;
-
+	//Older hash versions are hashed again, as a changed mtime is
 	void update(std::time_t mTime,
 			const Hasher::hash & extentsHash,
-			const Hasher::hash & dataHash);
+			const Hasher::hash & dataHash,
+			uint32_t hashVersion);
 
 	void update(bool updateExtents);
 
-	void dedupe(const std::set <File *> & dests,
+	void dedupe(const std::vector <FileId> & dests,
 			std::map <std::string, std::string> & failures);
 
 	friend std::ostream & operator<<(std::ostream & out,
 			const File & file);
-
-	friend void HashStore::addFileFromDb(File *);
-
-	friend void HashStore::newFile(File *);
-
-	friend void HashStore::insertHash(File *);
-
-	friend void HashStore::insertHashOnly(File *);
-
-	friend void Database::insertFile(const File *);
-
-	friend void Database::updateFile(const File *);
 };
 
 #endif /* FILE_H_ */
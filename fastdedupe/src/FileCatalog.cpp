@@ -0,0 +1,270 @@
+/*
+ * FileCatalog.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "FileCatalog.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using std::overflow_error;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+FileCatalog::FileCatalog() :
+	lastDirectory(UINT32_MAX) {
+}
+
+FileCatalog::~FileCatalog() {
+}
+
+void FileCatalog::reserve(size_t files) {
+	directoryColumn.reserve(files);
+	nameColumn.reserve(files);
+	sizeColumn.reserve(files);
+	mTimeColumn.reserve(files);
+	extentsHashColumn.reserve(files);
+	dataHashColumn.reserve(files);
+	flagColumn.reserve(files);
+	previousColumn.reserve(files);
+	nextColumn.reserve(files);
+	byPath.reserve(files);
+}
+
+uint64_t FileCatalog::hashPath(const string & filename) {
+	return Hasher::getHasher().hashFromBytes(filename.c_str(),
+			filename.length()).getValue();
+}
+
+uint32_t FileCatalog::getDirectoryId(const string & directory) {
+	//Walks hand over whole directories in a row
+	if (lastDirectory != UINT32_MAX &&
+			directories[lastDirectory] == directory)
+		return lastDirectory;
+
+	auto it = directoryIds.find(directory);
+
+	if (it == directoryIds.end()) {
+		it = directoryIds.emplace(directory, directories.size()).first;
+		directories.push_back(directory);
+	}
+
+	lastDirectory = it->second;
+
+	return lastDirectory;
+}
+
+FileId FileCatalog::add(const string & filename, std::time_t mTime,
+		size_t size) {
+	FileId existing = lookup(filename);
+	if (existing != NO_FILE) {
+		if (hasFlag(existing, REMOVED)) {
+			mTimeColumn[existing] = mTime;
+			sizeColumn[existing] = size;
+			extentsHashColumn[existing] = Hash();
+			dataHashColumn[existing] = Hash();
+			flagColumn[existing] = NEW_FILE;
+		}
+		return existing;
+	}
+
+	if (directoryColumn.size() >= NO_FILE)
+		throw overflow_error("Too many files");
+
+	FileId id = directoryColumn.size();
+	size_t separator = filename.rfind('/');
+	string directory = separator == string::npos ?
+			"" : filename.substr(0, separator);
+	const char * name = filename.c_str() +
+			(separator == string::npos ? 0 : separator + 1);
+
+	directoryColumn.push_back(getDirectoryId(directory));
+	nameColumn.push_back(names.size());
+	names.insert(names.end(), name, name + strlen(name) + 1);
+	sizeColumn.push_back(size);
+	mTimeColumn.push_back(mTime);
+	extentsHashColumn.emplace_back();
+	dataHashColumn.emplace_back();
+	flagColumn.push_back(NEW_FILE);
+	previousColumn.push_back(NO_FILE);
+	nextColumn.push_back(NO_FILE);
+
+	FileId & slot = byPath[hashPath(filename)];
+	//Ids are stored off by one, zero means a fresh slot
+	if (slot == 0)
+		slot = id + 1;
+	else
+		collisions.emplace(filename, id);
+
+	return id;
+}
+
+FileId FileCatalog::lookup(const string & filename) const {
+	const FileId * slot = byPath.find(hashPath(filename));
+
+	if (slot == NULL)
+		return NO_FILE;
+
+	FileId id = *slot - 1;
+	if (getFilename(id) == filename)
+		return id;
+
+	auto it = collisions.find(filename);
+	if (it == collisions.end())
+		return NO_FILE;
+
+	return it->second;
+}
+
+FileId FileCatalog::find(const string & filename) const {
+	FileId id = lookup(filename);
+
+	if (id == NO_FILE || hasFlag(id, REMOVED))
+		return NO_FILE;
+
+	return id;
+}
+
+void FileCatalog::remove(FileId id) {
+	setFlag(id, REMOVED, true);
+}
+
+size_t FileCatalog::size() const {
+	return directoryColumn.size();
+}
+
+string FileCatalog::getFilename(FileId id) const {
+	const string & directory = directories[directoryColumn[id]];
+
+	if (directory.empty())
+		return getName(id);
+
+	return directory + "/" + getName(id);
+}
+
+const string & FileCatalog::getDirectory(FileId id) const {
+	return directories[directoryColumn[id]];
+}
+
+size_t FileCatalog::getDirectoryCount() const {
+	return directories.size();
+}
+
+const string & FileCatalog::getDirectoryPath(uint32_t directory) const {
+	return directories[directory];
+}
+
+const char * FileCatalog::getName(FileId id) const {
+	return &names[nameColumn[id]];
+}
+
+size_t FileCatalog::memoryUsage() const {
+	size_t total = names.capacity()
+			+ directoryColumn.capacity() * sizeof(uint32_t)
+			+ nameColumn.capacity() * sizeof(uint64_t)
+			+ sizeColumn.capacity() * sizeof(uint64_t)
+			+ mTimeColumn.capacity() * sizeof(int64_t)
+			+ extentsHashColumn.capacity() * sizeof(Hash)
+			+ dataHashColumn.capacity() * sizeof(Hash)
+			+ flagColumn.capacity() * sizeof(uint8_t)
+			+ previousColumn.capacity() * sizeof(FileId)
+			+ nextColumn.capacity() * sizeof(FileId)
+			+ byPath.memoryUsage();
+
+	for (const string & directory : directories)
+		total += directory.capacity() + sizeof(string) * 2;
+
+	return total;
+}
+
+//Strings as one run of null terminated characters
+static vector<char> joinStrings(const vector<string> & strings) {
+	vector<char> joined;
+
+	for (const string & value : strings)
+		joined.insert(joined.end(), value.c_str(),
+				value.c_str() + value.size() + 1);
+
+	return joined;
+}
+
+static vector<string> splitStrings(const vector<char> & joined) {
+	vector<string> strings;
+
+	if (! joined.empty() && joined.back() != '\0')
+		throw runtime_error("Corrupt snapshot strings");
+	for (size_t start = 0; start < joined.size(); ) {
+		strings.emplace_back(joined.data() + start);
+		start += strings.back().size() + 1;
+	}
+
+	return strings;
+}
+
+void FileCatalog::save(SnapshotWriter & snapshot) const {
+	vector<string> collidingPaths;
+	vector<FileId> collidingIds;
+
+	for (auto & collision : collisions) {
+		collidingPaths.push_back(collision.first);
+		collidingIds.push_back(collision.second);
+	}
+
+	snapshot.write(joinStrings(directories));
+	snapshot.write(names);
+	snapshot.write(directoryColumn);
+	snapshot.write(nameColumn);
+	snapshot.write(sizeColumn);
+	snapshot.write(mTimeColumn);
+	snapshot.write(extentsHashColumn);
+	snapshot.write(dataHashColumn);
+	snapshot.write(flagColumn);
+	snapshot.write(previousColumn);
+	snapshot.write(nextColumn);
+	byPath.save(snapshot);
+	snapshot.write(joinStrings(collidingPaths));
+	snapshot.write(collidingIds);
+}
+
+void FileCatalog::load(SnapshotReader & snapshot) {
+	vector<char> joined;
+	vector<FileId> collidingIds;
+
+	snapshot.read(joined);
+	directories = splitStrings(joined);
+	snapshot.read(names);
+	snapshot.read(directoryColumn);
+	snapshot.read(nameColumn);
+	snapshot.read(sizeColumn);
+	snapshot.read(mTimeColumn);
+	snapshot.read(extentsHashColumn);
+	snapshot.read(dataHashColumn);
+	snapshot.read(flagColumn);
+	snapshot.read(previousColumn);
+	snapshot.read(nextColumn);
+	byPath.load(snapshot);
+	snapshot.read(joined);
+	vector<string> collidingPaths = splitStrings(joined);
+	snapshot.read(collidingIds);
+
+	size_t files = directoryColumn.size();
+	if (nameColumn.size() != files || sizeColumn.size() != files ||
+			mTimeColumn.size() != files ||
+			extentsHashColumn.size() != files ||
+			dataHashColumn.size() != files || flagColumn.size() != files ||
+			previousColumn.size() != files || nextColumn.size() != files ||
+			collidingPaths.size() != collidingIds.size())
+		throw runtime_error("Corrupt snapshot catalog");
+
+	directoryIds.clear();
+	for (uint32_t i = 0; i < directories.size(); i++)
+		directoryIds.emplace(directories[i], i);
+	collisions.clear();
+	for (size_t i = 0; i < collidingPaths.size(); i++)
+		collisions.emplace(collidingPaths[i], collidingIds[i]);
+	lastDirectory = UINT32_MAX;
+}
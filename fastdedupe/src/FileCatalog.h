@@ -0,0 +1,165 @@
+/*
+ * FileCatalog.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef FILECATALOG_H_
+#define FILECATALOG_H_
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "FlatHashMap.h"
+#include "Hasher.h"
+#include "Snapshot.h"
+
+typedef uint32_t FileId;
+
+#define NO_FILE UINT32_MAX
+
+/*
+ * Columnar store of every file in a run, indexed by a dense FileId.
+ * Paths are split into an interned directory and a name kept in one
+ * character arena; the remaining attributes live in parallel arrays
+ * so scans over one attribute stay sequential.
+ */
+class FileCatalog {
+public:
+	enum Flag : uint8_t {
+		CLEAN = 1,
+		NEW_FILE = 2,
+		INDEXED = 4,
+		REMOVED = 8,
+		//Indexed outside the walked roots, only used as a source
+		REFERENCE = 16,
+		//Deduped with the rest of an identical directory subtree
+		SUBTREE_SOURCE = 32,
+		SUBTREE_COPY = 64
+	};
+private:
+	std::vector<std::string> directories;
+	std::unordered_map<std::string, uint32_t> directoryIds;
+	std::vector<char> names;
+
+	std::vector<uint32_t> directoryColumn;
+	std::vector<uint64_t> nameColumn;
+	std::vector<uint64_t> sizeColumn;
+	std::vector<int64_t> mTimeColumn;
+	std::vector<Hash> extentsHashColumn;
+	std::vector<Hash> dataHashColumn;
+	std::vector<uint8_t> flagColumn;
+	std::vector<FileId> previousColumn;
+	std::vector<FileId> nextColumn;
+
+	//Keyed on the path hash, the rare collisions spill over
+	FlatHashMap<FileId> byPath;
+	std::unordered_map<std::string, FileId> collisions;
+
+	uint32_t lastDirectory;
+
+	uint32_t getDirectoryId(const std::string & directory);
+
+	static uint64_t hashPath(const std::string & filename);
+
+	//Removed entries included
+	FileId lookup(const std::string & filename) const;
+public:
+	FileCatalog();
+
+	virtual ~FileCatalog();
+
+	void reserve(size_t files);
+
+	//A removed entry of the same path comes back as a new file
+	FileId add(const std::string & filename, std::time_t mTime,
+			size_t size);
+
+	FileId find(const std::string & filename) const;
+
+	void remove(FileId id);
+
+	size_t size() const;
+
+	std::string getFilename(FileId id) const;
+
+	const std::string & getDirectory(FileId id) const;
+
+	uint32_t getDirectoryIndex(FileId id) const {
+		return directoryColumn[id];
+	}
+
+	size_t getDirectoryCount() const;
+
+	const std::string & getDirectoryPath(uint32_t directory) const;
+
+	const char * getName(FileId id) const;
+
+	std::time_t getMTime(FileId id) const {
+		return mTimeColumn[id];
+	}
+
+	void setMTime(FileId id, std::time_t mTime) {
+		mTimeColumn[id] = mTime;
+	}
+
+	size_t getSize(FileId id) const {
+		return sizeColumn[id];
+	}
+
+	void setSize(FileId id, size_t size) {
+		sizeColumn[id] = size;
+	}
+
+	const Hash & getExtentsHash(FileId id) const {
+		return extentsHashColumn[id];
+	}
+
+	void setExtentsHash(FileId id, const Hash & extentsHash) {
+		extentsHashColumn[id] = extentsHash;
+	}
+
+	const Hash & getDataHash(FileId id) const {
+		return dataHashColumn[id];
+	}
+
+	void setDataHash(FileId id, const Hash & dataHash) {
+		dataHashColumn[id] = dataHash;
+	}
+
+	bool hasFlag(FileId id, Flag flag) const {
+		return flagColumn[id] & flag;
+	}
+
+	void setFlag(FileId id, Flag flag, bool value) {
+		if (value)
+			flagColumn[id] |= flag;
+		else
+			flagColumn[id] &= ~flag;
+	}
+
+	FileId & previousSameExtents(FileId id) {
+		return previousColumn[id];
+	}
+
+	FileId & nextSameExtents(FileId id) {
+		return nextColumn[id];
+	}
+
+	FileId getNextSameExtents(FileId id) const {
+		return nextColumn[id];
+	}
+
+	size_t memoryUsage() const;
+
+	void save(SnapshotWriter & snapshot) const;
+
+	//Into an empty catalog
+	void load(SnapshotReader & snapshot);
+};
+
+#endif /* FILECATALOG_H_ */
@@ -6,11 +6,18 @@
  */
 
 #include "FilesystemHelper.h"
+#include "Stats.h"
+#include "Throttle.h"
+#include "Trace.h"
 
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
+#include <linux/magic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/ioctl.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -19,9 +26,16 @@
 #include <limits.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <fstream>
 #include <list>
+#include <memory>
 #include <set>
+#include <sstream>
 #include <stdexcept>
+#include <tuple>
 #include <vector>
 
 using std::invalid_argument;
@@ -47,16 +61,18 @@ const long int RECURSIVE_DEFAULT_MIN_SIZE = 128*1024;
 
 FilesystemHelper FilesystemHelper::filesystemHelper(RECURSIVE_DEFAULT_MIN_SIZE);
 
-FilesystemHelper::FilesystemHelper(long int minSize) :
-	buffer(new char [FILESYSTEM_BUFFER_SIZE]) {
-	if (buffer == NULL) {
-		throw runtime_error("Unable to allocate buffer");
-	}
+FilesystemHelper::FilesystemHelper(long int minSize) {
 	this->minSize = minSize;
 }
 
 FilesystemHelper::~FilesystemHelper() {
-	delete [] buffer;
+}
+
+char * FilesystemHelper::getBuffer() {
+	static thread_local std::unique_ptr<char []> buffer(
+			new char [FILESYSTEM_BUFFER_SIZE]);
+
+	return buffer.get();
 }
 
 long int FilesystemHelper::getMinSize() {
@@ -78,7 +94,8 @@ void FilesystemHelper::getStat(const string & filename, struct stat & statData)
 }
 
 struct fiemap * FilesystemHelper::getFiemap(int fd, size_t offset, size_t size) {
-	struct fiemap *fiemap_buffer = (struct fiemap *) buffer;
+	TRACE_SCOPE_ARG(fiemap, offset);
+	struct fiemap *fiemap_buffer = (struct fiemap *) getBuffer();
 
 	fiemap_buffer->fm_start=offset;
 	fiemap_buffer->fm_length=size;
@@ -86,6 +103,7 @@ struct fiemap * FilesystemHelper::getFiemap(int fd, size_t offset, size_t size)
 	fiemap_buffer->fm_extent_count=FIEMAP_MAX_EXTENTS;
 	fiemap_buffer->fm_reserved=0;
 
+	Throttle::getThrottle().acquire(0);
 	if (ioctl(fd, FS_IOC_FIEMAP, fiemap_buffer) == -1) {
 		throw runtime_error(strerror(errno));
 	}
@@ -93,7 +111,9 @@ struct fiemap * FilesystemHelper::getFiemap(int fd, size_t offset, size_t size)
 	return fiemap_buffer;
 }
 
-vector<FiemapData> FilesystemHelper::getFiemapData(string const & filename, size_t size) {
+vector<FiemapData> FilesystemHelper::getFiemapData(string const & filename,
+		size_t size, vector<uint32_t> * flags) {
+	Stats::Timer timer(Stats::FIEMAP);
 	int fd = open(filename.c_str(), O_RDONLY|O_NOATIME|O_NOFOLLOW);
 	if (fd == -1) {
 		if (errno == ENOENT)
@@ -121,6 +141,8 @@ vector<FiemapData> FilesystemHelper::getFiemapData(string const & filename, size
 					extents.emplace_back(FiemapData{
 						extent.fe_logical, extent.fe_physical,
 						extent.fe_length});
+					if (flags)
+						flags->push_back(extent.fe_flags);
 
 					last = &extent;
 
@@ -151,30 +173,44 @@ int FilesystemHelper::dedupe(int src_fd, size_t size,
 		const vector<string> &dsts_vector,
 		int error,	map<string, string> &failures) {
 	struct file_dedupe_range * range =
-			(struct file_dedupe_range *) buffer;
+			(struct file_dedupe_range *) getBuffer();
 	struct file_dedupe_range_info * range_infos = range->info;
 
 	range->dest_count = dsts_vector.size();
 
 	do {
+		bool called = true;
+
 		range->src_length = size > DEDUPE_MAX_SIZE ?
 				DEDUPE_MAX_SIZE : size;
-		if (ioctl(src_fd, FIDEDUPERANGE, range) == -1)
-			error = errno;
+		//The kernel reads the source and every destination to compare
+		Throttle::getThrottle().acquire(range->src_length *
+				(range->dest_count + 1));
+		{
+			TRACE_SCOPE_ARG(dedupe, range->src_length);
+			Stats::Timer timer(Stats::DEDUPE);
+			timer.setBytes(range->src_length * range->dest_count);
+			if (ioctl(src_fd, FIDEDUPERANGE, range) == -1) {
+				error = errno;
+				called = false;
+			}
+		}
+
+		//The last range tells as much as the others
+		for (size_t j = 0; called && j < range->dest_count; j++) {
+			int status = range_infos[j].status;
+			if (status == FILE_DEDUPE_RANGE_DIFFERS) {
+				failures.emplace(dsts_vector[j], DEDUPE_DIFFERS);
+			} else if (status != FILE_DEDUPE_RANGE_SAME) {
+				failures.emplace(dsts_vector[j], "Unknown error");
+			}
+		}
 
 		size -= range->src_length;
 		if (size > 0) {
 			range->src_offset += range->src_length;
-			for (size_t j = 0; j < range->dest_count; j++) {
-				int status = range_infos[j].status;
-				if (status == FILE_DEDUPE_RANGE_DIFFERS) {
-					failures.emplace(dsts_vector[j], "Files differ");
-				} else if (status != FILE_DEDUPE_RANGE_SAME) {
-					failures.emplace(dsts_vector[j], "Unknown error");
-				}
-
+			for (size_t j = 0; j < range->dest_count; j++)
 				range_infos[j].dest_offset += range->src_length;
-			}
 		}
 	} while (size > 0);
 
@@ -186,7 +222,7 @@ void FilesystemHelper::dedupe(const string & src,
 		map<string, string> & failures) {
 
 	struct file_dedupe_range * range =
-			(struct file_dedupe_range *) buffer;
+			(struct file_dedupe_range *) getBuffer();
 	struct file_dedupe_range_info * range_infos =
 			range->info;
 
@@ -251,13 +287,74 @@ void FilesystemHelper::dedupe(const string & src,
 		throw runtime_error(strerror(errno));
 }
 
+void FilesystemHelper::dedupeRange(const string & src, size_t srcOffset,
+		const string & dest, size_t destOffset, size_t length,
+		map<string, string> & failures) {
+	struct file_dedupe_range * range =
+			(struct file_dedupe_range *) getBuffer();
+	struct file_dedupe_range_info & range_info = range->info[0];
+
+	int src_fd = open(src.c_str(), O_RDONLY|O_NOATIME|O_NOFOLLOW);
+	if (src_fd == -1) throw invalid_argument(strerror(errno));
+
+	range_info.dest_fd = open(dest.c_str(), O_RDONLY|O_NOATIME|O_NOFOLLOW);
+	if (range_info.dest_fd == -1) {
+		failures.emplace(dest, strerror(errno));
+		close(src_fd);
+		return;
+	}
+
+	range->src_offset = srcOffset;
+	range->reserved1 = 0;
+	range->reserved2 = 0;
+	range_info.dest_offset = destOffset;
+	range_info.reserved = 0;
+
+	int error = dedupe(src_fd, length, vector<string>{dest}, 0, failures);
+
+	//The last chunk is not checked by dedupe
+	if (! error && range_info.status == FILE_DEDUPE_RANGE_DIFFERS)
+		failures.emplace(dest, "Ranges differ");
+	else if (! error && range_info.status < 0)
+		failures.emplace(dest, strerror(-range_info.status));
+
+	close(range_info.dest_fd);
+	close(src_fd);
+
+	if (error)
+		throw runtime_error(strerror(error));
+}
+
+bool FilesystemHelper::isUnder(const string & path,
+		const set<string> & roots) {
+	for (const string & root : roots)
+		if (path == root || (path.size() > root.size() &&
+				path.compare(0, root.size(), root) == 0 &&
+				path[root.size()] == '/'))
+			return true;
+
+	return false;
+}
+
 string FilesystemHelper::getRealPath(const string & path) {
-	char * fullpath = realpath(path.c_str(), buffer);
+	char * fullpath = realpath(path.c_str(), getBuffer());
 
 	if (fullpath == NULL) throw errno;
 	else return fullpath;
 }
 
+FileInfo FilesystemHelper::getInfo(const string & filename) {
+	struct stat statData;
+
+	getStat(filename, statData);
+
+	return FileInfo{filename,
+		statData.st_size,
+		statData.st_mtim.tv_sec,
+		S_ISDIR(statData.st_mode),
+		S_ISREG(statData.st_mode)};
+}
+
 void FilesystemHelper::fetchInfos(const set<string> & filenames,
 		list <FileInfo> & files,
 		set<string> & patterns,
@@ -295,9 +392,10 @@ void FilesystemHelper::fetchInfos(const set<string> & filenames,
 
 void FilesystemHelper::recursiveRead(const string & fullpath,
 		DIR * dirStream,
-		list<FileInfo> & files,
+		const FileCallback & onFile,
 		list<IgnoredFile> & ignored) {
-	
+	TRACE_SCOPE(readdir);
+
 	errno = 0;
 
 	for (	struct dirent * entity = readdir(dirStream);
@@ -345,12 +443,12 @@ void FilesystemHelper::recursiveRead(const string & fullpath,
 				else {
 					recursiveRead(entity_fullpath,
 							entityDirStream,
-							files, ignored);
+							onFile, ignored);
 					closedir(entityDirStream);
 				}
 			} else if (regular_type) {
 				if (statData.st_size > minSize)
-					files.emplace_back(FileInfo{entity_fullpath,
+					onFile(FileInfo{entity_fullpath,
 						statData.st_size,
 						statData.st_mtim.tv_sec,
 						false, true});
@@ -379,14 +477,18 @@ void FilesystemHelper::recursiveRead(const string & fullpath,
 }
 
 void FilesystemHelper::recursiveRead(const set<string> & filenames,
-		list <FileInfo> & files,
+		const FileCallback & onFile,
 		set <string> & patterns,
 		list<IgnoredFile> & ignored) {
+	list<FileInfo> files;
 
 	fetchInfos(filenames, files, patterns, ignored);
 
 	for (const auto & fileinfo : files) {
 
+		if (fileinfo.regType)
+			onFile(fileinfo);
+
 		if (! fileinfo.dirType)
 			continue;
 
@@ -403,7 +505,7 @@ void FilesystemHelper::recursiveRead(const set<string> & filenames,
 			else {
 				recursiveRead(dir,
 						dirStream,
-						files, ignored);
+						onFile, ignored);
 				closedir(dirStream);
 			}
 		} catch (int error) {
@@ -415,3 +517,374 @@ void FilesystemHelper::recursiveRead(const set<string> & filenames,
 		}
 	}
 }
+
+void FilesystemHelper::readDirectory(const string & directory,
+		list<FileInfo> & entries,
+		list<IgnoredFile> & ignored) {
+	DIR * dirStream = opendir(directory.c_str());
+
+	if (dirStream == NULL) {
+		ignored.emplace_back(IgnoredFile{directory, errno, strerror(errno)});
+		return;
+	}
+
+	for (struct dirent * entity = readdir(dirStream); entity != NULL;
+			entity = readdir(dirStream)) {
+		if (! strcmp(entity->d_name, ".") || ! strcmp(entity->d_name, ".."))
+			continue;
+
+		string path(directory + "/" + entity->d_name);
+		try {
+			struct stat statData;
+
+			if (entity->d_type != DT_UNKNOWN && entity->d_type != DT_DIR &&
+					entity->d_type != DT_REG)
+				continue;
+			getStat(path, statData);
+
+			if (S_ISDIR(statData.st_mode))
+				entries.emplace_back(FileInfo{path, statData.st_size,
+					statData.st_mtim.tv_sec, true, false});
+			else if (S_ISREG(statData.st_mode) && statData.st_size > minSize)
+				entries.emplace_back(FileInfo{path, statData.st_size,
+					statData.st_mtim.tv_sec, false, true});
+		} catch (int error) {
+			ignored.emplace_back(IgnoredFile{path, error, strerror(error)});
+		}
+	}
+	closedir(dirStream);
+}
+
+//Items of one tree in key order, from where key starts to where it ends
+static bool searchTree(int fd, struct btrfs_ioctl_search_key key,
+		const std::function<void(const struct btrfs_ioctl_search_header &,
+				const char *)> & onItem) {
+	struct btrfs_ioctl_search_args args;
+
+	while (true) {
+		args.key = key;
+		args.key.nr_items = 4096;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) == -1)
+			return false;
+		if (args.key.nr_items == 0)
+			return true;
+
+		struct btrfs_ioctl_search_header header;
+		size_t offset = 0;
+
+		for (uint32_t i = 0; i < args.key.nr_items; i++) {
+			memcpy(&header, args.buf + offset, sizeof(header));
+			offset += sizeof(header);
+			onItem(header, args.buf + offset);
+			offset += header.len;
+		}
+
+		//Resume after the last key returned, as btrfs-progs does
+		key.min_objectid = header.objectid;
+		key.min_type = header.type;
+		key.min_offset = header.offset;
+		if (key.min_offset < (uint64_t) -1) {
+			key.min_offset++;
+		} else if (key.min_type < (uint8_t) -1) {
+			key.min_type++;
+			key.min_offset = 0;
+		} else if (key.min_objectid < (uint64_t) -1) {
+			key.min_objectid++;
+			key.min_type = 0;
+			key.min_offset = 0;
+		} else {
+			return true;
+		}
+	}
+}
+
+static struct btrfs_ioctl_search_key searchKey(uint64_t treeId,
+		uint64_t minObjectId, uint64_t maxObjectId,
+		uint32_t minType, uint32_t maxType, uint64_t minTransId) {
+	struct btrfs_ioctl_search_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.tree_id = treeId;
+	key.min_objectid = minObjectId;
+	key.max_objectid = maxObjectId;
+	key.min_type = minType;
+	key.max_type = maxType;
+	key.max_offset = (uint64_t) -1;
+	key.min_transid = minTransId;
+	key.max_transid = (uint64_t) -1;
+
+	return key;
+}
+
+//Tree of the subvolume holding fd
+static bool getTreeId(int fd, uint64_t & treeId) {
+	struct statfs info;
+	struct btrfs_ioctl_ino_lookup_args args;
+
+	if (fstatfs(fd, &info) == -1 || info.f_type != BTRFS_SUPER_MAGIC)
+		return false;
+
+	memset(&args, 0, sizeof(args));
+	args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) == -1)
+		return false;
+
+	treeId = args.treeid;
+	return true;
+}
+
+static string toHex(const uint8_t * bytes, size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	string hex;
+
+	for (size_t i = 0; i < length; i++) {
+		hex += digits[bytes[i] >> 4];
+		hex += digits[bytes[i] & 15];
+	}
+
+	return hex;
+}
+
+//Mount points come with spaces and the like as octal escapes
+static string unescapeMountPoint(const string & escaped) {
+	string path;
+
+	for (size_t i = 0; i < escaped.size(); i++) {
+		if (escaped[i] == '\\' && i + 3 < escaped.size() &&
+				isdigit(escaped[i + 1])) {
+			path += (char) strtol(escaped.substr(i + 1, 3).c_str(), NULL, 8);
+			i += 3;
+		} else {
+			path += escaped[i];
+		}
+	}
+
+	return path;
+}
+
+//Files of another filesystem mounted below root are not in its trees
+static bool hasMountsBelow(const string & root) {
+	std::ifstream mountInfo("/proc/self/mountinfo");
+	string line;
+
+	while (std::getline(mountInfo, line)) {
+		std::istringstream fields(line);
+		string id, parent, device, source, mountPoint;
+
+		fields >> id >> parent >> device >> source >> mountPoint;
+		mountPoint = unescapeMountPoint(mountPoint);
+		if (mountPoint != root &&
+				FilesystemHelper::isUnder(mountPoint, {root}))
+			return true;
+	}
+
+	return false;
+}
+
+bool FilesystemHelper::getGeneration(const string & path,
+		BtrfsGeneration & generation) {
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	uint64_t treeId;
+	struct btrfs_ioctl_fs_info_args fsInfo;
+	bool found = false;
+
+	memset(&fsInfo, 0, sizeof(fsInfo));
+	if (getTreeId(fd, treeId) &&
+			ioctl(fd, BTRFS_IOC_FS_INFO, &fsInfo) != -1) {
+		//The top subvolume may have a null uuid, the tree id tells
+		searchTree(fd, searchKey(BTRFS_ROOT_TREE_OBJECTID, treeId, treeId,
+				BTRFS_ROOT_ITEM_KEY, BTRFS_ROOT_ITEM_KEY, 0),
+				[&] (const struct btrfs_ioctl_search_header & header,
+						const char * item) {
+			struct btrfs_root_item root;
+
+			if (header.type != BTRFS_ROOT_ITEM_KEY ||
+					header.len < offsetof(struct btrfs_root_item, uuid) +
+					BTRFS_UUID_SIZE)
+				return;
+
+			memcpy(&root, item, std::min((size_t) header.len,
+					sizeof(root)));
+			generation.uuid = toHex(fsInfo.fsid, BTRFS_FSID_SIZE) + ":" +
+					std::to_string(treeId) + ":" +
+					toHex(root.uuid, BTRFS_UUID_SIZE);
+			generation.generation = root.generation;
+			found = true;
+		});
+	}
+
+	close(fd);
+	return found;
+}
+
+/*
+ * Path of a directory inode, from the subvolume top at top, cached;
+ * empty once the directory is gone.
+ */
+string FilesystemHelper::getPathOf(int fd, uint64_t treeId,
+		uint64_t inode, const string & top,
+		map<uint64_t, string> & directories) {
+	auto cached = directories.find(inode);
+	if (cached != directories.end())
+		return cached->second;
+
+	struct btrfs_ioctl_ino_lookup_args args;
+	string path;
+
+	memset(&args, 0, sizeof(args));
+	args.treeid = treeId;
+	args.objectid = inode;
+	if (inode == BTRFS_FIRST_FREE_OBJECTID)
+		path = top;
+	else if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) != -1) {
+		//Relative, with a trailing slash
+		string name(args.name, strnlen(args.name, sizeof(args.name)));
+
+		if (! name.empty())
+			name.pop_back();
+		path = top + "/" + name;
+	}
+
+	directories.emplace(inode, path);
+	return path;
+}
+
+bool FilesystemHelper::findChanged(const string & root, uint64_t since,
+		set<string> & files,
+		set<string> & directories,
+		set<string> & added) {
+	TRACE_SCOPE(find_changed);
+	int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	uint64_t treeId;
+	struct stat statData;
+	map<uint64_t, string> paths;
+	string top = root;
+	bool complete = getTreeId(fd, treeId) && fstat(fd, &statData) == 0 &&
+			! hasMountsBelow(root);
+
+	//Paths from the tree start at the subvolume top, above root if it is
+	//a directory inside; a bind mount of such a directory is refused
+	if (complete && statData.st_ino != BTRFS_FIRST_FREE_OBJECTID) {
+		string relative = getPathOf(fd, treeId, statData.st_ino, "", paths);
+
+		complete = ! relative.empty() && root.size() >= relative.size() &&
+				root.compare(root.size() - relative.size(), string::npos,
+						relative) == 0;
+		if (complete)
+			top = root.substr(0, root.size() - relative.size());
+		paths.clear();
+	}
+
+	//Subvolumes inside keep their inodes in trees of their own
+	if (complete)
+		complete = searchTree(fd, searchKey(BTRFS_ROOT_TREE_OBJECTID, treeId,
+				treeId, BTRFS_ROOT_REF_KEY, BTRFS_ROOT_REF_KEY, 0),
+				[&complete] (const struct btrfs_ioctl_search_header & header,
+						const char *) {
+			if (header.type == BTRFS_ROOT_REF_KEY)
+				complete = false;
+		}) && complete;
+
+	set<uint64_t> changedFiles, changedDirectories;
+	vector<std::tuple<uint64_t, string, bool>> entries;
+
+	//Only leaves written after since are returned, items are filtered
+	//on their own transid
+	if (complete)
+		complete = searchTree(fd, searchKey(treeId, BTRFS_FIRST_FREE_OBJECTID,
+				BTRFS_LAST_FREE_OBJECTID, 0, (uint8_t) -1, since + 1),
+				[&] (const struct btrfs_ioctl_search_header & header,
+						const char * item) {
+			if (header.type == BTRFS_INODE_ITEM_KEY &&
+					header.len >= sizeof(struct btrfs_inode_item)) {
+				struct btrfs_inode_item inode;
+
+				memcpy(&inode, item, sizeof(inode));
+				if (inode.transid <= since)
+					return;
+				if (S_ISREG(inode.mode))
+					changedFiles.insert(header.objectid);
+				else if (S_ISDIR(inode.mode))
+					changedDirectories.insert(header.objectid);
+			} else if (header.type == BTRFS_DIR_INDEX_KEY &&
+					header.len >= sizeof(struct btrfs_dir_item)) {
+				struct btrfs_dir_item entry;
+
+				memcpy(&entry, item, sizeof(entry));
+				if (entry.transid <= since ||
+						sizeof(entry) + entry.name_len > header.len)
+					return;
+				if (entry.location.type == BTRFS_ROOT_ITEM_KEY)
+					complete = false;
+				else if (entry.type == BTRFS_FT_DIR ||
+						entry.type == BTRFS_FT_REG_FILE)
+					entries.emplace_back(header.objectid,
+							string(item + sizeof(entry), entry.name_len),
+							entry.type == BTRFS_FT_DIR);
+			}
+		}) && complete;
+
+	if (! complete) {
+		close(fd);
+		return false;
+	}
+
+	auto add = [&root] (set<string> & to, const string & path) {
+		if (isUnder(path, {root}))
+			to.insert(path);
+	};
+
+	for (uint64_t inode : changedDirectories) {
+		string path = getPathOf(fd, treeId, inode, top, paths);
+
+		if (! path.empty())
+			add(directories, path);
+	}
+
+	for (auto & entry : entries) {
+		string parent = getPathOf(fd, treeId, std::get<0>(entry), top,
+				paths);
+
+		if (! parent.empty())
+			add(std::get<2>(entry) ? added : files,
+					parent + "/" + std::get<1>(entry));
+	}
+
+	//Every name of a file written, hardlinks included
+	vector<char> buffer(64*1024);
+	struct btrfs_data_container * container =
+			(struct btrfs_data_container *) buffer.data();
+
+	for (uint64_t inode : changedFiles) {
+		struct btrfs_ioctl_ino_path_args args;
+
+		memset(&args, 0, sizeof(args));
+		args.inum = inode;
+		args.size = buffer.size();
+		args.fspath = (uintptr_t) container;
+		if (ioctl(fd, BTRFS_IOC_INO_PATHS, &args) == -1) {
+			//Removed since, its directory changed too
+			if (errno == ENOENT)
+				continue;
+			complete = false;
+			break;
+		}
+		if (container->elem_missed) {
+			complete = false;
+			break;
+		}
+
+		for (uint32_t i = 0; i < container->elem_cnt; i++)
+			add(files, top + "/" + ((const char *) container->val +
+					container->val[i]));
+	}
+
+	close(fd);
+	return complete;
+}
@@ -11,17 +11,22 @@
 #include <sys/types.h>
 #include <dirent.h>
 
+#include <cstdint>
 #include <ctime>
+#include <functional>
 #include <list>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
 
+//Dedupe failure of files found not to hold the same data
+#define DEDUPE_DIFFERS "Files differ"
+
 struct FiemapData {
-		const size_t logical;
-		const size_t physical;
-		const size_t length;
+		size_t logical;
+		size_t physical;
+		size_t length;
 };
 
 struct FileInfo {
@@ -32,18 +37,29 @@ struct FileInfo {
 	const bool regType;
 };
 
+//Where a btrfs subvolume stood, to ask it later what changed since
+struct BtrfsGeneration {
+	//Filesystem, subvolume tree and subvolume uuids, in hex
+	std::string uuid;
+	uint64_t generation;
+};
+
 struct IgnoredFile {
 	const std::string fullpath;
 	const int error;
 	const std::string message;
 };
 
+typedef std::function<void(const FileInfo &)> FileCallback;
+
 class FilesystemHelper {
 private:
 	static FilesystemHelper filesystemHelper;
-	char * buffer;
 	long int minSize;
 
+	//Scratch space for ioctls and paths, one per thread
+	static char * getBuffer();
+
 	FilesystemHelper(long int minSize);
 
 	void getStat(const std::string & filename, struct stat & statData);
@@ -56,12 +72,20 @@ private:
 
 	void recursiveRead(const std::string & fullpath,
 			DIR * dirStream,
-			std::list<FileInfo> & files,
+			const FileCallback & onFile,
 			std::list<IgnoredFile> & ignored);
 
+	std::string getPathOf(int fd, uint64_t treeId, uint64_t inode,
+			const std::string & top,
+			std::map<uint64_t, std::string> & directories);
+
 public:
 	static FilesystemHelper & getFilesystemHelper();
 
+	//Whether path is one of roots or below one of them
+	static bool isUnder(const std::string & path,
+			const std::set<std::string> & roots);
+
 	virtual ~FilesystemHelper();
 
 	long int getMinSize();
@@ -70,23 +94,55 @@ public:
 
 	std::string getRealPath(const std::string & path);
 
+	FileInfo getInfo(const std::string & filename);
+
+	//FIEMAP_EXTENT flags of each extent go to flags if given
 	std::vector<FiemapData> getFiemapData(
-			std::string const & filename, size_t size);
+			std::string const & filename, size_t size,
+			std::vector<uint32_t> * flags = NULL);
 
 	void dedupe(const std::string & dest,
 			const std::set<std::string> & srcs,
 			size_t size,
 			std::map<std::string, std::string> & failures);
 
+	void dedupeRange(const std::string & src, size_t srcOffset,
+			const std::string & dest, size_t destOffset,
+			size_t length,
+			std::map<std::string, std::string> & failures);
+
 	void fetchInfos(const std::set<std::string> & filenames,
 			std::list<FileInfo> & files,
 			std::set<std::string> & patterns,
 			std::list<IgnoredFile> & ignored);
 
+	//Regular files are handed over as found instead of collected
 	void recursiveRead(const std::set<std::string> & filenames,
-			std::list<FileInfo> & files,
+			const FileCallback & onFile,
 			std::set<std::string> & patterns,
 			std::list<IgnoredFile> & ignored);
+
+	//Subdirectories and files worth indexing right in directory
+	void readDirectory(const std::string & directory,
+			std::list<FileInfo> & entries,
+			std::list<IgnoredFile> & ignored);
+
+	//False when path is not on btrfs or its trees cannot be searched
+	bool getGeneration(const std::string & path,
+			BtrfsGeneration & generation);
+
+	/*
+	 * btrfs fast path of recursiveRead, from the inodes changed in the
+	 * subvolume of root after the given generation: regular files
+	 * written or linked, directories whose entries changed and
+	 * directories linked, created or moved in, to be walked. Returns
+	 * false when that would miss files: without CAP_SYS_ADMIN, with
+	 * subvolumes nested in the subvolume or mounts below root.
+	 */
+	bool findChanged(const std::string & root, uint64_t since,
+			std::set<std::string> & files,
+			std::set<std::string> & directories,
+			std::set<std::string> & added);
 };
 
 #endif /* FILESYSTEMHELPER_H_ */
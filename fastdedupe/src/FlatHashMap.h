@@ -0,0 +1,215 @@
+/*
+ * FlatHashMap.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef FLATHASHMAP_H_
+#define FLATHASHMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "Snapshot.h"
+
+#define FLAT_HASH_MAP_MIN_CAPACITY 16
+
+/*
+ * Open addressing map keyed on 64 bit hashes, linear probing over a
+ * single slot array with backward shift deletion (no tombstones).
+ * Key 0 marks an empty slot and is kept aside. Like std::vector,
+ * operator[] and insertions invalidate references to other values.
+ */
+template <typename V>
+class FlatHashMap {
+private:
+	struct Slot {
+		uint64_t key;
+		V value;
+	};
+
+	std::vector<Slot> slots;
+	size_t count;
+	size_t mask;
+	bool hasZero;
+	V zeroValue;
+
+	static size_t mix(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	size_t findSlot(uint64_t key) const {
+		if (slots.empty())
+			return SIZE_MAX;
+
+		for (size_t i = mix(key) & mask; ; i = (i + 1) & mask) {
+			if (slots[i].key == key)
+				return i;
+			if (slots[i].key == 0)
+				return SIZE_MAX;
+		}
+	}
+
+	void rehash(size_t capacity) {
+		std::vector<Slot> old(capacity);
+		old.swap(slots);
+		mask = capacity - 1;
+
+		for (Slot & slot : old) {
+			if (slot.key == 0)
+				continue;
+
+			size_t i = mix(slot.key) & mask;
+			while (slots[i].key != 0)
+				i = (i + 1) & mask;
+			slots[i] = std::move(slot);
+		}
+	}
+
+public:
+	FlatHashMap() :
+		count(0), mask(0), hasZero(false), zeroValue() {
+	}
+
+	void reserve(size_t size) {
+		size_t capacity = FLAT_HASH_MAP_MIN_CAPACITY;
+		while (capacity * 3 < size * 4)
+			capacity *= 2;
+
+		if (capacity > slots.size())
+			rehash(capacity);
+	}
+
+	V * find(uint64_t key) {
+		if (key == 0)
+			return hasZero ? &zeroValue : NULL;
+
+		size_t i = findSlot(key);
+		return i == SIZE_MAX ? NULL : &slots[i].value;
+	}
+
+	const V * find(uint64_t key) const {
+		return const_cast<FlatHashMap *>(this)->find(key);
+	}
+
+	V & operator[](uint64_t key) {
+		if (key == 0) {
+			if (! hasZero) {
+				hasZero = true;
+				count++;
+			}
+			return zeroValue;
+		}
+
+		//Keep the load factor under 3/4
+		if ((count + 1) * 4 > slots.size() * 3)
+			rehash(slots.empty() ?
+					FLAT_HASH_MAP_MIN_CAPACITY : slots.size() * 2);
+
+		size_t i = mix(key) & mask;
+		while (slots[i].key != 0) {
+			if (slots[i].key == key)
+				return slots[i].value;
+			i = (i + 1) & mask;
+		}
+
+		slots[i].key = key;
+		slots[i].value = V();
+		count++;
+
+		return slots[i].value;
+	}
+
+	bool erase(uint64_t key) {
+		if (key == 0) {
+			if (! hasZero)
+				return false;
+			hasZero = false;
+			zeroValue = V();
+			count--;
+			return true;
+		}
+
+		size_t hole = findSlot(key);
+		if (hole == SIZE_MAX)
+			return false;
+
+		for (size_t i = (hole + 1) & mask; slots[i].key != 0;
+				i = (i + 1) & mask) {
+			size_t ideal = mix(slots[i].key) & mask;
+
+			//Move back entries whose probe sequence crosses the hole
+			if (((i - ideal) & mask) >= ((i - hole) & mask)) {
+				slots[hole] = std::move(slots[i]);
+				hole = i;
+			}
+		}
+
+		slots[hole].key = 0;
+		slots[hole].value = V();
+		count--;
+
+		return true;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	template <typename F>
+	void forEach(F function) {
+		if (hasZero)
+			function(0, zeroValue);
+
+		for (Slot & slot : slots)
+			if (slot.key != 0)
+				function(slot.key, slot.value);
+	}
+
+	template <typename F>
+	void forEach(F function) const {
+		if (hasZero)
+			function(0, zeroValue);
+
+		for (const Slot & slot : slots)
+			if (slot.key != 0)
+				function(slot.key, slot.value);
+	}
+
+	size_t memoryUsage() const {
+		return slots.capacity() * sizeof(Slot);
+	}
+
+	void save(SnapshotWriter & snapshot) const {
+		snapshot.write(slots);
+		snapshot.write((uint64_t) count);
+		snapshot.write((uint8_t) hasZero);
+		snapshot.write(zeroValue);
+	}
+
+	void load(SnapshotReader & snapshot) {
+		uint64_t loadedCount;
+		uint8_t loadedZero;
+
+		snapshot.read(slots);
+		snapshot.read(loadedCount);
+		snapshot.read(loadedZero);
+		snapshot.read(zeroValue);
+
+		//Probing relies on a power of two capacity
+		if (slots.size() & (slots.size() - 1))
+			throw std::runtime_error("Corrupt snapshot map");
+		count = loadedCount;
+		hasZero = loadedZero;
+		mask = slots.empty() ? 0 : slots.size() - 1;
+	}
+};
+
+#endif /* FLATHASHMAP_H_ */
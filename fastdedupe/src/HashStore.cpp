@@ -14,147 +14,512 @@
 
 using std::logic_error;
 using std::map;
-using std::pair;
-using std::set;
+using std::mutex;
 using std::string;
-
-HashStore::HashStore(Database * db) :
-	db(*db) {
-	// TODO Auto-generated constructor stub
-
+using std::unique_lock;
+using std::vector;
+
+//Global node ids keep the stripe in the low bits
+#define NODE_ID(stripe, node) ((node) << HASHSTORE_STRIPE_BITS | (stripe))
+#define NODE_STRIPE(id) ((id) & (HASHSTORE_STRIPES - 1))
+#define NODE_INDEX(id) ((id) >> HASHSTORE_STRIPE_BITS)
+
+HashStore::HashStore(Database * db, FileCatalog * catalog) :
+	db(*db),
+	catalog(*catalog),
+	blockSize(0) {
 }
 
 HashStore::~HashStore() {
-	// TODO Auto-generated destructor stub
 }
 
-void HashStore::addFileFromDb(File * file) {
-	Hash & extentsHash = file->extentsHash;
+FileCatalog & HashStore::getCatalog() const {
+	return catalog;
+}
+
+void HashStore::reserve(size_t files) {
+	size_t perStripe = files / HASHSTORE_STRIPES + files / 64 + 1;
 
-	ExtentsInfo & stored = byExtents[extentsHash];
-	if (stored.files.empty()) {
-		stored.dataHash=file->dataHash;
-		byData[stored.dataHash].insert(extentsHash);
+	for (size_t i = 0; i < HASHSTORE_STRIPES; i++) {
+		extentsStripes[i].extents.reserve(perStripe);
+		extentsStripes[i].byExtents.reserve(perStripe);
+		dataStripes[i].links.reserve(perStripe);
+		dataStripes[i].byData.reserve(perStripe);
 	}
+}
+
+void HashStore::setBlockSize(uint32_t blockSize) {
+	this->blockSize = blockSize;
+}
+
+void HashStore::loadExtentHashes() {
+	db.loadExtentHashes([this] (const ExtentKey & key, uint64_t hash) {
+		extentHashes.insert(key, hash);
+	});
+}
 
-	stored.files.insert(file);
+uint32_t HashStore::getStripe(const Hash & hash) {
+	return hash.getValue() >> (64 - HASHSTORE_STRIPE_BITS);
 }
 
-void HashStore::newFile(File * file) {
-	Hash & extentsHash = file->extentsHash;
+/*
+ * Returns the node of extentsHash in its stripe, creating it in the
+ * PENDING state if missing. Nodes still pending for another thread are
+ * waited for; if that thread gives up the node is gone and claimed
+ * again here.
+ */
+uint32_t HashStore::claimExtents(ExtentsStripe & stripe,
+		unique_lock<mutex> & lock,
+		const Hash & extentsHash, bool & created) {
+	for (;;) {
+		uint32_t & stored = stripe.byExtents[extentsHash.getValue()];
+
+		//New map entries are zeroed, index 0 is stored off by one
+		created = stored == 0;
+		if (created) {
+			uint32_t node = stripe.extents.allocate();
+			stored = node + 1;
+
+			ExtentsInfo & info = stripe.extents[node];
+			info.extentsHash = extentsHash;
+			info.firstFile = NO_FILE;
+			info.fileCount = 0;
+			info.dataLink = ARENA_NONE;
+			info.state = PENDING;
+
+			return node;
+		}
+
+		uint32_t node = stored - 1;
+		if (stripe.extents[node].state == READY)
+			return node;
 
-	ExtentsInfo & stored = byExtents[extentsHash];
-	if (stored.files.empty()) {
-		stored.dataHash=Hasher::getHasher()
-		.hashFromFile(file->getFilename());;
-		byData[stored.dataHash].insert(extentsHash);
-		db.upsertHash(extentsHash, stored.dataHash);
+		stripe.ready.wait(lock);
 	}
+}
+
+void HashStore::linkFile(ExtentsInfo & info, FileId file) {
+	if (catalog.hasFlag(file, FileCatalog::INDEXED))
+		throw logic_error("File already indexed");
+
+	catalog.previousSameExtents(file) = NO_FILE;
+	catalog.nextSameExtents(file) = info.firstFile;
+	if (info.firstFile != NO_FILE)
+		catalog.previousSameExtents(info.firstFile) = file;
+	info.firstFile = file;
+	info.fileCount++;
+	catalog.setFlag(file, FileCatalog::INDEXED, true);
+}
+
+void HashStore::linkData(uint32_t stripe, uint32_t node) {
+	ExtentsInfo & info = extentsStripes[stripe].extents[node];
+	DataStripe & data = dataStripes[getStripe(info.dataHash)];
+	std::lock_guard<mutex> lock(data.mutex);
+
+	uint32_t link = data.links.allocate();
+	DataInfo & group = data.byData[info.dataHash.getValue()];
+
+	if (group.extentsCount == 0)
+		group.firstLink = ARENA_NONE;
+
+	data.links[link] = DataLink{NODE_ID(stripe, node),
+		group.firstLink, ARENA_NONE};
+	if (group.firstLink != ARENA_NONE)
+		data.links[group.firstLink].previous = link;
+	group.firstLink = link;
+	group.extentsCount++;
+	info.dataLink = link;
+}
+
+void HashStore::unlinkData(const ExtentsInfo & info) {
+	DataStripe & data = dataStripes[getStripe(info.dataHash)];
+	std::lock_guard<mutex> lock(data.mutex);
+
+	DataLink & link = data.links[info.dataLink];
+	DataInfo & group = *data.byData.find(info.dataHash.getValue());
+
+	if (link.previous != ARENA_NONE)
+		data.links[link.previous].next = link.next;
+	else
+		group.firstLink = link.next;
+	if (link.next != ARENA_NONE)
+		data.links[link.next].previous = link.previous;
+	data.links.release(info.dataLink);
 
-	stored.files.insert(file);
+	group.extentsCount--;
+	if (group.extentsCount == 0)
+		data.byData.erase(info.dataHash.getValue());
+}
+
+void HashStore::addFileFromDb(FileId file) {
+	const Hash & extentsHash = catalog.getExtentsHash(file);
+	uint32_t index = getStripe(extentsHash);
+	ExtentsStripe & stripe = extentsStripes[index];
+	unique_lock<mutex> lock(stripe.mutex);
+	bool created;
+	uint32_t node = claimExtents(stripe, lock, extentsHash, created);
+
+	if (created) {
+		stripe.extents[node].dataHash=catalog.getDataHash(file);
+		linkData(index, node);
+		stripe.extents[node].state = READY;
+	}
 
-	db.insertFile(file);
+	linkFile(stripe.extents[node], file);
 }
 
-void HashStore::insertHash(File * file) {
-	Hash & extentsHash = file->extentsHash;
-	ExtentsInfo & stored = byExtents[extentsHash];
-	if (stored.files.empty()) {
-		stored.dataHash=Hasher::getHasher()
-			.hashFromFile(file->getFilename());
-		byData[stored.dataHash].insert(extentsHash);
+void HashStore::newFile(FileId file,
+		const vector<FiemapData> & extents,
+		const Hash & previousExtentsHash) {
+	const Hash extentsHash = catalog.getExtentsHash(file);
+	uint32_t index = getStripe(extentsHash);
+	ExtentsStripe & stripe = extentsStripes[index];
+	unique_lock<mutex> lock(stripe.mutex);
+	bool created;
+	uint32_t node = claimExtents(stripe, lock, extentsHash, created);
+	BlockHashes blocks{blockSize, {}};
+
+	if (created) {
+		Hash dataHash;
+
+		lock.unlock();
+		try {
+			dataHash=Hasher::getHasher()
+				.hashFromFile(catalog.getFilename(file), blocks,
+						&extentHashes);
+		} catch (...) {
+			lock.lock();
+			stripe.byExtents.erase(extentsHash.getValue());
+			stripe.extents.release(node);
+			stripe.ready.notify_all();
+			throw;
+		}
+		lock.lock();
 
-		db.upsertHash(extentsHash, stored.dataHash);
+		stripe.extents[node].dataHash=dataHash;
+		linkData(index, node);
 	}
 
-	stored.files.insert(file);
-	db.updateFile(file);
+	extentHashes.takeAdded([this] (const ExtentKey & key, uint64_t hash) {
+		db.storeExtentHash(key, hash);
+	});
+
+	ExtentsInfo & info = stripe.extents[node];
+	linkFile(info, file);
+	catalog.setDataHash(file, info.dataHash);
+
+	//The hash row is queued before anyone waiting can queue a file
+	db.storeFile(File(*this, file), created, extents, blocks,
+			previousExtentsHash);
+
+	if (created) {
+		info.state = READY;
+		stripe.ready.notify_all();
+	}
 }
 
-void HashStore::insertHashOnly(File * file) {
-	Hash & extentsHash = file->extentsHash;
-	ExtentsInfo & stored = byExtents[extentsHash];
-	if (stored.files.empty()) {
-		stored.dataHash=file->dataHash;
-		byData[stored.dataHash].insert(extentsHash);
+void HashStore::insertHash(FileId file,
+		const vector<FiemapData> & extents,
+		const Hash & previousExtentsHash) {
+	newFile(file, extents, previousExtentsHash);
+}
 
-		db.upsertHash(extentsHash, stored.dataHash);
+void HashStore::insertHashOnly(FileId file,
+		const vector<FiemapData> & extents,
+		const Hash & previousExtentsHash) {
+	const Hash & extentsHash = catalog.getExtentsHash(file);
+	uint32_t index = getStripe(extentsHash);
+	ExtentsStripe & stripe = extentsStripes[index];
+	unique_lock<mutex> lock(stripe.mutex);
+	bool created;
+	uint32_t node = claimExtents(stripe, lock, extentsHash, created);
+
+	if (created) {
+		stripe.extents[node].dataHash=catalog.getDataHash(file);
+		linkData(index, node);
 	}
 
-	stored.files.insert(file);
-	db.updateFile(file);
+	ExtentsInfo & info = stripe.extents[node];
+	linkFile(info, file);
+	catalog.setDataHash(file, info.dataHash);
+
+	db.storeFile(File(*this, file), created, extents, BlockHashes{0, {}},
+			previousExtentsHash);
+
+	if (created) {
+		info.state = READY;
+		stripe.ready.notify_all();
+	}
 }
 
 bool HashStore::hasExtentsHash(const Hash & extentsHash) const {
-	return byExtents.count(extentsHash);
+	ExtentsStripe & stripe = extentsStripes[getStripe(extentsHash)];
+	std::lock_guard<mutex> lock(stripe.mutex);
+
+	return stripe.byExtents.find(extentsHash.getValue()) != NULL;
 }
 
 Hash HashStore::getDataHash(const Hash & extentsHash) const {
-	return byExtents.find(extentsHash)->second.dataHash;
+	ExtentsStripe & stripe = extentsStripes[getStripe(extentsHash)];
+	std::lock_guard<mutex> lock(stripe.mutex);
+
+	return stripe.extents[*stripe.byExtents.find(extentsHash.getValue())
+						  - 1].dataHash;
 }
 
-void HashStore::removeExtentsHash(File * file,
-		const Hash & extentsHash) {
-	ExtentsInfo & stored = byExtents.find(extentsHash)
-			->second;
+FileId HashStore::getFile(const Hash & extentsHash) const {
+	ExtentsStripe & stripe = extentsStripes[getStripe(extentsHash)];
+	std::lock_guard<mutex> lock(stripe.mutex);
+	const uint32_t * node = stripe.byExtents.find(extentsHash.getValue());
 
-	stored.files.erase(file);
+	if (node == NULL || stripe.extents[*node - 1].state != READY)
+		return NO_FILE;
 
-	if (stored.files.empty()) {
-		set <Hash> & storedData=byData.find(stored.dataHash)
-				->second;
-		storedData.erase(extentsHash);
-		if (storedData.empty()) {
-			byData.erase(stored.dataHash);
-		}
+	return stripe.extents[*node - 1].firstFile;
+}
+
+bool HashStore::hasDataHash(const Hash & dataHash) const {
+	DataStripe & data = dataStripes[getStripe(dataHash)];
+	std::lock_guard<mutex> lock(data.mutex);
 
-		byExtents.erase(extentsHash);
+	return data.byData.find(dataHash.getValue()) != NULL;
+}
+
+void HashStore::removeExtentsHash(FileId file,
+		const Hash & extentsHash) {
+	ExtentsStripe & stripe = extentsStripes[getStripe(extentsHash)];
+	std::lock_guard<mutex> lock(stripe.mutex);
+
+	uint32_t node = *stripe.byExtents.find(extentsHash.getValue()) - 1;
+	ExtentsInfo & info = stripe.extents[node];
+	FileId previous = catalog.previousSameExtents(file);
+	FileId next = catalog.nextSameExtents(file);
+
+	if (previous != NO_FILE)
+		catalog.nextSameExtents(previous) = next;
+	else
+		info.firstFile = next;
+	if (next != NO_FILE)
+		catalog.previousSameExtents(next) = previous;
+	catalog.previousSameExtents(file) = NO_FILE;
+	catalog.nextSameExtents(file) = NO_FILE;
+	catalog.setFlag(file, FileCatalog::INDEXED, false);
+	info.fileCount--;
+
+	if (info.fileCount == 0) {
+		unlinkData(info);
+
+		stripe.byExtents.erase(extentsHash.getValue());
+		stripe.extents.release(node);
 	}
 }
 
-void HashStore::updateFileExtentsOnly(File * file, const Hash & oldExtentsHash) {
+void HashStore::updateFileExtentsOnly(FileId file, const Hash & oldExtentsHash,
+		const vector<FiemapData> & extents) {
 	removeExtentsHash(file, oldExtentsHash);
-	insertHashOnly(file);
+	insertHashOnly(file, extents, oldExtentsHash);
 }
 
-void HashStore::removeFile(File * file) {
-	removeExtentsHash(file, file->getExtentsHash());
+void HashStore::removeFile(FileId file) {
+	removeExtentsHash(file, catalog.getExtentsHash(file));
 
-	db.removeFile(file->getFilename());
+	db.removeFile(catalog.getFilename(file));
 }
 
-void HashStore::getDedupeCandidates(map<File *, set<File *>> &
+void HashStore::dropFile(FileId file) {
+	removeExtentsHash(file, catalog.getExtentsHash(file));
+}
+
+void HashStore::forgetData(FileId file, vector<FileId> & files) {
+	if (! catalog.hasFlag(file, FileCatalog::INDEXED))
+		return;
+
+	const Hash extentsHash = catalog.getExtentsHash(file);
+	size_t first = files.size();
+	vector<ExtentKey> keys;
+
+	{
+		ExtentsStripe & stripe = extentsStripes[getStripe(extentsHash)];
+		std::lock_guard<mutex> lock(stripe.mutex);
+		const ExtentsInfo & info = stripe.extents[
+				*stripe.byExtents.find(extentsHash.getValue()) - 1];
+
+		for (FileId same = info.firstFile; same != NO_FILE;
+				same = catalog.getNextSameExtents(same))
+			files.push_back(same);
+	}
+
+	for (size_t i = first; i < files.size(); i++) {
+		removeExtentsHash(files[i], extentsHash);
+		catalog.setFlag(files[i], FileCatalog::CLEAN, false);
+	}
+
+	ExtentHashCache::getKeys(catalog.getFilename(file), keys);
+	for (const ExtentKey & key : keys)
+		if (key.length)
+			extentHashes.remove(key);
+	extentHashes.takeAdded([this] (const ExtentKey & key, uint64_t hash) {
+		db.storeExtentHash(key, hash);
+	});
+}
+
+void HashStore::getDuplicateHashes(vector<DuplicateHash> & hashes) const {
+	vector<unique_lock<mutex>> locks;
+
+	for (ExtentsStripe & stripe : extentsStripes)
+		locks.emplace_back(stripe.mutex);
+	for (DataStripe & data : dataStripes)
+		locks.emplace_back(data.mutex);
+
+	for (const DataStripe & data : dataStripes) {
+		data.byData.forEach([&] (uint64_t dataHash, const DataInfo & group) {
+			if (group.extentsCount < 2)
+				return;
+
+			uint32_t id = data.links[group.firstLink].extentsNode;
+			const ExtentsInfo & info =
+					extentsStripes[NODE_STRIPE(id)].extents[NODE_INDEX(id)];
+			uint64_t size = info.firstFile != NO_FILE ?
+					catalog.getSize(info.firstFile) : 0;
+
+			hashes.push_back(DuplicateHash{dataHash,
+				size * (group.extentsCount - 1)});
+		});
+	}
+}
+
+/*
+ * Never holds an extents stripe and a data stripe together, so the
+ * group is read as two snapshots; copies changed in between are
+ * skipped.
+ */
+bool HashStore::getDuplicateGroup(const Hash & dataHash,
+		DuplicateGroup & group) const {
+	vector<uint32_t> nodes;
+
+	{
+		DataStripe & data = dataStripes[getStripe(dataHash)];
+		std::lock_guard<mutex> lock(data.mutex);
+		const DataInfo * info = data.byData.find(dataHash.getValue());
+
+		if (info == NULL || info->extentsCount < 2)
+			return false;
+
+		for (uint32_t link = info->firstLink; link != ARENA_NONE;
+				link = data.links[link].next)
+			nodes.push_back(data.links[link].extentsNode);
+	}
+
+	group.clear();
+	for (uint32_t id : nodes) {
+		ExtentsStripe & stripe = extentsStripes[NODE_STRIPE(id)];
+		std::lock_guard<mutex> lock(stripe.mutex);
+		const ExtentsInfo & info = stripe.extents[NODE_INDEX(id)];
+
+		if (info.state != READY || info.dataHash != dataHash ||
+				info.firstFile == NO_FILE)
+			continue;
+
+		group.emplace_back();
+		group.back().reserve(info.fileCount);
+		for (FileId file = info.firstFile; file != NO_FILE;
+				file = catalog.getNextSameExtents(file))
+			group.back().push_back(file);
+	}
+
+	return group.size() > 1;
+}
+
+void HashStore::getDedupeCandidates(map<FileId, vector<FileId>> &
 		candidates) const {
+	vector<unique_lock<mutex>> locks;
+
+	for (ExtentsStripe & stripe : extentsStripes)
+		locks.emplace_back(stripe.mutex);
+	for (DataStripe & data : dataStripes)
+		locks.emplace_back(data.mutex);
+
+	auto getNode = [this] (uint32_t id) -> const ExtentsInfo & {
+		return extentsStripes[NODE_STRIPE(id)].extents[NODE_INDEX(id)];
+	};
+
 	//For each dataHash:
-	for (auto & entry : byData) {
-		auto & extentsHashes = entry.second;
-		//If more than one extentsHashes:
-		if (extentsHashes.size() > 1) {
-			size_t max = 0;
-			Hash ref_extentsHash;
-			File * ref_file;
-
-			//Which extentsHash has more files?
-			for (auto & extentsHash : extentsHashes) {
-				auto & files = byExtents.find(extentsHash)->second.files;
-				size_t count = files.size();
-				if (count > max) {
-					max = count;
-					ref_file=*files.begin();
-					ref_extentsHash=extentsHash;
+	for (const DataStripe & data : dataStripes) {
+		data.byData.forEach([&] (uint64_t, const DataInfo & group) {
+			//If more than one extentsHashes:
+			if (group.extentsCount > 1) {
+				size_t max = 0;
+				uint32_t ref_link = ARENA_NONE;
+
+				//Which extentsHash has more files?
+				for (uint32_t link = group.firstLink; link != ARENA_NONE;
+						link = data.links[link].next) {
+					size_t count =
+							getNode(data.links[link].extentsNode).fileCount;
+					if (count > max) {
+						max = count;
+						ref_link = link;
+					}
 				}
-			}
-
-			auto & duplicates = candidates[ref_file];
 
-			//Include every file with different extentsHash
-			for (Hash extentsHash : extentsHashes) {
-				if (extentsHash != ref_extentsHash) {
-					for (auto & file : byExtents.find(extentsHash)->second.files) {
-						duplicates.insert(file);
+				auto & duplicates = candidates[getNode(
+						data.links[ref_link].extentsNode).firstFile];
+
+				//Include every file with different extentsHash
+				for (uint32_t link = group.firstLink; link != ARENA_NONE;
+						link = data.links[link].next) {
+					if (link != ref_link) {
+						for (FileId file =
+								getNode(data.links[link].extentsNode).firstFile;
+								file != NO_FILE;
+								file = catalog.getNextSameExtents(file)) {
+							duplicates.push_back(file);
+						}
 					}
 				}
 			}
-		}
+		});
+	}
+}
+
+size_t HashStore::memoryUsage() const {
+	size_t total = 0;
+
+	for (ExtentsStripe & stripe : extentsStripes) {
+		std::lock_guard<mutex> lock(stripe.mutex);
+		total += stripe.extents.memoryUsage()
+				+ stripe.byExtents.memoryUsage();
+	}
+	for (DataStripe & data : dataStripes) {
+		std::lock_guard<mutex> lock(data.mutex);
+		total += data.links.memoryUsage() + data.byData.memoryUsage();
+	}
+
+	return total;
+}
+
+void HashStore::save(SnapshotWriter & snapshot) const {
+	for (ExtentsStripe & stripe : extentsStripes) {
+		std::lock_guard<mutex> lock(stripe.mutex);
+		stripe.extents.save(snapshot);
+		stripe.byExtents.save(snapshot);
+	}
+	for (DataStripe & data : dataStripes) {
+		std::lock_guard<mutex> lock(data.mutex);
+		data.links.save(snapshot);
+		data.byData.save(snapshot);
+	}
+}
+
+void HashStore::load(SnapshotReader & snapshot) {
+	for (ExtentsStripe & stripe : extentsStripes) {
+		std::lock_guard<mutex> lock(stripe.mutex);
+		stripe.extents.load(snapshot);
+		stripe.byExtents.load(snapshot);
+	}
+	for (DataStripe & data : dataStripes) {
+		std::lock_guard<mutex> lock(data.mutex);
+		data.links.load(snapshot);
+		data.byData.load(snapshot);
 	}
 }
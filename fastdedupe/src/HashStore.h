@@ -8,55 +8,172 @@
 #ifndef HASHSTORE_H_
 #define HASHSTORE_H_
 
+#include <condition_variable>
+#include <cstdint>
 #include <map>
-#include <set>
-
+#include <mutex>
+#include <vector>
+
+#include "Arena.h"
+#include "ExtentHashCache.h"
+#include "FileCatalog.h"
+#include "FilesystemHelper.h"
+#include "FlatHashMap.h"
 #include "Hasher.h"
+#include "Snapshot.h"
+
+#define HASHSTORE_STRIPE_BITS 6
+#define HASHSTORE_STRIPES (1 << HASHSTORE_STRIPE_BITS)
 
 class Database;
-class File;
 
+/*
+ * Index of extents hashes and data hashes, safe to update from several
+ * threads. Both sides are split in stripes by the top bits of the hash,
+ * each with its own lock; an extents stripe is always locked before a
+ * data stripe. Reading the data of a new extents hash is done outside
+ * the lock by the first file claiming it, the others wait until it is
+ * ready.
+ */
 class HashStore {
+public:
+	//Files with the same data, one list per extents hash
+	typedef std::vector<std::vector<FileId>> DuplicateGroup;
+
+	//Data hash with more than one copy, bytes held by the extra copies
+	struct DuplicateHash {
+		Hash dataHash;
+		uint64_t bytes;
+	};
 private:
+	enum State : uint8_t {
+		PENDING,
+		READY
+	};
+
+	//Files sharing extents are chained through the catalog
 	struct ExtentsInfo {
-		std::set <File *> files;
+		Hash extentsHash;
 		Hash dataHash;
+		FileId firstFile;
+		uint32_t fileCount;
+		uint32_t dataLink;
+		State state;
+	};
+
+	//Entry of a same data list, extentsNode is a global node id
+	struct DataLink {
+		uint32_t extentsNode;
+		uint32_t next;
+		uint32_t previous;
+	};
+
+	struct DataInfo {
+		uint32_t firstLink;
+		uint32_t extentsCount;
+	};
+
+	struct ExtentsStripe {
+		std::mutex mutex;
+		std::condition_variable ready;
+		Arena<ExtentsInfo> extents;
+		FlatHashMap<uint32_t> byExtents;
+	};
+
+	struct DataStripe {
+		std::mutex mutex;
+		Arena<DataLink> links;
+		FlatHashMap<DataInfo> byData;
 	};
 
 	Database & db;
+	FileCatalog & catalog;
+	uint32_t blockSize;
+	ExtentHashCache extentHashes;
 
-	std::map<Hash, ExtentsInfo> byExtents;
-	std::map<Hash, std::set<Hash>> byData;
+	mutable ExtentsStripe extentsStripes[HASHSTORE_STRIPES];
+	mutable DataStripe dataStripes[HASHSTORE_STRIPES];
 
-	void removeExtentsHash(File * file, const Hash & extentsHash);
+	static uint32_t getStripe(const Hash & hash);
+
+	uint32_t claimExtents(ExtentsStripe & stripe,
+			std::unique_lock<std::mutex> & lock,
+			const Hash & extentsHash, bool & created);
+
+	void linkFile(ExtentsInfo & info, FileId file);
+
+	void linkData(uint32_t stripe, uint32_t node);
+
+	void unlinkData(const ExtentsInfo & info);
+
+	void removeExtentsHash(FileId file, const Hash & extentsHash);
 
 public:
-	HashStore(Database * db);
+	HashStore(Database * db, FileCatalog * catalog);
 
 	virtual ~HashStore();
 
-	void addFileFromDb(File * file);
+	FileCatalog & getCatalog() const;
+
+	void reserve(size_t files);
+
+	//Block hashes are computed with the data hash when not zero
+	void setBlockSize(uint32_t blockSize);
+
+	FileId getFile(const Hash & extentsHash) const;
+
+	//Chunk hashes of shared extents, used when hashing new files
+	void loadExtentHashes();
 
-	void newFile(File * file);
+	void addFileFromDb(FileId file);
 
-	void insertHash(File * file);
+	//previousExtentsHash is the one the database row was stored under
+	void newFile(FileId file, const std::vector<FiemapData> & extents,
+			const Hash & previousExtentsHash = Hash());
 
-	void insertHashOnly(File * file);
+	void insertHash(FileId file, const std::vector<FiemapData> & extents,
+			const Hash & previousExtentsHash = Hash());
 
-	void insertHash(File * file,
-			const Hash & extentsHash);
+	void insertHashOnly(FileId file,
+			const std::vector<FiemapData> & extents,
+			const Hash & previousExtentsHash);
 
 	bool hasExtentsHash(const Hash & extentsHash) const;
 
 	Hash getDataHash(const Hash & extentsHash) const;
 
-	void updateFileExtentsOnly(File * file, const Hash & oldExtentsHash);
+	bool hasDataHash(const Hash & dataHash) const;
 
-	void removeFile(File * file);
+	void updateFileExtentsOnly(FileId file, const Hash & oldExtentsHash,
+			const std::vector<FiemapData> & extents);
+
+	void removeFile(FileId file);
+
+	//As removeFile, the database left as it is
+	void dropFile(FileId file);
+
+	/*
+	 * Drops the extents hash of file with its data hash, and the cached
+	 * chunk hashes of its extents. The files sharing it are added to
+	 * files, each to be hashed again.
+	 */
+	void forgetData(FileId file, std::vector<FileId> & files);
+
+	void getDuplicateHashes(std::vector<DuplicateHash> & hashes) const;
+
+	bool getDuplicateGroup(const Hash & dataHash,
+			DuplicateGroup & group) const;
 
 	void getDedupeCandidates(
-			std::map<File *, std::set<File *>> &
+			std::map<FileId, std::vector<FileId>> &
 			candidates) const;
+
+	size_t memoryUsage() const;
+
+	//Both with no file being hashed, load() into an empty store
+	void save(SnapshotWriter & snapshot) const;
+
+	void load(SnapshotReader & snapshot);
 };
 
 #endif /* HASHSTORE_H_ */
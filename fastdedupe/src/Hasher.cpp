@@ -6,7 +6,12 @@
  */
 
 #include "Hasher.h"
+#include "ExtentHashCache.h"
+#include "Stats.h"
+#include "Throttle.h"
+#include "Trace.h"
 
+#include <chrono>
 #include <exception>
 #include <fstream>
 #include <iomanip>
@@ -24,9 +29,10 @@ using std::setfill;
 using std::runtime_error;
 using std::stringstream;
 using std::memcpy;
+using std::vector;
 typedef Hasher::hash hash;
 
-Hasher Hasher::hasher;
+thread_local Hasher Hasher::hasher;
 
 ostream& operator<<(ostream & out, const Hash & in) {
 	XXH64_canonical_t canonical;
@@ -67,6 +73,10 @@ void Hash::getBinHash(char (&data) [HASH_LENGTH]) const {
 	memcpy(data, canonical.digest, HASH_LENGTH);
 }
 
+XXH64_hash_t Hash::getValue() const {
+	return hash_data;
+}
+
 Hash::operator string() const {
 	stringstream sbuilder;
 
@@ -115,19 +125,82 @@ Hasher::~Hasher() {
 }
 
 hash Hasher::hashFromFile(string const & filename) {
+	BlockHashes blocks{0, {}};
+
+	return hashFromFile(filename, blocks);
+}
+
+hash Hasher::hashFromFile(string const & filename, BlockHashes & blocks,
+		ExtentHashCache * cache) {
+	Stats::Timer timer(Stats::HASH);
+	Throttle & throttle = Throttle::getThrottle();
+	uint64_t read = 0;
+
 	if (XXH64_reset(state, HASHER_SEED) != 0)
 			throw runtime_error("Unable to reset XXH64");
 
+	vector<ExtentKey> keys, unshared;
+	if (cache) {
+		ExtentHashCache::getKeys(filename, keys,
+				cache->size() ? &unshared : NULL);
+		for (const ExtentKey & key : unshared)
+			cache->remove(key);
+	}
+
 	ifstream input(filename);
 
 	if (! input.is_open())
 		throw runtime_error("Unable to open");
 
-	while (input.good()) {
-
-		input.read(buffer, HASHER_BUFFER_SIZE);
+	blocks.hashes.clear();
+
+	for (size_t chunk = 0, offset = 0; input.good(); chunk++) {
+		const ExtentKey * key = chunk < keys.size() &&
+				keys[chunk].length ? &keys[chunk] : NULL;
+		uint64_t chunkHash;
+		char raw [HASH_LENGTH];
+
+		if (key && ! blocks.blockSize && cache->find(*key, chunkHash)) {
+			offset += key->length;
+			input.seekg(offset);
+		} else {
+			std::chrono::steady_clock::time_point start;
+			if (throttle.isEnabled())
+				start = std::chrono::steady_clock::now();
+			{
+				TRACE_SCOPE_ARG(hash_read, offset);
+				input.read(buffer, HASHER_BUFFER_SIZE);
+			}
+
+			size_t length = input.gcount();
+			if (length == 0)
+				break;
+
+			if (throttle.isEnabled()) {
+				throttle.observe(std::chrono::steady_clock::now() - start);
+				throttle.acquire(length);
+			}
+
+			offset += length;
+			read += length;
+			timer.setBytes(read);
+			{
+				TRACE_SCOPE_ARG(hash_digest, length);
+				chunkHash = hashFromBytes(buffer, length).getValue();
+			}
+			if (key && key->length == length)
+				cache->add(*key, chunkHash);
+
+			//Reads fill the buffer up to the end of the file
+			for (size_t block = 0; blocks.blockSize &&
+					block + blocks.blockSize <= length;
+					block += blocks.blockSize)
+				blocks.hashes.push_back(hashFromBytes(buffer + block,
+						blocks.blockSize).getValue());
+		}
 
-		if (XXH64_update(state, buffer, input.gcount()) != 0) {
+		Hash(chunkHash).getBinHash(raw);
+		if (XXH64_update(state, raw, HASH_LENGTH) != 0) {
 				throw runtime_error("Unable to update XXH64");
 		}
 	}
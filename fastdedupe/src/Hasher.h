@@ -9,12 +9,16 @@
 #define HASHER_H_
 
 #include <xxhash.h>
+#include <cstdint>
 #include <string>
 #include <ostream>
+#include <vector>
 
 #define HASH_LENGTH sizeof(XXH64_hash_t)
 #define HASHER_SEED 0
 #define HASHER_BUFFER_SIZE 4*1024*1024
+//Data hashes are built from chunk hashes since version 2
+#define HASH_VERSION 2
 
 class Hash {
 	typedef XXH64_canonical_t bin_hash;
@@ -29,6 +33,8 @@ public:
 
 	void getBinHash(char (&data) [HASH_LENGTH]) const;
 
+	XXH64_hash_t getValue() const;
+
 	operator std::string() const;
 
 	friend std::ostream& operator<<(std::ostream & out, const Hash & in);
@@ -42,12 +48,26 @@ public:
 	size_t length() const;
 };
 
+//Hashes of the whole aligned blocks of some data, the tail is left out
+struct BlockHashes {
+	uint32_t blockSize = 0;
+	std::vector<uint64_t> hashes;
+};
+
+class ExtentHashCache;
+
+/*
+ * Data hashes are XXH64 over the canonical XXH64 of each chunk of
+ * HASHER_BUFFER_SIZE bytes, so a chunk hash known from elsewhere stands
+ * for reading it.
+ */
 class Hasher {
 public:
 	typedef Hash hash;
 
 private:
-	static Hasher hasher;
+	//One instance per thread, each with its own read buffer
+	static thread_local Hasher hasher;
 	char * const buffer;
 	XXH64_state_t* const state;
 	Hasher();
@@ -58,6 +78,14 @@ public:
 
 	hash hashFromFile(std::string const & filename);
 
+	/*
+	 * Also fills blocks, whose blockSize must divide HASHER_BUFFER_SIZE.
+	 * Chunks found in cache are not read unless blocks are wanted, the
+	 * ones read from shared extents are added to it.
+	 */
+	hash hashFromFile(std::string const & filename, BlockHashes & blocks,
+			ExtentHashCache * cache = NULL);
+
 	hash hashFromBytes(char const * stream, size_t length);
 };
 
@@ -0,0 +1,137 @@
+/*
+ * JsonWriter.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "JsonWriter.h"
+
+#include <cstdio>
+
+using std::ostream;
+using std::string;
+
+JsonWriter::JsonWriter(ostream & out) :
+	out(out),
+	afterKey(false) {
+}
+
+JsonWriter::~JsonWriter() {
+}
+
+void JsonWriter::separate() {
+	if (afterKey) {
+		afterKey = false;
+		return;
+	}
+
+	if (! scopes.empty()) {
+		if (scopes.back())
+			out << ",";
+		scopes.back() = true;
+	}
+}
+
+void JsonWriter::writeString(const string & value) {
+	out << '"';
+
+	for (unsigned char c : value) {
+		switch (c) {
+		case '"':
+			out << "\\\"";
+			break;
+		case '\\':
+			out << "\\\\";
+			break;
+		case '\n':
+			out << "\\n";
+			break;
+		case '\t':
+			out << "\\t";
+			break;
+		default:
+			if (c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out << escaped;
+			} else {
+				out << c;
+			}
+		}
+	}
+
+	out << '"';
+}
+
+JsonWriter & JsonWriter::beginObject() {
+	separate();
+	out << "{";
+	scopes.push_back(false);
+	return *this;
+}
+
+JsonWriter & JsonWriter::endObject() {
+	scopes.pop_back();
+	out << "}";
+	if (scopes.empty())
+		out << "\n";
+	return *this;
+}
+
+JsonWriter & JsonWriter::beginArray() {
+	separate();
+	out << "[";
+	scopes.push_back(false);
+	return *this;
+}
+
+JsonWriter & JsonWriter::endArray() {
+	scopes.pop_back();
+	out << "]";
+	if (scopes.empty())
+		out << "\n";
+	return *this;
+}
+
+JsonWriter & JsonWriter::key(const string & name) {
+	separate();
+	writeString(name);
+	out << ":";
+	afterKey = true;
+	return *this;
+}
+
+JsonWriter & JsonWriter::value(const string & value) {
+	separate();
+	writeString(value);
+	return *this;
+}
+
+JsonWriter & JsonWriter::value(const char * value) {
+	return this->value(string(value));
+}
+
+JsonWriter & JsonWriter::value(uint64_t value) {
+	separate();
+	out << value;
+	return *this;
+}
+
+JsonWriter & JsonWriter::value(int64_t value) {
+	separate();
+	out << value;
+	return *this;
+}
+
+JsonWriter & JsonWriter::value(double value) {
+	separate();
+	out << value;
+	return *this;
+}
+
+JsonWriter & JsonWriter::value(bool value) {
+	separate();
+	out << (value ? "true" : "false");
+	return *this;
+}
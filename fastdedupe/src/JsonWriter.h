@@ -0,0 +1,58 @@
+/*
+ * JsonWriter.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef JSONWRITER_H_
+#define JSONWRITER_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Streaming JSON output, commas and nesting are tracked here so callers
+ * only describe the structure.
+ */
+class JsonWriter {
+private:
+	std::ostream & out;
+	//One entry per open object or array, true once it has members
+	std::vector<bool> scopes;
+	bool afterKey;
+
+	void separate();
+
+	void writeString(const std::string & value);
+public:
+	JsonWriter(std::ostream & out);
+
+	virtual ~JsonWriter();
+
+	JsonWriter & beginObject();
+
+	JsonWriter & endObject();
+
+	JsonWriter & beginArray();
+
+	JsonWriter & endArray();
+
+	JsonWriter & key(const std::string & name);
+
+	JsonWriter & value(const std::string & value);
+
+	JsonWriter & value(const char * value);
+
+	JsonWriter & value(uint64_t value);
+
+	JsonWriter & value(int64_t value);
+
+	JsonWriter & value(double value);
+
+	JsonWriter & value(bool value);
+};
+
+#endif /* JSONWRITER_H_ */
@@ -0,0 +1,824 @@
+/*
+ * LogDatabase.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "LogDatabase.h"
+#include "Stats.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+using std::map;
+using std::memcpy;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+typedef Hasher::hash hash;
+
+static size_t alignRecord(size_t length) {
+	return (length + 7) & ~(size_t) 7;
+}
+
+LogDatabase::LogDatabase(const string & filename) :
+	filename(filename),
+	fd(openLog(filename, false)),
+	length(0),
+	compacting(false),
+	id(0),
+	generation(0),
+	knownVersion(0),
+	versionKnown(false),
+	foreignWrites(false),
+	buffered(0),
+	records(0),
+	liveEntries(0) {
+	try {
+		FileLock lock(*this);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+}
+
+LogDatabase::~LogDatabase() {
+	try {
+		flush();
+	} catch (runtime_error &) {
+	}
+
+	close(fd);
+}
+
+LogDatabase::FileLock::FileLock(LogDatabase & log) :
+	log(log) {
+	log.lock();
+}
+
+LogDatabase::FileLock::~FileLock() {
+	flock(log.fd, LOCK_UN);
+}
+
+int LogDatabase::openLog(const string & filename, bool truncate) {
+	int fd = ::open(filename.c_str(), O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC|
+			(truncate ? O_TRUNC : 0), 0644);
+
+	if (fd == -1)
+		throw runtime_error(filename + ": " + strerror(errno));
+
+	return fd;
+}
+
+size_t LogDatabase::headerLength(uint32_t version) {
+	return version < 8 ? offsetof(LogHeader, id) : sizeof(LogHeader);
+}
+
+LogDatabase::LogHeader LogDatabase::makeHeader() {
+	LogHeader header{};
+
+	memcpy(header.magic, LOG_DATABASE_MAGIC, sizeof(header.magic));
+	header.version = LOG_DATABASE_VERSION;
+
+	if (! id) {
+		std::random_device random;
+
+		id = (uint64_t) random() << 32 | random();
+	}
+	header.id = id;
+	header.generation = generation;
+
+	return header;
+}
+
+void LogDatabase::lock() {
+	while (true) {
+		struct stat opened, current;
+
+		if (flock(fd, LOCK_EX) == -1 || fstat(fd, &opened) == -1)
+			throw runtime_error(filename + ": " + strerror(errno));
+
+		if (stat(filename.c_str(), &current) == 0 &&
+				current.st_dev == opened.st_dev &&
+				current.st_ino == opened.st_ino)
+			break;
+
+		//Another run compacted it, the new log holds all we had written
+		int reopened = openLog(filename, false);
+		close(fd);
+		fd = reopened;
+		reset();
+	}
+
+	try {
+		load();
+	} catch (...) {
+		flock(fd, LOCK_UN);
+		throw;
+	}
+
+	if (versionKnown && generation != knownVersion)
+		foreignWrites = true;
+	knownVersion = generation;
+}
+
+void LogDatabase::reset() {
+	paths.clear();
+	entries.clear();
+	layouts.clear();
+	blocks.clear();
+	extentHashes.clear();
+	generations.clear();
+	verified.clear();
+	length = 0;
+	records = 0;
+	liveEntries = 0;
+}
+
+//Reads what was appended since the last call, all of it the first time
+void LogDatabase::load() {
+	struct stat statData;
+
+	if (fstat(fd, &statData) == -1)
+		throw runtime_error(strerror(errno));
+
+	size_t size = statData.st_size;
+
+	if (size == 0) {
+		id = 0;
+		generation = 0;
+
+		LogHeader header = makeHeader();
+
+		length = 0;
+		buffer.insert(0, (const char *) &header, sizeof(header));
+		writeBuffer();
+		return;
+	}
+
+	if (size == length)
+		return;
+	if (size < length)
+		throw runtime_error(filename + ": truncated by another run");
+
+	if (size < headerLength(1))
+		throw runtime_error(filename + ": not a fastdedupe log");
+
+	const char * data = (const char *) mmap(NULL, size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		throw runtime_error(strerror(errno));
+
+	madvise((void *) data, size, MADV_SEQUENTIAL);
+
+	LogHeader header{};
+	memcpy(&header, data, std::min(size, sizeof(header)));
+
+	if (memcmp(header.magic, LOG_DATABASE_MAGIC, sizeof(header.magic))
+			|| header.version < 1
+			|| header.version > LOG_DATABASE_VERSION
+			|| size < headerLength(header.version)) {
+		munmap((void *) data, size);
+		throw runtime_error(filename + ": unsupported log format");
+	}
+
+	if (header.version >= 8) {
+		id = header.id;
+		generation = header.generation;
+	}
+
+	bool first = ! length;
+	size_t offset = applyRecords(data,
+			first ? headerLength(header.version) : length, size);
+
+	munmap((void *) data, size);
+
+	//Drop whatever a crash left half written
+	if (offset < size && ftruncate(fd, offset) == -1)
+		throw runtime_error(strerror(errno));
+
+	length = offset;
+
+	if (! first)
+		return;
+
+	//Data hashes are now built from chunk hashes, older entries are kept
+	//until a run hashes their files again
+	if (header.version < 4)
+		for (Entry & entry : entries)
+			entry.hashVersion = 1;
+
+	//Read again after a compaction, what is still to be written stands
+	applyRecords(buffer.data(), 0, buffer.size());
+
+	//Older readers would cut the log at the first record they lack
+	if (header.version < LOG_DATABASE_VERSION)
+		compact();
+}
+
+size_t LogDatabase::applyRecords(const char * data, size_t offset,
+		size_t size) {
+	Hasher & hasher = Hasher::getHasher();
+
+	while (offset + sizeof(RecordHeader) <= size) {
+		RecordHeader record;
+		memcpy(&record, data + offset, sizeof(record));
+
+		size_t total = alignRecord(sizeof(RecordHeader) + record.length);
+		if (total > size - offset)
+			break;
+
+		const char * payload = data + offset + sizeof(RecordHeader);
+		char checksum[HASH_LENGTH];
+		hasher.hashFromBytes(payload, record.length).getBinHash(checksum);
+		if (memcmp(checksum, record.checksum, HASH_LENGTH))
+			break;
+
+		bool valid = true;
+
+		if (record.type == PUT_PATH_RECORD
+				&& record.length >= sizeof(PutPathRecord)) {
+			PutPathRecord put;
+			memcpy(&put, payload, sizeof(put));
+
+			valid = sizeof(put) + put.pathLength == record.length;
+			if (valid) {
+				Entry & entry = entries[getPathId(
+						string(payload + sizeof(put), put.pathLength))];
+
+				if (! entry.live)
+					liveEntries++;
+
+				entry = Entry{(std::time_t) put.mTime, put.size,
+					hash(put.extentsHash), hash(put.dataHash), true,
+					put.hashVersion};
+			}
+		} else if (record.type == REMOVE_PATH_RECORD
+				&& record.length >= sizeof(RemovePathRecord)) {
+			RemovePathRecord remove;
+			memcpy(&remove, payload, sizeof(remove));
+
+			valid = sizeof(remove) + remove.pathLength == record.length;
+			if (valid) {
+				auto it = paths.find(string(payload + sizeof(remove),
+						remove.pathLength));
+
+				if (it != paths.end() && entries[it->second].live) {
+					entries[it->second].live = false;
+					liveEntries--;
+				}
+			}
+		} else if (record.type == PATH_RECORD
+				&& record.length >= sizeof(PathRecord)) {
+			PathRecord path;
+			memcpy(&path, payload, sizeof(path));
+
+			valid = sizeof(path) + path.length == record.length;
+			if (valid) {
+				if (path.pathId >= entries.size())
+					entries.resize(path.pathId + 1,
+							Entry{0, 0, Hash(), Hash(), false, HASH_VERSION});
+
+				paths[string(payload + sizeof(path), path.length)] =
+						path.pathId;
+			}
+		} else if (record.type == PUT_RECORD
+				&& record.length == sizeof(PutRecord)) {
+			PutRecord put;
+			memcpy(&put, payload, sizeof(put));
+
+			valid = put.pathId < entries.size();
+			if (valid) {
+				Entry & entry = entries[put.pathId];
+
+				if (! entry.live)
+					liveEntries++;
+
+				entry = Entry{(std::time_t) put.mTime, put.size,
+					hash(put.extentsHash), hash(put.dataHash), true,
+					HASH_VERSION};
+			}
+		} else if (record.type == EXTENTS_RECORD
+				&& record.length >= sizeof(ExtentsRecord)) {
+			ExtentsRecord extents;
+			memcpy(&extents, payload, sizeof(extents));
+
+			valid = sizeof(extents) + extents.count * sizeof(FiemapData)
+					== record.length;
+			if (valid) {
+				vector<FiemapData> & layout =
+						layouts[hash(extents.extentsHash).getValue()];
+
+				layout.resize(extents.count);
+				memcpy(layout.data(), payload + sizeof(extents),
+						extents.count * sizeof(FiemapData));
+			}
+		} else if (record.type == BLOCKS_RECORD
+				&& record.length >= sizeof(BlocksRecord)) {
+			BlocksRecord hashes;
+			memcpy(&hashes, payload, sizeof(hashes));
+
+			valid = sizeof(hashes) + hashes.count * sizeof(uint64_t)
+					== record.length;
+			if (valid) {
+				BlockHashes & stored =
+						blocks[hash(hashes.extentsHash).getValue()];
+
+				stored.blockSize = hashes.blockSize;
+				stored.hashes.resize(hashes.count);
+				memcpy(stored.hashes.data(), payload + sizeof(hashes),
+						hashes.count * sizeof(uint64_t));
+			}
+		} else if (record.type == EXTENT_HASH_RECORD
+				&& record.length == sizeof(ExtentHashRecord)) {
+			ExtentHashRecord extentHash;
+			memcpy(&extentHash, payload, sizeof(extentHash));
+
+			extentHashes.insert(extentHash.key, extentHash.hash);
+		} else if (record.type == GENERATION_RECORD
+				&& record.length >= sizeof(GenerationRecord)) {
+			GenerationRecord generation;
+			memcpy(&generation, payload, sizeof(generation));
+
+			valid = sizeof(generation) + generation.rootLength
+					+ generation.uuidLength == record.length;
+			if (valid) {
+				const char * root = payload + sizeof(generation);
+
+				generations[string(root, generation.rootLength)] =
+						BtrfsGeneration{string(root + generation.rootLength,
+								generation.uuidLength),
+						generation.generation};
+			}
+		} else if (record.type == VERIFIED_RECORD
+				&& record.length >= sizeof(VerifiedRecord)) {
+			VerifiedRecord checked;
+			memcpy(&checked, payload, sizeof(checked));
+
+			valid = sizeof(checked) + checked.pathLength == record.length;
+			if (valid) {
+				string path(payload + sizeof(checked), checked.pathLength);
+
+				if (checked.time)
+					verified[path] = checked.time;
+				else
+					verified.erase(path);
+			}
+		} else if (record.type == REMOVE_RECORD
+				&& record.length == sizeof(RemoveRecord)) {
+			RemoveRecord remove;
+			memcpy(&remove, payload, sizeof(remove));
+
+			valid = remove.pathId < entries.size();
+			if (valid && entries[remove.pathId].live) {
+				entries[remove.pathId].live = false;
+				liveEntries--;
+			}
+		} else {
+			valid = false;
+		}
+
+		if (! valid)
+			break;
+
+		records++;
+		offset += total;
+	}
+
+	return offset;
+}
+
+void LogDatabase::append(RecordType type, const void * payload,
+		size_t length, const char * extra, size_t extraLength) {
+	size_t start = buffer.size();
+	RecordHeader header{type, (uint32_t) (length + extraLength), {}};
+
+	buffer.append((const char *) &header, sizeof(header));
+	buffer.append((const char *) payload, length);
+	if (extraLength)
+		buffer.append(extra, extraLength);
+	buffer.resize(start + alignRecord(sizeof(header) + length + extraLength),
+			'\0');
+
+	Hasher::getHasher()
+		.hashFromBytes(&buffer[start + sizeof(header)], header.length)
+		.getBinHash(header.checksum);
+	memcpy(&buffer[start], &header, sizeof(header));
+
+	records++;
+	buffered++;
+
+	if (buffer.size() >= LOG_BUFFER_SIZE && compacting) {
+		writeBuffer();
+	} else if (buffer.size() >= LOG_BUFFER_SIZE) {
+		FileLock lock(*this);
+		writeBuffer();
+	}
+}
+
+uint32_t LogDatabase::getPathId(const string & filename) {
+	auto it = paths.find(filename);
+
+	if (it != paths.end())
+		return it->second;
+
+	uint32_t pathId = entries.size();
+
+	entries.push_back(Entry{0, 0, Hash(), Hash(), false, HASH_VERSION});
+	paths.emplace(filename, pathId);
+
+	return pathId;
+}
+
+void LogDatabase::writePut(const string & path, const Entry & entry) {
+	PutPathRecord put{entry.mTime, entry.size, {}, {},
+		(uint32_t) path.size(), entry.hashVersion};
+
+	entry.extentsHash.getBinHash(put.extentsHash);
+	entry.dataHash.getBinHash(put.dataHash);
+
+	append(PUT_PATH_RECORD, &put, sizeof(put), path.data(), path.size());
+}
+
+void LogDatabase::writeRemove(const string & path) {
+	RemovePathRecord remove{(uint32_t) path.size(), 0};
+
+	append(REMOVE_PATH_RECORD, &remove, sizeof(remove), path.data(),
+			path.size());
+}
+
+void LogDatabase::writeExtents(const Hash & extentsHash,
+		const vector<FiemapData> & extents) {
+	ExtentsRecord record{{}, (uint32_t) extents.size(), 0};
+
+	extentsHash.getBinHash(record.extentsHash);
+
+	append(EXTENTS_RECORD, &record, sizeof(record),
+			(const char *) extents.data(),
+			extents.size() * sizeof(FiemapData));
+}
+
+void LogDatabase::writeBlocks(const Hash & extentsHash,
+		const BlockHashes & hashes) {
+	BlocksRecord record{{}, hashes.blockSize,
+		(uint32_t) hashes.hashes.size()};
+
+	extentsHash.getBinHash(record.extentsHash);
+
+	append(BLOCKS_RECORD, &record, sizeof(record),
+			(const char *) hashes.hashes.data(),
+			hashes.hashes.size() * sizeof(uint64_t));
+}
+
+void LogDatabase::writeExtentHash(const ExtentKey & key, uint64_t hash) {
+	ExtentHashRecord record{key, hash};
+
+	append(EXTENT_HASH_RECORD, &record, sizeof(record));
+}
+
+void LogDatabase::writeGeneration(const string & root,
+		const BtrfsGeneration & generation) {
+	GenerationRecord record{generation.generation, (uint32_t) root.size(),
+		(uint32_t) generation.uuid.size()};
+	string names = root + generation.uuid;
+
+	append(GENERATION_RECORD, &record, sizeof(record), names.data(),
+			names.size());
+}
+
+void LogDatabase::writeVerified(const string & path, std::time_t time) {
+	VerifiedRecord record{time, (uint32_t) path.size(), 0};
+
+	append(VERIFIED_RECORD, &record, sizeof(record), path.data(),
+			path.size());
+}
+
+void LogDatabase::writeBuffer() {
+	Stats::Timer timer(Stats::DATABASE);
+	size_t written = 0;
+
+	if (buffer.empty())
+		return;
+
+	timer.setBytes(buffer.size());
+
+	//After what load() read, the end of the log under the lock
+	while (written < buffer.size()) {
+		ssize_t result = pwrite(fd, buffer.data() + written,
+				buffer.size() - written, length + written);
+
+		if (result == -1) {
+			if (errno == EINTR)
+				continue;
+			throw runtime_error(filename + ": " + strerror(errno));
+		}
+
+		written += result;
+	}
+
+	//A new log and a compaction write their header along
+	if (length && ! compacting) {
+		uint64_t next = generation + 1;
+
+		if (pwrite(fd, &next, sizeof(next),
+				offsetof(LogHeader, generation)) != sizeof(next))
+			throw runtime_error(filename + ": " + strerror(errno));
+		generation = next;
+		knownVersion = next;
+	}
+
+	if (fdatasync(fd) == -1)
+		throw runtime_error(filename + ": " + strerror(errno));
+
+	length += written;
+	buffer.clear();
+	buffered = 0;
+}
+
+bool LogDatabase::needsCompaction() const {
+	//A live entry takes a put record, an extent hash one
+	return records > LOG_COMPACT_MIN_RECORDS &&
+			records > (liveEntries + extentHashes.size() +
+					generations.size() + verified.size()) * 2;
+}
+
+void LogDatabase::compact() {
+	writeBuffer();
+
+	string temporary = filename + ".compact";
+	int oldFd = fd;
+	size_t oldLength = length;
+	uint64_t oldGeneration = generation;
+	map<string, uint32_t> oldPaths;
+	vector<Entry> oldEntries;
+	std::unordered_map<uint64_t, vector<FiemapData>> oldLayouts;
+	std::unordered_map<uint64_t, BlockHashes> oldBlocks;
+
+	oldPaths.swap(paths);
+	oldEntries.swap(entries);
+	oldLayouts.swap(layouts);
+	oldBlocks.swap(blocks);
+	records = 0;
+	liveEntries = 0;
+
+	try {
+		//Held until the caller unlocks, past the rename
+		fd = openLog(temporary, true);
+		length = 0;
+		compacting = true;
+		if (flock(fd, LOCK_EX) == -1)
+			throw runtime_error(temporary + ": " + strerror(errno));
+
+		generation++;
+		LogHeader header = makeHeader();
+		buffer.append((const char *) &header, sizeof(header));
+
+		for (auto & path : oldPaths) {
+			const Entry & entry = oldEntries[path.second];
+
+			if (entry.live) {
+				entries[getPathId(path.first)] = entry;
+				writePut(path.first, entry);
+				liveEntries++;
+
+				//Only layouts and blocks still referenced survive
+				auto layout = oldLayouts.find(entry.extentsHash.getValue());
+				if (layout != oldLayouts.end() &&
+						! layouts.count(layout->first)) {
+					writeExtents(entry.extentsHash, layout->second);
+					layouts.emplace(layout->first, layout->second);
+				}
+				auto hashes = oldBlocks.find(entry.extentsHash.getValue());
+				if (hashes != oldBlocks.end() &&
+						! blocks.count(hashes->first)) {
+					writeBlocks(entry.extentsHash, hashes->second);
+					blocks.emplace(hashes->first, hashes->second);
+				}
+			}
+		}
+
+		extentHashes.forEach([this] (const ExtentKey & key, uint64_t hash) {
+			writeExtentHash(key, hash);
+		});
+
+		for (auto & generation : generations)
+			writeGeneration(generation.first, generation.second);
+
+		for (auto & checked : verified)
+			writeVerified(checked.first, checked.second);
+
+		writeBuffer();
+		compacting = false;
+
+		if (rename(temporary.c_str(), filename.c_str()) == -1)
+			throw runtime_error(temporary + ": " + strerror(errno));
+		knownVersion = generation;
+	} catch (...) {
+		compacting = false;
+		generation = oldGeneration;
+		buffer.clear();
+		buffered = 0;
+		if (fd != oldFd) {
+			close(fd);
+			unlink(temporary.c_str());
+		}
+		fd = oldFd;
+		length = oldLength;
+		paths.swap(oldPaths);
+		entries.swap(oldEntries);
+		layouts.swap(oldLayouts);
+		blocks.swap(oldBlocks);
+		throw;
+	}
+
+	close(oldFd);
+}
+
+FileRecord LogDatabase::toRecord(const string & filename,
+		const Entry & entry) const {
+	FileRecord record{filename, entry.mTime, entry.size,
+		entry.extentsHash, entry.dataHash};
+
+	record.hashVersion = entry.hashVersion;
+	return record;
+}
+
+void LogDatabase::storeRecord(const FileRecord & record, bool storeHash) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (storeHash && ! record.extents.empty()) {
+		layouts[record.extentsHash.getValue()] = record.extents;
+		writeExtents(record.extentsHash, record.extents);
+	}
+	if (storeHash && ! record.blocks.hashes.empty()) {
+		blocks[record.extentsHash.getValue()] = record.blocks;
+		writeBlocks(record.extentsHash, record.blocks);
+	}
+
+	uint32_t pathId = getPathId(record.filename);
+	Entry & entry = entries[pathId];
+
+	if (! entry.live)
+		liveEntries++;
+
+	entry = Entry{record.mTime, record.size,
+		record.extentsHash, record.dataHash, true, record.hashVersion};
+
+	writePut(record.filename, entry);
+}
+
+void LogDatabase::removeFile(const string & filename) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	auto it = paths.find(filename);
+
+	if (it == paths.end() || ! entries[it->second].live)
+		return;
+
+	entries[it->second].live = false;
+	liveEntries--;
+	writeRemove(filename);
+}
+
+void LogDatabase::flush() {
+	std::lock_guard<std::mutex> lock(mutex);
+	FileLock fileLock(*this);
+
+	writeBuffer();
+
+	if (needsCompaction())
+		compact();
+}
+
+size_t LogDatabase::getBacklog() const {
+	return buffered.load();
+}
+
+void LogDatabase::loadFiles(const string & pattern,
+		const RecordCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (pattern.empty()) {
+		for (auto & path : paths)
+			if (entries[path.second].live)
+				callback(toRecord(path.first, entries[path.second]));
+		return;
+	}
+
+	auto it = paths.find(pattern);
+	if (it != paths.end() && entries[it->second].live)
+		callback(toRecord(it->first, entries[it->second]));
+
+	string prefix = pattern + "/";
+	for (it = paths.lower_bound(prefix);
+			it != paths.end() &&
+			it->first.compare(0, prefix.length(), prefix) == 0;
+			it++) {
+		if (entries[it->second].live)
+			callback(toRecord(it->first, entries[it->second]));
+	}
+}
+
+void LogDatabase::loadExtents(const ExtentsCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (auto & layout : layouts)
+		callback(Hash(layout.first), layout.second);
+}
+
+void LogDatabase::loadBlocks(const BlocksCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (auto & hashes : blocks)
+		callback(Hash(hashes.first), hashes.second);
+}
+
+void LogDatabase::storeExtentHash(const ExtentKey & key, uint64_t hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	extentHashes.insert(key, hash);
+	writeExtentHash(key, hash);
+}
+
+void LogDatabase::loadExtentHashes(
+		const ExtentHashCache::EntryCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	extentHashes.forEach(callback);
+}
+
+void LogDatabase::storeGeneration(const string & root,
+		const BtrfsGeneration & generation) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	generations[root] = generation;
+	writeGeneration(root, generation);
+}
+
+bool LogDatabase::loadGeneration(const string & root,
+		BtrfsGeneration & generation) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto stored = generations.find(root);
+
+	if (stored == generations.end())
+		return false;
+
+	generation = stored->second;
+	return true;
+}
+
+void LogDatabase::storeVerified(const string & path, std::time_t time) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (time)
+		verified[path] = time;
+	else if (! verified.erase(path))
+		return;
+	writeVerified(path, time);
+}
+
+void LogDatabase::loadVerified(const string & root,
+		const VerifiedCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+	string prefix = root + "/";
+
+	for (auto checked = verified.lower_bound(prefix);
+			checked != verified.end() &&
+			! checked->first.compare(0, prefix.size(), prefix); checked++)
+		callback(checked->first, checked->second);
+}
+
+void LogDatabase::cleanHashes() {
+	std::lock_guard<std::mutex> lock(mutex);
+	FileLock fileLock(*this);
+
+	extentHashes.clear();
+	compact();
+}
+
+//The length tells apart a batch a crash left without its bump
+string LogDatabase::getVersion() {
+	std::lock_guard<std::mutex> lock(mutex);
+	FileLock fileLock(*this);
+
+	writeBuffer();
+	if (needsCompaction())
+		compact();
+	versionKnown = true;
+
+	return foreignWrites ? "" : std::to_string(id) + ":" +
+			std::to_string(generation) + ":" + std::to_string(length);
+}
@@ -0,0 +1,273 @@
+/*
+ * LogDatabase.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef LOGDATABASE_H_
+#define LOGDATABASE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Database.h"
+#include "Hasher.h"
+
+#define LOG_DATABASE_EXTENSION ".fdlog"
+#define LOG_DATABASE_MAGIC "FDDBLOG1"
+#define LOG_DATABASE_VERSION 8
+#define LOG_BUFFER_SIZE 1024*1024
+#define LOG_COMPACT_MIN_RECORDS 65536
+
+/*
+ * Append-only log of put, remove, extents, blocks, extent hash,
+ * generation and verified records, read back through a single mmap at
+ * startup. Every record is checksummed, a torn tail left by a crash is
+ * truncated on the next open. The log is rewritten with only live
+ * entries once dead records dominate it. Runs sharing the log lock it
+ * only to append a batch or to compact it, after reading what the
+ * others appended since; records name their paths, so they stay valid
+ * whoever appended before. The generation in the header counts the
+ * batches and compactions, it versions the log for snapshots.
+ */
+class LogDatabase : public Database {
+private:
+	enum RecordType : uint32_t {
+		//Up to version 6, by path ids local to the run that wrote them
+		PATH_RECORD = 1,
+		PUT_RECORD = 2,
+		REMOVE_RECORD = 3,
+		EXTENTS_RECORD = 4,
+		BLOCKS_RECORD = 5,
+		EXTENT_HASH_RECORD = 6,
+		GENERATION_RECORD = 7,
+		VERIFIED_RECORD = 8,
+		PUT_PATH_RECORD = 9,
+		REMOVE_PATH_RECORD = 10
+	};
+
+	//Up to version 7, only up to id
+	struct LogHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t reserved;
+		//Random, drawn when the log is created
+		uint64_t id;
+		//Bumped by every append batch and compaction
+		uint64_t generation;
+	};
+
+	struct RecordHeader {
+		uint32_t type;
+		uint32_t length;
+		char checksum[HASH_LENGTH];
+	};
+
+	struct PathRecord {
+		uint32_t pathId;
+		uint32_t length;
+	};
+
+	struct PutRecord {
+		uint32_t pathId;
+		uint32_t reserved;
+		int64_t mTime;
+		uint64_t size;
+		char extentsHash[HASH_LENGTH];
+		char dataHash[HASH_LENGTH];
+	};
+
+	struct RemoveRecord {
+		uint32_t pathId;
+		uint32_t reserved;
+	};
+
+	//Followed by the path
+	struct PutPathRecord {
+		int64_t mTime;
+		uint64_t size;
+		char extentsHash[HASH_LENGTH];
+		char dataHash[HASH_LENGTH];
+		uint32_t pathLength;
+		uint32_t hashVersion;
+	};
+
+	//Followed by the path
+	struct RemovePathRecord {
+		uint32_t pathLength;
+		uint32_t reserved;
+	};
+
+	//Followed by count FiemapData
+	struct ExtentsRecord {
+		char extentsHash[HASH_LENGTH];
+		uint32_t count;
+		uint32_t reserved;
+	};
+
+	//Followed by count block hashes
+	struct BlocksRecord {
+		char extentsHash[HASH_LENGTH];
+		uint32_t blockSize;
+		uint32_t count;
+	};
+
+	struct ExtentHashRecord {
+		ExtentKey key;
+		uint64_t hash;
+	};
+
+	//Followed by the root then the uuid
+	struct GenerationRecord {
+		uint64_t generation;
+		uint32_t rootLength;
+		uint32_t uuidLength;
+	};
+
+	//Followed by the path, a time of 0 forgets it
+	struct VerifiedRecord {
+		int64_t time;
+		uint32_t pathLength;
+		uint32_t reserved;
+	};
+
+	//Exclusive lock on the log, caught up with what other runs appended
+	class FileLock {
+	private:
+		LogDatabase & log;
+	public:
+		FileLock(LogDatabase & log);
+		~FileLock();
+	};
+
+	struct Entry {
+		std::time_t mTime;
+		size_t size;
+		Hash extentsHash;
+		Hash dataHash;
+		bool live;
+		uint32_t hashVersion;
+	};
+
+	const std::string filename;
+	int fd;
+	//Bytes of the log read or written by this run, 0 before the header
+	size_t length;
+	//Set while compact() writes the new log, it holds the lock already
+	bool compacting;
+	mutable std::mutex mutex;
+
+	//Of the log as last read or written by this run
+	uint64_t id;
+	uint64_t generation;
+	uint64_t knownVersion;
+	bool versionKnown;
+	bool foreignWrites;
+
+	std::map<std::string, uint32_t> paths;
+	std::vector<Entry> entries;
+	std::unordered_map<uint64_t, std::vector<FiemapData>> layouts;
+	std::unordered_map<uint64_t, BlockHashes> blocks;
+	ExtentHashCache extentHashes;
+	std::map<std::string, BtrfsGeneration> generations;
+	std::map<std::string, std::time_t> verified;
+
+	std::string buffer;
+	std::atomic<size_t> buffered;
+	size_t records;
+	size_t liveEntries;
+
+	static int openLog(const std::string & filename, bool truncate);
+
+	static size_t headerLength(uint32_t version);
+
+	LogHeader makeHeader();
+
+	void lock();
+
+	//Drops what was read, before reading a log compacted by another run
+	void reset();
+
+	void load();
+
+	//Returns the end of the last valid record
+	size_t applyRecords(const char * data, size_t offset, size_t size);
+
+	void append(RecordType type, const void * payload,
+			size_t length, const char * extra = NULL,
+			size_t extraLength = 0);
+
+	uint32_t getPathId(const std::string & filename);
+
+	void writePut(const std::string & path, const Entry & entry);
+
+	void writeRemove(const std::string & path);
+
+	void writeExtents(const Hash & extentsHash,
+			const std::vector<FiemapData> & extents);
+
+	void writeBlocks(const Hash & extentsHash, const BlockHashes & hashes);
+
+	void writeExtentHash(const ExtentKey & key, uint64_t hash);
+
+	void writeGeneration(const std::string & root,
+			const BtrfsGeneration & generation);
+
+	void writeVerified(const std::string & path, std::time_t time);
+
+	//These two with the lock held
+	void writeBuffer();
+
+	void compact();
+
+	bool needsCompaction() const;
+
+	FileRecord toRecord(const std::string & filename,
+			const Entry & entry) const;
+public:
+	LogDatabase(const std::string & filename);
+	virtual ~LogDatabase();
+
+	void storeRecord(const FileRecord & record, bool storeHash);
+
+	void removeFile(const std::string & filename);
+
+	void flush();
+
+	size_t getBacklog() const;
+
+	void loadFiles(const std::string & pattern,
+			const RecordCallback & callback);
+
+	void loadExtents(const ExtentsCallback & callback);
+
+	void loadBlocks(const BlocksCallback & callback);
+
+	void storeExtentHash(const ExtentKey & key, uint64_t hash);
+
+	void loadExtentHashes(const ExtentHashCache::EntryCallback & callback);
+
+	void cleanHashes();
+
+	void storeGeneration(const std::string & root,
+			const BtrfsGeneration & generation);
+
+	bool loadGeneration(const std::string & root,
+			BtrfsGeneration & generation);
+
+	void storeVerified(const std::string & path, std::time_t time);
+
+	void loadVerified(const std::string & root,
+			const VerifiedCallback & callback);
+
+	std::string getVersion();
+};
+
+#endif /* LOGDATABASE_H_ */
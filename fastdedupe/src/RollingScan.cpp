@@ -0,0 +1,321 @@
+/*
+ * RollingScan.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "RollingScan.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <iterator>
+#include <list>
+
+#include "File.h"
+
+using std::cout;
+using std::list;
+using std::set;
+using std::string;
+using std::vector;
+
+//Files a rolling scan walks before hashing them
+#define ROLLING_BATCH_FILES 1024
+
+RollingScan::RollingScan(Database & db, HashStore & hs,
+		const set<string> & roots, const HashCallback & hashFiles,
+		const BudgetCallback & spentBudget) :
+	db(db),
+	hs(hs),
+	catalog(hs.getCatalog()),
+	roots(roots),
+	hashFiles(hashFiles),
+	spentBudget(spentBudget),
+	verified(0) {
+}
+
+bool RollingScan::isStaler(const StampedEntry & a, const StampedEntry & b) {
+	return a.first != b.first ? a.first < b.first :
+			a.second->filename < b.second->filename;
+}
+
+std::time_t RollingScan::getStamp(const string & path) const {
+	auto stamp = stamps.find(path);
+
+	return stamp == stamps.end() ? 0 : stamp->second;
+}
+
+void RollingScan::storeStamp(const string & path, std::time_t time) {
+	db.storeVerified(path, time);
+	stamps[path] = time;
+}
+
+void RollingScan::dropKnown(const string & path, bool gone) {
+	auto record = known.lower_bound(path);
+
+	while (record != known.end() &&
+			! record->first.compare(0, path.size(), path)) {
+		if (! FilesystemHelper::isUnder(record->first, {path})) {
+			record++;
+			continue;
+		}
+		if (gone) {
+			cout << "Cleaning removed file '" << record->first << "'\n";
+			db.removeFile(record->first);
+		}
+		record = known.erase(record);
+	}
+}
+
+void RollingScan::forgetStamps(const string & directory) {
+	string prefix = directory + "/";
+
+	for (auto stamp = stamps.lower_bound(prefix);
+			stamp != stamps.end() &&
+			! stamp->first.compare(0, prefix.size(), prefix); ) {
+		db.storeVerified(stamp->first, 0);
+		stamp = stamps.erase(stamp);
+	}
+}
+
+void RollingScan::forgetVerified(const string & path) {
+	list<string> filenames;
+
+	db.loadFiles(path, [&] (const FileRecord & record) {
+		//The pattern also matches paths differing in case
+		if (FilesystemHelper::isUnder(record.filename, {path}))
+			filenames.push_back(record.filename);
+	});
+	for (const string & filename : filenames) {
+		cout << "Cleaning removed file '" << filename << "'\n";
+		db.removeFile(filename);
+	}
+	dropKnown(path, false);
+
+	forgetStamps(path);
+	if (stamps.erase(path))
+		db.storeVerified(path, 0);
+}
+
+void RollingScan::forgetGone(const string & directory,
+		const set<string> & present) {
+	string prefix = directory + "/";
+	set<string> gone;
+
+	for (auto stamp = stamps.lower_bound(prefix);
+			stamp != stamps.end() &&
+			! stamp->first.compare(0, prefix.size(), prefix); ) {
+		string child = stamp->first.substr(0,
+				stamp->first.find('/', prefix.size()));
+
+		if (! present.count(child))
+			gone.insert(child);
+		//Past the subtree of child, its siblings sort before it
+		stamp = stamp->first == child ? std::next(stamp) :
+				stamps.lower_bound(child + "0");
+	}
+	for (const string & child : gone)
+		forgetVerified(child);
+}
+
+bool RollingScan::hashBatch() {
+	vector<uint8_t> updated(batch.size());
+	std::time_t now = std::time(NULL);
+	bool done = hashFiles(batch, updated);
+
+	if (done) {
+		set<string> stamped;
+
+		verified += batch.size();
+		//Parents come last, once done they cover what is below them
+		for (auto path = walked.rbegin(); path != walked.rend(); path++) {
+			if (FilesystemHelper::isUnder(*path, stamped))
+				continue;
+			forgetStamps(*path);
+			storeStamp(*path, now);
+			stamped.insert(*path);
+		}
+	} else {
+		//The files done are skipped until their directory is done
+		for (size_t i = 0; i < batch.size(); i++) {
+			string filename = catalog.getFilename(batch[i]);
+
+			if (! updated[i])
+				continue;
+			verified++;
+			if (! roots.count(filename))
+				storeStamp(filename, now);
+		}
+	}
+	batch.clear();
+	walked.clear();
+
+	return done;
+}
+
+bool RollingScan::verifyFile(const FileInfo & info) {
+	FileId id = catalog.add(info.filename, info.mTime, info.size);
+	auto record = known.find(info.filename);
+
+	if (record != known.end()) {
+		File(hs, id).update(record->second.mTime,
+				record->second.extentsHash, record->second.dataHash,
+				record->second.hashVersion);
+		known.erase(record);
+	}
+	batch.push_back(id);
+
+	return batch.size() < ROLLING_BATCH_FILES || hashBatch();
+}
+
+/*
+ * Walks a directory, the entries verified longest ago first. Those
+ * stamped after the directory were verified since it was last done and
+ * are skipped. Returns false once the budget is spent.
+ */
+bool RollingScan::verifyDirectory(const string & directory,
+		std::time_t stamp) {
+	FilesystemHelper & fsHelper = FilesystemHelper::getFilesystemHelper();
+	list<FileInfo> entries;
+	list<IgnoredFile> ignored;
+	set<string> present;
+	vector<StampedEntry> children;
+
+	fsHelper.readDirectory(directory, entries, ignored);
+	for (const IgnoredFile & item : ignored) {
+		cout << "Ignored '" << item.fullpath << "': " << item.message
+				<< "\n";
+		if (item.fullpath != directory) {
+			if (item.error != ENOENT)
+				present.insert(item.fullpath);
+			continue;
+		}
+
+		//Only what is known to be gone, not what could not be read
+		if (item.error == ENOENT)
+			forgetVerified(directory);
+		else
+			dropKnown(directory, false);
+		return true;
+	}
+
+	for (const FileInfo & entry : entries) {
+		std::time_t entryStamp = getStamp(entry.filename);
+
+		present.insert(entry.filename);
+		if (entryStamp > stamp)
+			dropKnown(entry.filename, false);
+		else
+			children.emplace_back(entryStamp, &entry);
+	}
+	forgetGone(directory, present);
+
+	std::sort(children.begin(), children.end(), isStaler);
+	for (auto & child : children) {
+		if (spentBudget() || ! verifyEntry(*child.second, child.first)) {
+			//Cut short it keeps its place, but is known, should it vanish
+			if (! stamp)
+				storeStamp(directory, 1);
+			return false;
+		}
+	}
+
+	//What is left was not found on disk
+	dropKnown(directory, true);
+	if (! roots.count(directory))
+		walked.push_back(directory);
+	return true;
+}
+
+bool RollingScan::verifyEntry(const FileInfo & info, std::time_t stamp) {
+	return info.dirType ? verifyDirectory(info.filename, stamp) :
+			verifyFile(info);
+}
+
+bool RollingScan::run(set<string> & patterns) {
+	FilesystemHelper & fsHelper = FilesystemHelper::getFilesystemHelper();
+	list<FileInfo> entries;
+	vector<StampedEntry> units;
+	bool done = true;
+
+	for (const string & root : roots) {
+		list<FileInfo> listed;
+		list<IgnoredFile> ignored;
+		set<string> present;
+		bool complete = true;
+
+		db.loadVerified(root, [this] (const string & path,
+				std::time_t time) {
+			stamps.emplace(path, time);
+		});
+
+		try {
+			FileInfo info = fsHelper.getInfo(root);
+
+			if (info.dirType) {
+				fsHelper.readDirectory(root, listed, ignored);
+			} else {
+				entries.push_back(info);
+				units.emplace_back(0, &entries.back());
+			}
+		} catch (int error) {
+			ignored.emplace_back(IgnoredFile{root, error, strerror(error)});
+		}
+
+		for (const IgnoredFile & item : ignored) {
+			cout << "Ignored '" << item.fullpath << "': " << item.message
+					<< "\n";
+			if (item.fullpath == root)
+				complete = item.error == ENOENT;
+			else if (item.error != ENOENT)
+				present.insert(item.fullpath);
+		}
+		for (const FileInfo & entry : listed) {
+			present.insert(entry.filename);
+			units.emplace_back(getStamp(entry.filename), &entry);
+		}
+		entries.splice(entries.end(), listed);
+
+		//Only what is known to be gone, not what could not be read
+		if (complete)
+			forgetGone(root, present);
+	}
+
+	std::sort(units.begin(), units.end(), isStaler);
+	for (auto & unit : units) {
+		const FileInfo & info = *unit.second;
+
+		if (spentBudget()) {
+			done = false;
+			break;
+		}
+
+		cout << "Verifying '" << info.filename << "'...\n";
+		patterns.insert(info.filename);
+		db.loadFiles(info.filename, [this, &info]
+				(const FileRecord & record) {
+			if (FilesystemHelper::isUnder(record.filename, {info.filename}))
+				known.emplace(record.filename, record);
+		});
+
+		done = verifyEntry(info, unit.first);
+		known.clear();
+		if (! done)
+			break;
+		//Directories stamp themselves
+		if (! info.dirType && ! roots.count(info.filename))
+			walked.push_back(info.filename);
+	}
+	if (done && ! batch.empty())
+		done = hashBatch();
+
+	return done;
+}
+
+size_t RollingScan::getVerified() const {
+	return verified;
+}
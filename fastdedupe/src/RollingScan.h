@@ -0,0 +1,100 @@
+/*
+ * RollingScan.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef ROLLINGSCAN_H_
+#define ROLLINGSCAN_H_
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Database.h"
+#include "FileCatalog.h"
+#include "FilesystemHelper.h"
+#include "HashStore.h"
+
+/*
+ * Rolling scan under --time-budget or --io-budget. The entries right in
+ * the roots are taken in turn, those verified longest ago first, and
+ * walked a directory at a time the same way; files are checked with
+ * FIEMAP and hashed in batches until a budget is spent. An entry is
+ * stamped once done, the files of a directory cut short as they are
+ * done, so the next run goes on where this one stopped.
+ */
+class RollingScan {
+public:
+	//Brings files up to date, setting updated for those it got through;
+	//false when the budget ran out first
+	typedef std::function<bool(const std::vector<FileId> & files,
+			std::vector<uint8_t> & updated)> HashCallback;
+	//Option naming the budget spent, NULL while there is some left
+	typedef std::function<const char *()> BudgetCallback;
+private:
+	//An entry and when it was last verified
+	typedef std::pair<std::time_t, const FileInfo *> StampedEntry;
+
+	Database & db;
+	HashStore & hs;
+	FileCatalog & catalog;
+	const std::set<std::string> & roots;
+	const HashCallback hashFiles;
+	const BudgetCallback spentBudget;
+
+	//When each path below the roots was last verified
+	std::map<std::string, std::time_t> stamps;
+	//Records of the entry being verified not found on disk yet
+	std::map<std::string, FileRecord> known;
+	std::vector<FileId> batch;
+	//Directories walked, stamped once the batch is hashed
+	std::vector<std::string> walked;
+	size_t verified;
+
+	static bool isStaler(const StampedEntry & a, const StampedEntry & b);
+
+	std::time_t getStamp(const std::string & path) const;
+
+	void storeStamp(const std::string & path, std::time_t time);
+
+	//Known records of path and below it, removed from the database if gone
+	void dropKnown(const std::string & path, bool gone);
+
+	void forgetStamps(const std::string & directory);
+
+	//Drops the records below a path gone from disk, and the stamps there
+	void forgetVerified(const std::string & path);
+
+	//Paths right in directory with stamps on or below them, gone from disk
+	void forgetGone(const std::string & directory,
+			const std::set<std::string> & present);
+
+	//Hashes the batch and stamps what it got through
+	bool hashBatch();
+
+	bool verifyFile(const FileInfo & info);
+
+	bool verifyDirectory(const std::string & directory, std::time_t stamp);
+
+	bool verifyEntry(const FileInfo & info, std::time_t stamp);
+public:
+	RollingScan(Database & db, HashStore & hs,
+			const std::set<std::string> & roots, const HashCallback & hashFiles,
+			const BudgetCallback & spentBudget);
+
+	RollingScan(const RollingScan &) = delete;
+
+	//Adds the entries it took to patterns, false once a budget is spent
+	bool run(std::set<std::string> & patterns);
+
+	size_t getVerified() const;
+};
+
+#endif /* ROLLINGSCAN_H_ */
@@ -0,0 +1,295 @@
+/*
+ * ShardedDatabase.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "ShardedDatabase.h"
+
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "Hasher.h"
+#include "SqliteDatabase.h"
+
+using std::exception_ptr;
+using std::ifstream;
+using std::invalid_argument;
+using std::mutex;
+using std::ofstream;
+using std::runtime_error;
+using std::string;
+using std::thread;
+using std::vector;
+
+static const char * keyNames[] = {"hash", "directory"};
+
+ShardedDatabase::ShardedDatabase(const string & manifest,
+		size_t count, ShardKey key) :
+	key(key) {
+	try {
+		for (size_t i = 0; i < count; i++)
+			shards.push_back(new SqliteDatabase(
+					manifest + "." + std::to_string(i)));
+	} catch (...) {
+		for (SqliteDatabase * shard : shards)
+			delete shard;
+		throw;
+	}
+}
+
+ShardedDatabase::~ShardedDatabase() {
+	for (SqliteDatabase * shard : shards)
+		delete shard;
+}
+
+bool ShardedDatabase::isManifest(const string & filename) {
+	ifstream input(filename);
+	string magic;
+
+	return input.is_open() && (input >> magic) &&
+			magic == SHARDS_MANIFEST_MAGIC;
+}
+
+ShardedDatabase::ShardKey ShardedDatabase::parseKey(const string & name) {
+	for (size_t i = 0; i < sizeof(keyNames) / sizeof(*keyNames); i++)
+		if (name == keyNames[i])
+			return (ShardKey) i;
+
+	throw invalid_argument("Unknown shard key '" + name + "'");
+}
+
+ShardedDatabase * ShardedDatabase::open(const string & manifest) {
+	ifstream input(manifest);
+	string magic, keyName;
+	int version;
+	size_t count;
+
+	if (! (input >> magic >> version >> count >> keyName)
+			|| magic != SHARDS_MANIFEST_MAGIC
+			|| version != SHARDS_MANIFEST_VERSION
+			|| count == 0 || count > SHARDS_MAX)
+		throw runtime_error(manifest + ": invalid shard manifest");
+
+	return new ShardedDatabase(manifest, count, parseKey(keyName));
+}
+
+ShardedDatabase * ShardedDatabase::create(const string & manifest,
+		size_t count, ShardKey key) {
+	if (count == 0 || count > SHARDS_MAX)
+		throw invalid_argument("Shard count must be between 1 and "
+				+ std::to_string(SHARDS_MAX));
+
+	if (isManifest(manifest)) {
+		ShardedDatabase * existing = open(manifest);
+
+		if (existing->shards.size() != count || existing->key != key) {
+			delete existing;
+			throw invalid_argument(manifest + " is sharded differently, "
+					"use --export and --import to reshard");
+		}
+
+		return existing;
+	}
+
+	{
+		ifstream probe(manifest);
+		if (probe.is_open() && probe.peek() != EOF)
+			throw invalid_argument(manifest + " already exists "
+					"and is not a shard manifest");
+	}
+
+	ofstream output(manifest);
+	output << SHARDS_MANIFEST_MAGIC << " " << SHARDS_MANIFEST_VERSION
+			<< "\n" << count << " " << keyNames[key] << "\n";
+	output.close();
+
+	if (output.fail())
+		throw runtime_error(manifest + ": could not write manifest");
+
+	return new ShardedDatabase(manifest, count, key);
+}
+
+size_t ShardedDatabase::getShard(const string & filename) const {
+	size_t separator = filename.rfind('/');
+	string directory = separator == string::npos ?
+			"" : filename.substr(0, separator);
+	char raw[HASH_LENGTH];
+
+	Hasher::getHasher().hashFromBytes(directory.c_str(),
+			directory.length()).getBinHash(raw);
+
+	return (unsigned char) raw[0] % shards.size();
+}
+
+size_t ShardedDatabase::getShard(const Hash & extentsHash) const {
+	char raw[HASH_LENGTH];
+
+	extentsHash.getBinHash(raw);
+
+	return (unsigned char) raw[0] % shards.size();
+}
+
+void ShardedDatabase::forEachShard(
+		const std::function<void(SqliteDatabase &)> & action) {
+	vector<thread> workers;
+	vector<exception_ptr> errors(shards.size());
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		workers.emplace_back([this, &action, &errors, i] {
+			try {
+				action(*shards[i]);
+			} catch (...) {
+				errors[i] = std::current_exception();
+			}
+		});
+	}
+
+	for (thread & worker : workers)
+		worker.join();
+
+	for (exception_ptr & error : errors)
+		if (error)
+			std::rethrow_exception(error);
+}
+
+void ShardedDatabase::storeRecord(const FileRecord & record,
+		bool storeHash) {
+	if (key == DIRECTORY_KEY) {
+		//Files of one layout may sit in several shards, each joins
+		//its own hash row, an unchanged row is not rewritten
+		shards[getShard(record.filename)]->storeRecord(record, true);
+		return;
+	}
+
+	size_t target = getShard(record.extentsHash);
+
+	shards[target]->storeRecord(record, storeHash);
+
+	//The row still sits in the shard of its previous extents hash
+	if (record.previousExtentsHash != Hash()) {
+		size_t previous = getShard(record.previousExtentsHash);
+
+		if (previous != target)
+			shards[previous]->removeFile(record.filename);
+	}
+}
+
+void ShardedDatabase::removeFile(const string & filename) {
+	if (key == DIRECTORY_KEY) {
+		shards[getShard(filename)]->removeFile(filename);
+	} else {
+		for (SqliteDatabase * shard : shards)
+			shard->removeFile(filename);
+	}
+}
+
+void ShardedDatabase::flush() {
+	forEachShard([] (SqliteDatabase & shard) {
+		shard.flush();
+	});
+}
+
+size_t ShardedDatabase::getBacklog() const {
+	size_t backlog = 0;
+
+	for (SqliteDatabase * shard : shards)
+		backlog += shard->getBacklog();
+
+	return backlog;
+}
+
+void ShardedDatabase::loadFiles(const string & pattern,
+		const RecordCallback & callback) {
+	mutex callbackMutex;
+
+	forEachShard([&pattern, &callback, &callbackMutex]
+				(SqliteDatabase & shard) {
+		shard.loadFiles(pattern, [&callback, &callbackMutex]
+				(const FileRecord & record) {
+			std::lock_guard<mutex> lock(callbackMutex);
+			callback(record);
+		});
+	});
+}
+
+void ShardedDatabase::loadExtents(const ExtentsCallback & callback) {
+	mutex callbackMutex;
+
+	forEachShard([&callback, &callbackMutex] (SqliteDatabase & shard) {
+		shard.loadExtents([&callback, &callbackMutex]
+				(const Hash & extentsHash,
+						const vector<FiemapData> & extents) {
+			std::lock_guard<mutex> lock(callbackMutex);
+			callback(extentsHash, extents);
+		});
+	});
+}
+
+void ShardedDatabase::loadBlocks(const BlocksCallback & callback) {
+	mutex callbackMutex;
+
+	forEachShard([&callback, &callbackMutex] (SqliteDatabase & shard) {
+		shard.loadBlocks([&callback, &callbackMutex]
+				(const Hash & extentsHash, const BlockHashes & hashes) {
+			std::lock_guard<mutex> lock(callbackMutex);
+			callback(extentsHash, hashes);
+		});
+	});
+}
+
+//Extents are shared across shards, the first shard keeps their hashes
+void ShardedDatabase::storeExtentHash(const ExtentKey & key, uint64_t hash) {
+	shards.front()->storeExtentHash(key, hash);
+}
+
+void ShardedDatabase::loadExtentHashes(
+		const ExtentHashCache::EntryCallback & callback) {
+	shards.front()->loadExtentHashes(callback);
+}
+
+void ShardedDatabase::cleanHashes() {
+	forEachShard([] (SqliteDatabase & shard) {
+		shard.cleanHashes();
+	});
+}
+
+void ShardedDatabase::storeGeneration(const string & root,
+		const BtrfsGeneration & generation) {
+	//Only once the files it covers are in every shard
+	flush();
+	shards.front()->storeGeneration(root, generation);
+}
+
+bool ShardedDatabase::loadGeneration(const string & root,
+		BtrfsGeneration & generation) {
+	return shards.front()->loadGeneration(root, generation);
+}
+
+void ShardedDatabase::storeVerified(const string & path, std::time_t time) {
+	flush();
+	shards.front()->storeVerified(path, time);
+}
+
+void ShardedDatabase::loadVerified(const string & root,
+		const VerifiedCallback & callback) {
+	shards.front()->loadVerified(root, callback);
+}
+
+string ShardedDatabase::getVersion() {
+	string version;
+
+	for (auto & shard : shards) {
+		string shardVersion = shard->getVersion();
+
+		if (shardVersion.empty())
+			return "";
+		version += (version.empty() ? "" : ",") + shardVersion;
+	}
+
+	return version;
+}
@@ -0,0 +1,98 @@
+/*
+ * ShardedDatabase.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef SHARDEDDATABASE_H_
+#define SHARDEDDATABASE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Database.h"
+
+#define SHARDS_MANIFEST_MAGIC "fastdedupe-shards"
+#define SHARDS_MANIFEST_VERSION 1
+#define SHARDS_MAX 256
+
+class SqliteDatabase;
+
+/*
+ * Spreads files over N SQLite databases named <manifest>.<n>, each
+ * with its own connection and writer thread. The manifest file holds
+ * the shard count and key. Loads run on every shard in parallel and
+ * funnel into the same callback, so HashStore still sees every
+ * data hash group whatever shard its files live in.
+ */
+class ShardedDatabase : public Database {
+public:
+	enum ShardKey {
+		//Extents hash prefix, keeps a file and its hash row together
+		HASH_KEY,
+		//Parent directory, a file never moves between shards
+		DIRECTORY_KEY
+	};
+private:
+	ShardKey key;
+	std::vector<SqliteDatabase *> shards;
+
+	size_t getShard(const std::string & filename) const;
+
+	size_t getShard(const Hash & extentsHash) const;
+
+	void forEachShard(const std::function<void(SqliteDatabase &)> &
+			action);
+public:
+	ShardedDatabase(const std::string & manifest,
+			size_t count, ShardKey key);
+	virtual ~ShardedDatabase();
+
+	static bool isManifest(const std::string & filename);
+
+	static ShardedDatabase * open(const std::string & manifest);
+
+	static ShardedDatabase * create(const std::string & manifest,
+			size_t count, ShardKey key);
+
+	static ShardKey parseKey(const std::string & name);
+
+	void storeRecord(const FileRecord & record, bool storeHash);
+
+	void removeFile(const std::string & filename);
+
+	void flush();
+
+	size_t getBacklog() const;
+
+	void loadFiles(const std::string & pattern,
+			const RecordCallback & callback);
+
+	//By directory the same layout may come from several shards
+	void loadExtents(const ExtentsCallback & callback);
+
+	void loadBlocks(const BlocksCallback & callback);
+
+	void storeExtentHash(const ExtentKey & key, uint64_t hash);
+
+	void loadExtentHashes(const ExtentHashCache::EntryCallback & callback);
+
+	void cleanHashes();
+
+	void storeGeneration(const std::string & root,
+			const BtrfsGeneration & generation);
+
+	bool loadGeneration(const std::string & root,
+			BtrfsGeneration & generation);
+
+	void storeVerified(const std::string & path, std::time_t time);
+
+	void loadVerified(const std::string & root,
+			const VerifiedCallback & callback);
+
+	std::string getVersion();
+};
+
+#endif /* SHARDEDDATABASE_H_ */
@@ -0,0 +1,184 @@
+/*
+ * Snapshot.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Snapshot.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "Hasher.h"
+
+using std::pair;
+using std::runtime_error;
+using std::string;
+
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t databaseVersionLength;
+};
+
+struct SectionHeader {
+	uint64_t length;
+	uint64_t checksum;
+};
+
+static size_t alignSection(size_t length) {
+	return (length + 7) & ~(size_t) 7;
+}
+
+SnapshotWriter::SnapshotWriter(const string & filename,
+		const string & version) :
+	filename(filename),
+	temporary(filename + ".tmp") {
+	fd = open(temporary.c_str(),
+			O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1)
+		throw runtime_error(temporary + ": " + strerror(errno));
+
+	SnapshotHeader header{{}, SNAPSHOT_VERSION, (uint32_t) version.size()};
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+	try {
+		append(&header, sizeof(header));
+		append(version.data(), version.size());
+		append("\0\0\0\0\0\0\0", alignSection(version.size()) -
+				version.size());
+	} catch (...) {
+		close(fd);
+		unlink(temporary.c_str());
+		throw;
+	}
+}
+
+SnapshotWriter::~SnapshotWriter() {
+	if (fd != -1) {
+		close(fd);
+		unlink(temporary.c_str());
+	}
+}
+
+void SnapshotWriter::append(const void * data, size_t length) {
+	for (size_t written = 0; written < length; ) {
+		ssize_t result = ::write(fd, (const char *) data + written,
+				length - written);
+
+		if (result == -1 && errno == EINTR)
+			continue;
+		if (result == -1)
+			throw runtime_error(temporary + ": " + strerror(errno));
+		written += result;
+	}
+}
+
+void SnapshotWriter::write(const void * data, size_t length) {
+	SectionHeader header{length, Hasher::getHasher().hashFromBytes(
+			(const char *) data, length).getValue()};
+
+	append(&header, sizeof(header));
+	append(data, length);
+	append("\0\0\0\0\0\0\0", alignSection(length) - length);
+}
+
+void SnapshotWriter::commit() {
+	if (fsync(fd) == -1 || close(fd) == -1) {
+		int error = errno;
+		fd = -1;
+		unlink(temporary.c_str());
+		throw runtime_error(temporary + ": " + strerror(error));
+	}
+	fd = -1;
+
+	if (rename(temporary.c_str(), filename.c_str()) == -1) {
+		int error = errno;
+		unlink(temporary.c_str());
+		throw runtime_error(filename + ": " + strerror(error));
+	}
+}
+
+SnapshotReader::SnapshotReader(const string & filename) :
+	data(NULL),
+	size(0),
+	offset(0) {
+	int fd = open(filename.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	struct stat statData;
+
+	if (fd == -1 || fstat(fd, &statData) == -1) {
+		int error = errno;
+		if (fd != -1)
+			close(fd);
+		throw runtime_error(filename + ": " + strerror(error));
+	}
+
+	//Every section is copied out, faulting it in page by page is slower
+	size = statData.st_size;
+	if (size >= sizeof(SnapshotHeader))
+		data = (const char *) mmap(NULL, size, PROT_READ,
+				MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+
+	if (data == NULL || data == MAP_FAILED) {
+		data = NULL;
+		throw runtime_error(filename + ": not a snapshot");
+	}
+
+	SnapshotHeader header;
+	memcpy(&header, data, sizeof(header));
+	offset = sizeof(header) + alignSection(header.databaseVersionLength);
+
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+			header.version != SNAPSHOT_VERSION || offset > size) {
+		munmap((void *) data, size);
+		data = NULL;
+		throw runtime_error(filename + ": unsupported snapshot format");
+	}
+
+	version.assign(data + sizeof(header), header.databaseVersionLength);
+}
+
+SnapshotReader::~SnapshotReader() {
+	if (data != NULL)
+		munmap((void *) data, size);
+}
+
+const string & SnapshotReader::getVersion() const {
+	return version;
+}
+
+pair<const char *, size_t> SnapshotReader::next() {
+	SectionHeader header;
+
+	if (size - offset < sizeof(header))
+		throw runtime_error("Truncated snapshot");
+	memcpy(&header, data + offset, sizeof(header));
+	offset += sizeof(header);
+
+	if (header.length > size - offset)
+		throw runtime_error("Truncated snapshot");
+
+	const char * section = data + offset;
+	if (Hasher::getHasher().hashFromBytes(section, header.length)
+			.getValue() != header.checksum)
+		throw runtime_error("Corrupt snapshot section");
+
+	offset += std::min(alignSection(header.length), size - offset);
+	return pair<const char *, size_t>(section, header.length);
+}
+
+void SnapshotReader::read(void * data, size_t length) {
+	pair<const char *, size_t> section = next();
+
+	if (section.second != length)
+		throw runtime_error("Corrupt snapshot section");
+	memcpy(data, section.first, length);
+}
@@ -0,0 +1,108 @@
+/*
+ * Snapshot.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define SNAPSHOT_EXTENSION ".snapshot"
+#define SNAPSHOT_MAGIC "FDSNAP01"
+#define SNAPSHOT_VERSION 1
+
+/*
+ * Image of the resident catalog and hash store, taken when a daemon
+ * stops and mapped by the next one instead of loading every record of
+ * the database. It carries the version of the database it mirrors and
+ * is a run of sections, each with its own checksum, checked as the
+ * section is copied out rather than upfront.
+ */
+class SnapshotWriter {
+private:
+	const std::string filename;
+	const std::string temporary;
+	int fd;
+
+	void append(const void * data, size_t length);
+public:
+	SnapshotWriter(const std::string & filename,
+			const std::string & version);
+
+	SnapshotWriter(const SnapshotWriter &) = delete;
+
+	//Leaves the previous snapshot in place unless committed
+	virtual ~SnapshotWriter();
+
+	void write(const void * data, size_t length);
+
+	template <typename T>
+	void write(const T & value) {
+		static_assert(std::is_trivially_copyable<T>::value,
+				"Snapshots hold raw bytes");
+		write(&value, sizeof(T));
+	}
+
+	template <typename T>
+	void write(const std::vector<T> & values) {
+		static_assert(std::is_trivially_copyable<T>::value,
+				"Snapshots hold raw bytes");
+		write(values.data(), values.size() * sizeof(T));
+	}
+
+	void commit();
+};
+
+class SnapshotReader {
+private:
+	const char * data;
+	size_t size;
+	size_t offset;
+	std::string version;
+
+	//Next section, once its checksum matched
+	std::pair<const char *, size_t> next();
+public:
+	//Throws runtime_error when missing or of another format
+	SnapshotReader(const std::string & filename);
+
+	SnapshotReader(const SnapshotReader &) = delete;
+
+	virtual ~SnapshotReader();
+
+	//Version of the database the snapshot was taken from
+	const std::string & getVersion() const;
+
+	void read(void * data, size_t length);
+
+	template <typename T>
+	void read(T & value) {
+		static_assert(std::is_trivially_copyable<T>::value,
+				"Snapshots hold raw bytes");
+		read(&value, sizeof(T));
+	}
+
+	template <typename T>
+	void read(std::vector<T> & values) {
+		static_assert(std::is_trivially_copyable<T>::value,
+				"Snapshots hold raw bytes");
+		std::pair<const char *, size_t> section = next();
+
+		if (section.second % sizeof(T))
+			throw std::runtime_error("Corrupt snapshot section");
+		values.resize(section.second / sizeof(T));
+		std::memcpy((void *) values.data(), section.first, section.second);
+	}
+};
+
+#endif /* SNAPSHOT_H_ */
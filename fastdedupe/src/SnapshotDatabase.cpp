@@ -0,0 +1,185 @@
+/*
+ * SnapshotDatabase.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "SnapshotDatabase.h"
+
+#include "File.h"
+#include "HashStore.h"
+
+using std::string;
+using std::vector;
+
+SnapshotDatabase::SnapshotDatabase(Database * database,
+		FileCatalog * catalog, HashStore * store, const string & version) :
+	database(database),
+	catalog(catalog),
+	store(store),
+	version(version) {
+	for (FileId id = 0; id < catalog->size(); id++)
+		indexFile(id);
+}
+
+SnapshotDatabase::~SnapshotDatabase() {
+	delete store;
+	delete catalog;
+	delete database;
+}
+
+void SnapshotDatabase::indexFile(FileId id) {
+	uint32_t directory = catalog->getDirectoryIndex(id);
+
+	while (directoryFiles.size() <= directory) {
+		directories.emplace(
+				catalog->getDirectoryPath(directoryFiles.size()),
+				directoryFiles.size());
+		directoryFiles.emplace_back();
+	}
+
+	directoryFiles[directory].push_back(id);
+}
+
+FileRecord SnapshotDatabase::toRecord(FileId id) const {
+	FileRecord record{catalog->getFilename(id), catalog->getMTime(id),
+		catalog->getSize(id), catalog->getExtentsHash(id),
+		catalog->getDataHash(id)};
+
+	//Left to be hashed again by whatever run reaches it
+	if (! catalog->hasFlag(id, FileCatalog::CLEAN))
+		record.hashVersion = 0;
+
+	return record;
+}
+
+const FileCatalog & SnapshotDatabase::getCatalog() const {
+	return *catalog;
+}
+
+const HashStore & SnapshotDatabase::getStore() const {
+	return *store;
+}
+
+const string & SnapshotDatabase::getSnapshotVersion() const {
+	return version;
+}
+
+void SnapshotDatabase::storeRecord(const FileRecord & record,
+		bool storeHash) {
+	database->storeRecord(record, storeHash);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t files = catalog->size();
+	FileId id = catalog->add(record.filename, record.mTime, record.size);
+
+	if (id >= files)
+		indexFile(id);
+	if (catalog->hasFlag(id, FileCatalog::INDEXED))
+		store->dropFile(id);
+
+	catalog->setMTime(id, record.mTime);
+	catalog->setSize(id, record.size);
+	File(*store, id).update(record.mTime, record.extentsHash,
+			record.dataHash, record.hashVersion);
+}
+
+void SnapshotDatabase::removeFile(const string & filename) {
+	database->removeFile(filename);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	FileId id = catalog->find(filename);
+
+	if (id == NO_FILE)
+		return;
+	if (catalog->hasFlag(id, FileCatalog::INDEXED))
+		store->dropFile(id);
+	catalog->remove(id);
+}
+
+void SnapshotDatabase::flush() {
+	database->flush();
+}
+
+size_t SnapshotDatabase::getBacklog() const {
+	return database->getBacklog();
+}
+
+void SnapshotDatabase::loadFiles(const string & pattern,
+		const RecordCallback & callback) {
+	std::lock_guard<std::mutex> lock(mutex);
+	vector<uint32_t> matched;
+
+	if (pattern.empty()) {
+		for (FileId id = 0; id < catalog->size(); id++)
+			if (! catalog->hasFlag(id, FileCatalog::REMOVED))
+				callback(toRecord(id));
+		return;
+	}
+
+	//The pattern itself, as a file then as a directory
+	FileId file = catalog->find(pattern);
+	if (file != NO_FILE)
+		callback(toRecord(file));
+
+	auto exact = directories.find(pattern);
+	if (exact != directories.end())
+		matched.push_back(exact->second);
+
+	//'0' follows '/', in between are the directories below
+	for (auto it = directories.lower_bound(pattern + "/");
+			it != directories.lower_bound(pattern + "0"); it++)
+		matched.push_back(it->second);
+
+	for (uint32_t directory : matched)
+		for (FileId id : directoryFiles[directory])
+			if (! catalog->hasFlag(id, FileCatalog::REMOVED))
+				callback(toRecord(id));
+}
+
+void SnapshotDatabase::loadExtents(const ExtentsCallback & callback) {
+	database->loadExtents(callback);
+}
+
+void SnapshotDatabase::loadBlocks(const BlocksCallback & callback) {
+	database->loadBlocks(callback);
+}
+
+void SnapshotDatabase::storeExtentHash(const ExtentKey & key,
+		uint64_t hash) {
+	database->storeExtentHash(key, hash);
+}
+
+void SnapshotDatabase::loadExtentHashes(
+		const ExtentHashCache::EntryCallback & callback) {
+	database->loadExtentHashes(callback);
+}
+
+void SnapshotDatabase::cleanHashes() {
+	database->cleanHashes();
+}
+
+void SnapshotDatabase::storeGeneration(const string & root,
+		const BtrfsGeneration & generation) {
+	database->storeGeneration(root, generation);
+}
+
+bool SnapshotDatabase::loadGeneration(const string & root,
+		BtrfsGeneration & generation) {
+	return database->loadGeneration(root, generation);
+}
+
+void SnapshotDatabase::storeVerified(const string & path,
+		std::time_t time) {
+	database->storeVerified(path, time);
+}
+
+void SnapshotDatabase::loadVerified(const string & root,
+		const VerifiedCallback & callback) {
+	database->loadVerified(root, callback);
+}
+
+string SnapshotDatabase::getVersion() {
+	return database->getVersion();
+}
@@ -0,0 +1,88 @@
+/*
+ * SnapshotDatabase.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef SNAPSHOTDATABASE_H_
+#define SNAPSHOTDATABASE_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Database.h"
+#include "FileCatalog.h"
+
+/*
+ * Database whose records are read from the catalog and hash store of
+ * its snapshot instead, so that runs over some files need not query it.
+ * Writes go through to the database and into the snapshot contents,
+ * which the run then saves again for the next one. Files are looked up
+ * by directory, a pattern takes a range of the sorted directories.
+ */
+class SnapshotDatabase : public Database {
+private:
+	Database * database;
+	FileCatalog * catalog;
+	HashStore * store;
+	const std::string version;
+	std::mutex mutex;
+
+	std::vector<std::vector<FileId>> directoryFiles;
+	std::map<std::string, uint32_t> directories;
+
+	void indexFile(FileId id);
+
+	FileRecord toRecord(FileId id) const;
+public:
+	//Takes all three, store and catalog read from a snapshot at version
+	SnapshotDatabase(Database * database, FileCatalog * catalog,
+			HashStore * store, const std::string & version);
+	virtual ~SnapshotDatabase();
+
+	const FileCatalog & getCatalog() const;
+
+	const HashStore & getStore() const;
+
+	//Of the database when the snapshot was read
+	const std::string & getSnapshotVersion() const;
+
+	void storeRecord(const FileRecord & record, bool storeHash);
+
+	void removeFile(const std::string & filename);
+
+	void flush();
+
+	size_t getBacklog() const;
+
+	void loadFiles(const std::string & pattern,
+			const RecordCallback & callback);
+
+	void loadExtents(const ExtentsCallback & callback);
+
+	void loadBlocks(const BlocksCallback & callback);
+
+	void storeExtentHash(const ExtentKey & key, uint64_t hash);
+
+	void loadExtentHashes(const ExtentHashCache::EntryCallback & callback);
+
+	void cleanHashes();
+
+	void storeGeneration(const std::string & root,
+			const BtrfsGeneration & generation);
+
+	bool loadGeneration(const std::string & root,
+			BtrfsGeneration & generation);
+
+	void storeVerified(const std::string & path, std::time_t time);
+
+	void loadVerified(const std::string & root,
+			const VerifiedCallback & callback);
+
+	std::string getVersion();
+};
+
+#endif /* SNAPSHOTDATABASE_H_ */
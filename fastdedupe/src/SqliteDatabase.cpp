@@ -0,0 +1,1049 @@
+/*
+ * SqliteDatabase.cpp
+ *
+ *  Created on: May 23, 2020
+ *      Author: adam
+ */
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <thread>
+
+#include "Hasher.h"
+#include "SqliteDatabase.h"
+#include "Stats.h"
+#include "Trace.h"
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::map;
+using std::memcpy;
+using std::memset;
+using std::runtime_error;
+using std::string;
+using std::time_t;
+using std::vector;
+
+typedef Hasher::hash hash;
+
+SqliteDatabase::SqliteDatabase(const string & filename) :
+	pending(0), flushRequests(0), stopping(false),
+	writerFailed(false), knownVersion(0), versionKnown(false),
+	foreignWrites(false) {
+	int status = sqlite3_open_v2(filename.c_str(), &conn,
+			SQLITE_OPEN_READWRITE |
+			SQLITE_OPEN_CREATE |
+			SQLITE_OPEN_NOMUTEX |
+			SQLITE_OPEN_NOFOLLOW,
+			NULL);
+	if (status != SQLITE_OK) {
+		sqlite3_close_v2(conn);
+		throw runtime_error(sqlite3_errstr(status));
+	}
+
+	sqlite3_busy_timeout(conn, DATABASE_BUSY_TIMEOUT);
+
+	try {
+		//WAL lets other runs keep reading while one of them commits
+		executeRetrying("PRAGMA journal_mode = WAL");
+		executeQuery("PRAGMA synchronous = NORMAL");
+
+		this->beginTransaction();
+	} catch (runtime_error &) {
+		sqlite3_close_v2(conn);
+		throw;
+	}
+
+	try {
+		executeQuery("CREATE TABLE IF NOT EXISTS "
+				"hashes ("
+				"extents_hash BLOB PRIMARY KEY NOT NULL,"
+				"data_hash BLOB)");
+
+		executeQuery("CREATE TABLE IF NOT EXISTS "
+				"files ("
+				"filename VARCHAR PRIMARY KEY NOT NULL,"
+				"m_time INTEGER,"
+				"extents_hash BLOB REFERENCES hashes)");
+
+		migrate();
+
+		this->endTransaction();
+	} catch (runtime_error &) {
+		rollbackTransaction();
+		sqlite3_close_v2(conn);
+		throw;
+	}
+
+	purgeHashesStmt = prepareStatement("DELETE FROM hashes "
+			"WHERE ref_count <= 0");
+
+	getFilesStmt = prepareStatement("SELECT filename, m_time, data_hash, extents_hash, "
+			"hash_version, size FROM files NATURAL JOIN hashes "
+			"WHERE filename LIKE ? OR filename LIKE ?1||'/%'");
+
+	getAllFilesStmt = prepareStatement("SELECT filename, m_time, data_hash, extents_hash, "
+			"hash_version, size FROM files NATURAL JOIN hashes");
+
+	getExtentsStmt = prepareStatement("SELECT extents_hash, extents "
+			"FROM hashes WHERE extents IS NOT NULL");
+
+	getBlocksStmt = prepareStatement("SELECT extents_hash, blocks "
+			"FROM hashes WHERE blocks IS NOT NULL");
+
+	getExtentHashesStmt = prepareStatement("SELECT device, physical, "
+			"length, hash FROM extent_hashes");
+
+	clearExtentHashesStmt = prepareStatement("DELETE FROM extent_hashes");
+
+	removeExtentHashStmt = prepareStatement("DELETE FROM extent_hashes "
+			"WHERE device = ? AND physical = ? AND length = ?");
+
+	getGenerationStmt = prepareStatement("SELECT uuid, generation "
+			"FROM generations WHERE root = ?");
+
+	storeGenerationStmt = prepareStatement("INSERT OR REPLACE INTO "
+			"generations (root, uuid, generation) VALUES (?, ?, ?)");
+
+	//Not LIKE, which ignores case
+	getVerifiedStmt = prepareStatement("SELECT path, time FROM verified "
+			"WHERE substr(path, 1, length(?1) + 1) = ?1||'/'");
+
+	storeVerifiedStmt = prepareStatement("INSERT OR REPLACE INTO "
+			"verified (path, time) VALUES (?, ?)");
+
+	removeVerifiedStmt = prepareStatement("DELETE FROM verified "
+			"WHERE path = ?");
+
+	getVersionStmt = prepareStatement("SELECT id, count FROM changes");
+
+	bumpVersionStmt = prepareStatement("UPDATE changes SET count = count + 1");
+
+	writer = std::thread(&SqliteDatabase::writeLoop, this);
+}
+
+SqliteDatabase::~SqliteDatabase() {
+	stopping.store(true);
+	{
+		std::lock_guard<std::mutex> lock(writerMutex);
+		writerWakeup.notify_one();
+	}
+	writer.join();
+
+	for (auto statements : {&upsertHashStmts, &upsertFileStmts,
+			&removeFileStmts, &upsertExtentHashStmts})
+		for (auto & entry : *statements)
+			sqlite3_finalize(entry.second);
+
+	sqlite3_finalize(bumpVersionStmt);
+	sqlite3_finalize(getVersionStmt);
+	sqlite3_finalize(removeVerifiedStmt);
+	sqlite3_finalize(storeVerifiedStmt);
+	sqlite3_finalize(getVerifiedStmt);
+	sqlite3_finalize(storeGenerationStmt);
+	sqlite3_finalize(getGenerationStmt);
+	sqlite3_finalize(removeExtentHashStmt);
+	sqlite3_finalize(clearExtentHashesStmt);
+	sqlite3_finalize(getExtentHashesStmt);
+	sqlite3_finalize(getBlocksStmt);
+	sqlite3_finalize(getExtentsStmt);
+	sqlite3_finalize(getAllFilesStmt);
+	sqlite3_finalize(getFilesStmt);
+	sqlite3_finalize(purgeHashesStmt);
+
+	sqlite3_close_v2(conn);
+}
+
+sqlite3_stmt * SqliteDatabase::prepareStatement(const string & query) {
+	sqlite3_stmt * statement;
+
+	if (sqlite3_prepare_v2(conn,
+				query.c_str(),
+				query.length(),
+				&statement,
+				NULL) != SQLITE_OK)
+			throw runtime_error(sqlite3_errmsg(conn));
+
+	return statement;
+}
+
+void SqliteDatabase::reset(sqlite3_stmt * statement) {
+	if (sqlite3_reset(statement) != SQLITE_OK)
+			throw runtime_error(sqlite3_errmsg(conn));
+}
+
+void SqliteDatabase::bind(sqlite3_stmt * statement, int index, const char * raw_data, size_t length) {
+	if (sqlite3_bind_blob64(statement, index, raw_data, HASH_LENGTH, SQLITE_STATIC) != SQLITE_OK)
+		throw runtime_error(sqlite3_errmsg(conn));
+}
+
+void SqliteDatabase::bind(sqlite3_stmt * statement, int index, const std::string & data) {
+	if (sqlite3_bind_text64(statement, index, data.c_str(), data.length(), SQLITE_STATIC, SQLITE_UTF8) != SQLITE_OK)
+			throw runtime_error(sqlite3_errmsg(conn));
+}
+
+void SqliteDatabase::bind(sqlite3_stmt * statement, int index, std::time_t data) {
+	if (sqlite3_bind_int64(statement, index, data) != SQLITE_OK)
+				throw runtime_error(sqlite3_errmsg(conn));
+}
+
+void SqliteDatabase::bind(sqlite3_stmt * statement, int index, uint64_t data) {
+	if (sqlite3_bind_int64(statement, index, (sqlite3_int64) data) != SQLITE_OK)
+				throw runtime_error(sqlite3_errmsg(conn));
+}
+
+bool SqliteDatabase::step(sqlite3_stmt * statement) {
+	TRACE_SCOPE(db_step);
+	Stats::Timer timer(Stats::DATABASE);
+	int status = sqlite3_step(statement);
+
+	if (status != SQLITE_DONE && status != SQLITE_ROW) {
+		string message(sqlite3_errmsg(conn));
+
+		sqlite3_reset(statement);
+
+		if (status == SQLITE_BUSY || status == SQLITE_LOCKED)
+			throw DatabaseBusy(message);
+		else
+			throw runtime_error(message);
+	}
+
+	if (status==SQLITE_DONE)
+		reset(statement);
+
+	return status==SQLITE_ROW;
+}
+
+void SqliteDatabase::blobColumn(sqlite3_stmt * statement, int index, char * raw_data, size_t length) {
+	const void *input = sqlite3_column_blob(statement, index);
+	size_t input_length = sqlite3_column_bytes(statement, index);
+
+	if (input == NULL) {
+		if (sqlite3_errcode(conn) == SQLITE_NOMEM)
+			throw runtime_error(sqlite3_errmsg(conn));
+		else {
+			memset(raw_data, 0, length);
+		}
+	} else {
+		if (input_length != length)
+			throw runtime_error("Data size mismatch");
+
+		memcpy(raw_data, input, length);
+	}
+}
+
+void SqliteDatabase::bindBlob(sqlite3_stmt * statement, int index,
+		const string & data) {
+	int status = data.empty() ?
+			sqlite3_bind_null(statement, index) :
+			sqlite3_bind_blob64(statement, index, data.data(),
+					data.length(), SQLITE_STATIC);
+
+	if (status != SQLITE_OK)
+		throw runtime_error(sqlite3_errmsg(conn));
+}
+
+vector<FiemapData> SqliteDatabase::extentsColumn(sqlite3_stmt * statement,
+		int index) {
+	const char * input = (const char *) sqlite3_column_blob(statement, index);
+	size_t length = sqlite3_column_bytes(statement, index);
+
+	if (input == NULL && sqlite3_errcode(conn) == SQLITE_NOMEM)
+		throw runtime_error(sqlite3_errmsg(conn));
+
+	if (length % sizeof(FiemapData))
+		throw runtime_error("Data size mismatch");
+
+	vector<FiemapData> extents(length / sizeof(FiemapData));
+	if (length)
+		memcpy(extents.data(), input, length);
+
+	return extents;
+}
+
+BlockHashes SqliteDatabase::blocksColumn(sqlite3_stmt * statement,
+		int index) {
+	const char * input = (const char *) sqlite3_column_blob(statement, index);
+	size_t length = sqlite3_column_bytes(statement, index);
+	BlockHashes blocks;
+	uint64_t blockSize;
+
+	if (input == NULL && sqlite3_errcode(conn) == SQLITE_NOMEM)
+		throw runtime_error(sqlite3_errmsg(conn));
+
+	if (length < sizeof(blockSize) || length % sizeof(uint64_t))
+		throw runtime_error("Data size mismatch");
+
+	memcpy(&blockSize, input, sizeof(blockSize));
+	blocks.blockSize = blockSize;
+	blocks.hashes.resize(length / sizeof(uint64_t) - 1);
+	memcpy(blocks.hashes.data(), input + sizeof(blockSize),
+			length - sizeof(blockSize));
+
+	return blocks;
+}
+
+string SqliteDatabase::stringColumn(sqlite3_stmt * statement, int index) {
+	const char * text = (const char *) sqlite3_column_text(statement, index);
+
+	if (text == NULL) {
+		if (sqlite3_errcode(conn) == SQLITE_NOMEM)
+			throw runtime_error(sqlite3_errmsg(conn));
+		else {
+			string result;
+			return "";
+		}
+	}
+
+	return text;
+}
+
+time_t SqliteDatabase::timeColumn(sqlite3_stmt * statement, int index) {
+	time_t value = sqlite3_column_int64(statement, index);
+
+	if (value == 0 && sqlite3_errcode(conn) == SQLITE_NOMEM) {
+		throw runtime_error(sqlite3_errmsg(conn));
+	} else {
+		return value;
+	}
+}
+
+void SqliteDatabase::finalize(sqlite3_stmt * statement) {
+	if (sqlite3_finalize(statement) != SQLITE_OK)
+			throw runtime_error(sqlite3_errmsg(conn));
+}
+
+void SqliteDatabase::executeQuery(const string & query) {
+	sqlite3_stmt * statement=prepareStatement(query);
+
+	try {
+		step(statement);
+	} catch (runtime_error &) {
+		finalize(statement);
+		throw;
+	}
+
+	finalize(statement);
+}
+
+int SqliteDatabase::getSchemaVersion() {
+	sqlite3_stmt * statement=prepareStatement("PRAGMA user_version");
+	int version = 0;
+
+	try {
+		if (step(statement))
+			version = sqlite3_column_int(statement, 0);
+	} catch (runtime_error &) {
+		finalize(statement);
+		throw;
+	}
+
+	finalize(statement);
+
+	return version;
+}
+
+void SqliteDatabase::migrate() {
+	int version = getSchemaVersion();
+
+	if (version > SCHEMA_VERSION)
+		throw runtime_error("Database schema is newer than supported");
+
+	if (version < 1) {
+		//Kept up to date by the files triggers below
+		executeQuery("ALTER TABLE hashes ADD COLUMN "
+				"ref_count INTEGER NOT NULL DEFAULT 0");
+		countReferences();
+
+		executeQuery("CREATE TRIGGER files_insert "
+				"AFTER INSERT ON files BEGIN "
+				"UPDATE hashes SET ref_count = ref_count + 1 "
+				"WHERE extents_hash = NEW.extents_hash; "
+				"END");
+
+		executeQuery("CREATE TRIGGER files_delete "
+				"AFTER DELETE ON files BEGIN "
+				"UPDATE hashes SET ref_count = ref_count - 1 "
+				"WHERE extents_hash = OLD.extents_hash; "
+				"DELETE FROM hashes WHERE extents_hash = OLD.extents_hash "
+				"AND ref_count <= 0; "
+				"END");
+
+		executeQuery("CREATE TRIGGER files_update "
+				"AFTER UPDATE OF extents_hash ON files "
+				"WHEN OLD.extents_hash IS NOT NEW.extents_hash BEGIN "
+				"UPDATE hashes SET ref_count = ref_count + 1 "
+				"WHERE extents_hash = NEW.extents_hash; "
+				"UPDATE hashes SET ref_count = ref_count - 1 "
+				"WHERE extents_hash = OLD.extents_hash; "
+				"DELETE FROM hashes WHERE extents_hash = OLD.extents_hash "
+				"AND ref_count <= 0; "
+				"END");
+	}
+
+	if (version < 2) {
+		//Batched writes may upsert a hash before the statement that
+		//releases its previous owner, so orphans are purged on commit
+		executeQuery("DROP TRIGGER files_delete");
+		executeQuery("DROP TRIGGER files_update");
+
+		executeQuery("CREATE TRIGGER files_delete "
+				"AFTER DELETE ON files BEGIN "
+				"UPDATE hashes SET ref_count = ref_count - 1 "
+				"WHERE extents_hash = OLD.extents_hash; "
+				"END");
+
+		executeQuery("CREATE TRIGGER files_update "
+				"AFTER UPDATE OF extents_hash ON files "
+				"WHEN OLD.extents_hash IS NOT NEW.extents_hash BEGIN "
+				"UPDATE hashes SET ref_count = ref_count + 1 "
+				"WHERE extents_hash = NEW.extents_hash; "
+				"UPDATE hashes SET ref_count = ref_count - 1 "
+				"WHERE extents_hash = OLD.extents_hash; "
+				"END");
+
+		executeQuery("CREATE INDEX hashes_unreferenced "
+				"ON hashes (extents_hash) WHERE ref_count <= 0");
+	}
+
+	if (version < 3) {
+		//Raw FiemapData array, NULL when the layout was never read
+		executeQuery("ALTER TABLE hashes ADD COLUMN extents BLOB");
+	}
+
+	if (version < 4) {
+		//Block size as a 64 bit integer then the raw block hashes
+		executeQuery("ALTER TABLE hashes ADD COLUMN blocks BLOB");
+	}
+
+	if (version < 5) {
+		//Data hashes are now built from chunk hashes, older rows are
+		//kept until a run hashes their files again
+		executeQuery("ALTER TABLE hashes ADD COLUMN "
+				"hash_version INTEGER NOT NULL DEFAULT 1");
+
+		executeQuery("CREATE TABLE extent_hashes ("
+				"device INTEGER NOT NULL,"
+				"physical INTEGER NOT NULL,"
+				"length INTEGER NOT NULL,"
+				"hash INTEGER NOT NULL,"
+				"PRIMARY KEY (device, physical, length)) WITHOUT ROWID");
+	}
+
+	if (version < 6) {
+		executeQuery("CREATE TABLE generations ("
+				"root VARCHAR PRIMARY KEY NOT NULL,"
+				"uuid VARCHAR NOT NULL,"
+				"generation INTEGER NOT NULL)");
+	}
+
+	if (version < 7) {
+		//One row: which database this is, and how often it was written
+		executeQuery("CREATE TABLE changes ("
+				"id INTEGER NOT NULL,"
+				"count INTEGER NOT NULL)");
+		executeQuery("INSERT INTO changes VALUES (random(), 0)");
+	}
+
+	if (version < 8) {
+		//Seconds since the epoch, for the rolling scan
+		executeQuery("CREATE TABLE verified ("
+				"path VARCHAR PRIMARY KEY NOT NULL,"
+				"time INTEGER NOT NULL)");
+	}
+
+	if (version < 9) {
+		//0 for rows written before, the size is then unknown
+		executeQuery("ALTER TABLE files ADD COLUMN "
+				"size INTEGER NOT NULL DEFAULT 0");
+	}
+
+	if (version < SCHEMA_VERSION)
+		executeQuery("PRAGMA user_version = "
+				+ std::to_string(SCHEMA_VERSION));
+}
+
+void SqliteDatabase::countReferences() {
+	executeQuery("UPDATE hashes SET ref_count = 0");
+
+	executeQuery("UPDATE hashes SET ref_count = counts.total "
+			"FROM (SELECT extents_hash, COUNT(*) AS total "
+			"FROM files GROUP BY extents_hash) AS counts "
+			"WHERE hashes.extents_hash = counts.extents_hash");
+
+	executeQuery("DELETE FROM hashes WHERE ref_count <= 0");
+}
+
+sqlite3_stmt * SqliteDatabase::batchStatement(
+		map<size_t, sqlite3_stmt *> & statements, size_t rows,
+		const string & head, const string & row, const string & tail) {
+	auto it = statements.find(rows);
+
+	if (it != statements.end())
+		return it->second;
+
+	string query(head);
+	for (size_t i = 0; i < rows; i++) {
+		if (i) query += ",";
+		query += row;
+	}
+	query += tail;
+
+	sqlite3_stmt * statement = prepareStatement(query);
+	statements.emplace(rows, statement);
+
+	return statement;
+}
+
+void SqliteDatabase::enqueue(WriteOperation && operation) {
+	if (writerFailed.load())
+		std::rethrow_exception(writerError);
+
+	bool wasIdle = queue.size() == 0;
+
+	pending.fetch_add(1);
+	queue.push(std::move(operation));
+
+	if (wasIdle) {
+		std::lock_guard<std::mutex> lock(writerMutex);
+		writerWakeup.notify_one();
+	}
+}
+
+void SqliteDatabase::storeRecord(const FileRecord & record, bool storeHash) {
+	WriteOperation operation{STORE_FILE, storeHash,
+		record.filename, record.mTime};
+
+	record.extentsHash.getBinHash(operation.extentsHash);
+	record.dataHash.getBinHash(operation.dataHash);
+	operation.hashVersion = record.hashVersion;
+	operation.size = record.size;
+	if (storeHash)
+		operation.extents.assign((const char *) record.extents.data(),
+				record.extents.size() * sizeof(FiemapData));
+	if (storeHash && ! record.blocks.hashes.empty()) {
+		uint64_t blockSize = record.blocks.blockSize;
+
+		operation.blocks.assign((const char *) &blockSize,
+				sizeof(blockSize));
+		operation.blocks.append(
+				(const char *) record.blocks.hashes.data(),
+				record.blocks.hashes.size() * sizeof(uint64_t));
+	}
+
+	enqueue(std::move(operation));
+}
+
+void SqliteDatabase::removeFile(const string & filename) {
+	enqueue(WriteOperation{REMOVE_FILE, false, filename, 0});
+}
+
+void SqliteDatabase::storeExtentHash(const ExtentKey & key, uint64_t hash) {
+	WriteOperation operation{STORE_EXTENT_HASH, false, "", 0};
+
+	operation.extentKey = key;
+	operation.extentHash = hash;
+
+	enqueue(std::move(operation));
+}
+
+void SqliteDatabase::flush() {
+	std::unique_lock<std::mutex> lock(writerMutex);
+
+	flushRequests.fetch_add(1);
+	writerWakeup.notify_one();
+	writerDrained.wait(lock, [this] {
+		return pending.load() == 0;
+	});
+	flushRequests.fetch_sub(1);
+
+	if (writerFailed.load())
+		std::rethrow_exception(writerError);
+}
+
+size_t SqliteDatabase::getBacklog() const {
+	return pending.load();
+}
+
+void SqliteDatabase::writeLoop() {
+	vector<WriteOperation> batch;
+	size_t uncommitted = 0;
+	bool inTransaction = false;
+	steady_clock::time_point deadline;
+
+	batch.reserve(WRITER_BATCH_ROWS);
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(writerMutex);
+			auto ready = [this] {
+				return queue.size() || flushRequests.load()
+						|| stopping.load();
+			};
+
+			if (inTransaction)
+				writerWakeup.wait_until(lock, deadline, ready);
+			else
+				writerWakeup.wait(lock, ready);
+		}
+
+		WriteOperation operation;
+		while (uncommitted < WRITER_GROUP_SIZE && queue.pop(operation)) {
+			batch.push_back(std::move(operation));
+			uncommitted++;
+
+			if (batch.size() == WRITER_BATCH_ROWS)
+				write(batch, inTransaction, deadline);
+		}
+		write(batch, inTransaction, deadline);
+
+		bool idle = queue.size() == 0;
+
+		if (uncommitted && (uncommitted >= WRITER_GROUP_SIZE
+				|| steady_clock::now() >= deadline
+				|| writerFailed.load()
+				|| (idle && (flushRequests.load() || stopping.load())))) {
+			commit(inTransaction);
+
+			std::lock_guard<std::mutex> lock(writerMutex);
+			pending.fetch_sub(uncommitted);
+			uncommitted = 0;
+			writerDrained.notify_all();
+		}
+
+		if (stopping.load() && idle && uncommitted == 0)
+			break;
+	}
+}
+
+void SqliteDatabase::write(vector<WriteOperation> & batch,
+		bool & inTransaction,
+		steady_clock::time_point & deadline) {
+	if (!batch.empty() && !writerFailed.load()) {
+		std::lock_guard<std::mutex> lock(connMutex);
+
+		try {
+			if (!inTransaction) {
+				beginTransaction();
+				inTransaction = true;
+				bumpVersion();
+				deadline = steady_clock::now()
+					+ milliseconds(WRITER_COMMIT_INTERVAL);
+			}
+
+			apply(batch);
+		} catch (...) {
+			writerError = std::current_exception();
+			writerFailed.store(true);
+		}
+	}
+
+	batch.clear();
+}
+
+void SqliteDatabase::commit(bool & inTransaction) {
+	if (!inTransaction)
+		return;
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	try {
+		if (writerFailed.load()) {
+			rollbackTransaction();
+		} else {
+			step(purgeHashesStmt);
+			endTransaction();
+		}
+	} catch (...) {
+		if (!writerFailed.load()) {
+			writerError = std::current_exception();
+			writerFailed.store(true);
+		}
+	}
+
+	inTransaction = false;
+}
+
+void SqliteDatabase::apply(vector<WriteOperation> & batch) {
+	size_t begin = 0;
+
+	while (begin < batch.size()) {
+		size_t end = begin + 1;
+		while (end < batch.size() &&
+				batch[end].kind == batch[begin].kind)
+			end++;
+
+		if (batch[begin].kind == REMOVE_FILE) {
+			removeFiles(batch, begin, end);
+		} else if (batch[begin].kind == STORE_EXTENT_HASH) {
+			storeExtentHashes(batch, begin, end);
+		} else {
+			storeHashes(batch, begin, end);
+			storeFiles(batch, begin, end);
+		}
+
+		begin = end;
+	}
+}
+
+void SqliteDatabase::storeHashes(vector<WriteOperation> & batch,
+		size_t begin, size_t end) {
+	vector<WriteOperation *> rows;
+
+	for (size_t i = begin; i < end; i++)
+		if (batch[i].storeHash)
+			rows.push_back(&batch[i]);
+
+	for (size_t first = 0; first < rows.size();
+			first += WRITER_BATCH_ROWS) {
+		size_t count = std::min<size_t>(WRITER_BATCH_ROWS,
+				rows.size() - first);
+		sqlite3_stmt * statement = batchStatement(upsertHashStmts,
+				count, "INSERT INTO hashes "
+				"(extents_hash, data_hash, hash_version, extents, blocks) "
+				"VALUES ", "(?, ?, ?, ?, ?)", " ON CONFLICT (extents_hash) "
+				"DO UPDATE SET data_hash = excluded.data_hash, "
+				"hash_version = excluded.hash_version, "
+				"extents = COALESCE(excluded.extents, extents), "
+				"blocks = COALESCE(excluded.blocks, blocks) "
+				"WHERE data_hash IS NOT excluded.data_hash "
+				"OR hash_version IS NOT excluded.hash_version "
+				"OR COALESCE(excluded.extents, extents) IS NOT extents "
+				"OR COALESCE(excluded.blocks, blocks) IS NOT blocks");
+
+		for (size_t i = 0; i < count; i++) {
+			bind(statement, i * 5 + 1, rows[first + i]->extentsHash);
+			bind(statement, i * 5 + 2, rows[first + i]->dataHash);
+			bind(statement, i * 5 + 3,
+					(uint64_t) rows[first + i]->hashVersion);
+			bindBlob(statement, i * 5 + 4, rows[first + i]->extents);
+			bindBlob(statement, i * 5 + 5, rows[first + i]->blocks);
+		}
+
+		step(statement);
+	}
+}
+
+void SqliteDatabase::storeFiles(vector<WriteOperation> & batch,
+		size_t begin, size_t end) {
+	for (size_t first = begin; first < end;
+			first += WRITER_BATCH_ROWS) {
+		size_t count = std::min<size_t>(WRITER_BATCH_ROWS,
+				end - first);
+		sqlite3_stmt * statement = batchStatement(upsertFileStmts,
+				count, "INSERT INTO files VALUES ", "(?, ?, ?, ?)",
+				" ON CONFLICT (filename) DO UPDATE SET "
+				"(m_time, extents_hash, size) = "
+				"(excluded.m_time, excluded.extents_hash, excluded.size)");
+
+		for (size_t i = 0; i < count; i++) {
+			WriteOperation & operation = batch[first + i];
+			bind(statement, i * 4 + 1, operation.filename);
+			bind(statement, i * 4 + 2, operation.mTime);
+			bind(statement, i * 4 + 3, operation.extentsHash);
+			bind(statement, i * 4 + 4, operation.size);
+		}
+
+		step(statement);
+	}
+}
+
+void SqliteDatabase::removeFiles(vector<WriteOperation> & batch,
+		size_t begin, size_t end) {
+	for (size_t first = begin; first < end;
+			first += WRITER_BATCH_ROWS) {
+		size_t count = std::min<size_t>(WRITER_BATCH_ROWS,
+				end - first);
+		sqlite3_stmt * statement = batchStatement(removeFileStmts,
+				count, "DELETE FROM files WHERE filename IN (",
+				"?", ")");
+
+		for (size_t i = 0; i < count; i++)
+			bind(statement, i + 1, batch[first + i].filename);
+
+		step(statement);
+	}
+}
+
+void SqliteDatabase::storeExtentHashes(vector<WriteOperation> & batch,
+		size_t begin, size_t end) {
+	while (begin < end) {
+		//Hash 0 forgets the entry, in order with the rows around it
+		if (! batch[begin].extentHash) {
+			bind(removeExtentHashStmt, 1, batch[begin].extentKey.device);
+			bind(removeExtentHashStmt, 2, batch[begin].extentKey.physical);
+			bind(removeExtentHashStmt, 3, batch[begin].extentKey.length);
+			step(removeExtentHashStmt);
+			begin++;
+			continue;
+		}
+
+		size_t count = 1;
+		while (count < WRITER_BATCH_ROWS && begin + count < end &&
+				batch[begin + count].extentHash)
+			count++;
+
+		sqlite3_stmt * statement = batchStatement(upsertExtentHashStmts,
+				count, "INSERT INTO extent_hashes VALUES ", "(?, ?, ?, ?)",
+				" ON CONFLICT (device, physical, length) DO UPDATE SET "
+				"hash = excluded.hash");
+
+		for (size_t i = 0; i < count; i++) {
+			WriteOperation & operation = batch[begin + i];
+			bind(statement, i * 4 + 1, operation.extentKey.device);
+			bind(statement, i * 4 + 2, operation.extentKey.physical);
+			bind(statement, i * 4 + 3, operation.extentKey.length);
+			bind(statement, i * 4 + 4, operation.extentHash);
+		}
+
+		step(statement);
+		begin += count;
+	}
+}
+
+void SqliteDatabase::loadFiles(const string & pattern,
+		const RecordCallback & callback) {
+	sqlite3_stmt * statement = pattern.empty() ?
+			getAllFilesStmt : getFilesStmt;
+
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	if (! pattern.empty())
+		bind(statement, 1, pattern);
+
+	try {
+		while (step(statement)) {
+			char hash_raw [HASH_LENGTH];
+			FileRecord record;
+
+			record.filename = stringColumn(statement, 0);
+			record.mTime = timeColumn(statement, 1);
+			blobColumn(statement, 2, hash_raw);
+			record.dataHash = hash(hash_raw);
+			blobColumn(statement, 3, hash_raw);
+			record.extentsHash = hash(hash_raw);
+			record.hashVersion = sqlite3_column_int(statement, 4);
+			record.size = sqlite3_column_int64(statement, 5);
+
+			callback(record);
+		}
+	} catch (...) {
+		sqlite3_reset(statement);
+		throw;
+	}
+}
+
+void SqliteDatabase::loadExtents(const ExtentsCallback & callback) {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	try {
+		while (step(getExtentsStmt)) {
+			char hash_raw [HASH_LENGTH];
+
+			blobColumn(getExtentsStmt, 0, hash_raw);
+			callback(hash(hash_raw), extentsColumn(getExtentsStmt, 1));
+		}
+	} catch (...) {
+		sqlite3_reset(getExtentsStmt);
+		throw;
+	}
+}
+
+void SqliteDatabase::loadBlocks(const BlocksCallback & callback) {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	try {
+		while (step(getBlocksStmt)) {
+			char hash_raw [HASH_LENGTH];
+
+			blobColumn(getBlocksStmt, 0, hash_raw);
+			callback(hash(hash_raw), blocksColumn(getBlocksStmt, 1));
+		}
+	} catch (...) {
+		sqlite3_reset(getBlocksStmt);
+		throw;
+	}
+}
+
+void SqliteDatabase::loadExtentHashes(
+		const ExtentHashCache::EntryCallback & callback) {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	try {
+		while (step(getExtentHashesStmt)) {
+			ExtentKey key{
+				(uint64_t) sqlite3_column_int64(getExtentHashesStmt, 0),
+				(uint64_t) sqlite3_column_int64(getExtentHashesStmt, 1),
+				(uint64_t) sqlite3_column_int64(getExtentHashesStmt, 2)};
+
+			callback(key, sqlite3_column_int64(getExtentHashesStmt, 3));
+		}
+	} catch (...) {
+		sqlite3_reset(getExtentHashesStmt);
+		throw;
+	}
+}
+
+void SqliteDatabase::cleanHashes() {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	beginTransaction();
+	try {
+		countReferences();
+		step(clearExtentHashesStmt);
+	} catch (runtime_error &) {
+		rollbackTransaction();
+		throw;
+	}
+	endTransaction();
+}
+
+void SqliteDatabase::storeGeneration(const string & root,
+		const BtrfsGeneration & generation) {
+	//After the files it covers
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	beginTransaction();
+	try {
+		bind(storeGenerationStmt, 1, root);
+		bind(storeGenerationStmt, 2, generation.uuid);
+		bind(storeGenerationStmt, 3, generation.generation);
+		step(storeGenerationStmt);
+	} catch (runtime_error &) {
+		rollbackTransaction();
+		throw;
+	}
+	endTransaction();
+}
+
+bool SqliteDatabase::loadGeneration(const string & root,
+		BtrfsGeneration & generation) {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	bind(getGenerationStmt, 1, root);
+	if (! step(getGenerationStmt))
+		return false;
+
+	generation.uuid = stringColumn(getGenerationStmt, 0);
+	generation.generation = sqlite3_column_int64(getGenerationStmt, 1);
+	reset(getGenerationStmt);
+
+	return true;
+}
+
+void SqliteDatabase::storeVerified(const string & path, std::time_t time) {
+	//After the files it covers
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+	sqlite3_stmt * statement = time ? storeVerifiedStmt : removeVerifiedStmt;
+
+	beginTransaction();
+	try {
+		bind(statement, 1, path);
+		if (time)
+			bind(statement, 2, time);
+		step(statement);
+	} catch (runtime_error &) {
+		rollbackTransaction();
+		throw;
+	}
+	endTransaction();
+}
+
+void SqliteDatabase::loadVerified(const string & root,
+		const VerifiedCallback & callback) {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+
+	bind(getVerifiedStmt, 1, root);
+	while (step(getVerifiedStmt))
+		callback(stringColumn(getVerifiedStmt, 0),
+				sqlite3_column_int64(getVerifiedStmt, 1));
+}
+
+string SqliteDatabase::readVersion(uint64_t & count) {
+	if (! step(getVersionStmt))
+		throw runtime_error("No change count in the database");
+
+	string id = std::to_string(sqlite3_column_int64(getVersionStmt, 0));
+	count = sqlite3_column_int64(getVersionStmt, 1);
+	reset(getVersionStmt);
+
+	return id;
+}
+
+//Inside each write transaction, the count tells other writers apart
+void SqliteDatabase::bumpVersion() {
+	uint64_t count;
+
+	step(bumpVersionStmt);
+	readVersion(count);
+	if (versionKnown && count != knownVersion + 1)
+		foreignWrites = true;
+	knownVersion = count;
+}
+
+string SqliteDatabase::getVersion() {
+	flush();
+
+	std::lock_guard<std::mutex> lock(connMutex);
+	uint64_t count;
+	string id = readVersion(count);
+
+	if (versionKnown && count != knownVersion)
+		foreignWrites = true;
+	versionKnown = true;
+	knownVersion = count;
+
+	return foreignWrites ? "" : id + ":" + std::to_string(count);
+}
+
+void SqliteDatabase::executeRetrying(const string & query) {
+	for (int attempt = 0; ; attempt++) {
+		try {
+			executeQuery(query);
+			return;
+		} catch (DatabaseBusy &) {
+			if (attempt >= DATABASE_BUSY_RETRIES)
+				throw;
+
+			std::this_thread::sleep_for(milliseconds(
+					DATABASE_BUSY_BACKOFF << std::min(attempt, 6)));
+		}
+	}
+}
+
+void SqliteDatabase::beginTransaction() {
+	//Take the write lock upfront, a deferred transaction that has to
+	//upgrade later fails with SQLITE_BUSY without waiting
+	executeRetrying("BEGIN IMMEDIATE TRANSACTION");
+}
+
+void SqliteDatabase::endTransaction() {
+	executeRetrying("END TRANSACTION");
+}
+
+void SqliteDatabase::rollbackTransaction() {
+	executeQuery("ROLLBACK TRANSACTION");
+}
@@ -0,0 +1,246 @@
+/*
+ * SqliteDatabase.h
+ *
+ *  Created on: May 23, 2020
+ *      Author: adam
+ */
+
+#ifndef SQLITEDATABASE_H_
+#define SQLITEDATABASE_H_
+
+#include <sqlite3.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Database.h"
+#include "Hasher.h"
+#include "WriteQueue.h"
+
+#define SCHEMA_VERSION 9
+#define WRITER_BATCH_ROWS 64
+#define WRITER_GROUP_SIZE 16384
+#define WRITER_COMMIT_INTERVAL 1000
+#define DATABASE_BUSY_TIMEOUT 5000
+#define DATABASE_BUSY_RETRIES 20
+#define DATABASE_BUSY_BACKOFF 10
+
+class DatabaseBusy : public std::runtime_error {
+public:
+	DatabaseBusy(const std::string & message) :
+		std::runtime_error(message) {
+	}
+};
+
+class SqliteDatabase : public Database {
+private:
+	enum WriteKind : uint8_t {
+		STORE_FILE,
+		REMOVE_FILE,
+		STORE_EXTENT_HASH
+	};
+
+	struct WriteOperation {
+		WriteKind kind;
+		bool storeHash;
+		std::string filename;
+		std::time_t mTime;
+		char extentsHash[HASH_LENGTH];
+		char dataHash[HASH_LENGTH];
+		std::string extents;
+		std::string blocks;
+		ExtentKey extentKey;
+		uint64_t extentHash;
+		uint32_t hashVersion;
+		uint64_t size;
+	};
+
+	sqlite3 * conn;
+	std::mutex connMutex;
+
+	sqlite3_stmt * purgeHashesStmt;
+	sqlite3_stmt * getFilesStmt;
+	sqlite3_stmt * getAllFilesStmt;
+	sqlite3_stmt * getExtentsStmt;
+	sqlite3_stmt * getBlocksStmt;
+	sqlite3_stmt * getExtentHashesStmt;
+	sqlite3_stmt * clearExtentHashesStmt;
+	sqlite3_stmt * removeExtentHashStmt;
+	sqlite3_stmt * getGenerationStmt;
+	sqlite3_stmt * storeGenerationStmt;
+	sqlite3_stmt * getVerifiedStmt;
+	sqlite3_stmt * storeVerifiedStmt;
+	sqlite3_stmt * removeVerifiedStmt;
+	sqlite3_stmt * getVersionStmt;
+	sqlite3_stmt * bumpVersionStmt;
+
+	std::map<size_t, sqlite3_stmt *> upsertHashStmts;
+	std::map<size_t, sqlite3_stmt *> upsertFileStmts;
+	std::map<size_t, sqlite3_stmt *> removeFileStmts;
+	std::map<size_t, sqlite3_stmt *> upsertExtentHashStmts;
+
+	WriteQueue<WriteOperation> queue;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> flushRequests;
+	std::atomic<bool> stopping;
+	std::atomic<bool> writerFailed;
+	std::exception_ptr writerError;
+	std::mutex writerMutex;
+	std::condition_variable writerWakeup;
+	std::condition_variable writerDrained;
+	std::thread writer;
+
+	//Write transactions counted in the database, under connMutex
+	uint64_t knownVersion;
+	bool versionKnown;
+	bool foreignWrites;
+
+	sqlite3_stmt * prepareStatement(
+			const std::string & query);
+
+	void reset(sqlite3_stmt * statement);
+
+	void bind(sqlite3_stmt * statement, int index,
+			const char * raw_data, size_t length);
+
+	template<size_t S>
+	void bind(sqlite3_stmt * statement, int index,
+			const char (&raw_data) [S]) {
+		bind(statement, index, raw_data, S);
+	}
+
+	void bind(sqlite3_stmt * statement, int index,
+			const std::string & data);
+
+	void bind(sqlite3_stmt * statement, int index,
+			std::time_t data);
+
+	//Stored as the signed integer of the same bits
+	void bind(sqlite3_stmt * statement, int index,
+			uint64_t data);
+
+	//Binds NULL for empty data
+	void bindBlob(sqlite3_stmt * statement, int index,
+			const std::string & data);
+
+	bool step(sqlite3_stmt * statement);
+
+	void blobColumn(sqlite3_stmt * statement, int index,
+			char * raw_data, size_t length);
+
+	template<size_t S>
+	void blobColumn(sqlite3_stmt * statement, int index,
+			char (&raw_data) [S]) {
+		blobColumn(statement, index, raw_data, S);
+	}
+
+	std::string stringColumn(sqlite3_stmt * statement,
+			int index);
+
+	std::time_t timeColumn(sqlite3_stmt * statement,
+			int index);
+
+	std::vector<FiemapData> extentsColumn(sqlite3_stmt * statement,
+			int index);
+
+	BlockHashes blocksColumn(sqlite3_stmt * statement, int index);
+
+	void finalize(sqlite3_stmt * statement);
+
+	void executeQuery(const std::string & query);
+
+	void executeRetrying(const std::string & query);
+
+	int getSchemaVersion();
+
+	void migrate();
+
+	void countReferences();
+
+	std::string readVersion(uint64_t & count);
+
+	void bumpVersion();
+
+	sqlite3_stmt * batchStatement(
+			std::map<size_t, sqlite3_stmt *> & statements,
+			size_t rows, const std::string & head,
+			const std::string & row, const std::string & tail);
+
+	void enqueue(WriteOperation && operation);
+
+	void writeLoop();
+
+	void write(std::vector<WriteOperation> & batch,
+			bool & inTransaction,
+			std::chrono::steady_clock::time_point & deadline);
+
+	void commit(bool & inTransaction);
+
+	void apply(std::vector<WriteOperation> & batch);
+
+	void storeHashes(std::vector<WriteOperation> & batch,
+			size_t begin, size_t end);
+
+	void storeFiles(std::vector<WriteOperation> & batch,
+			size_t begin, size_t end);
+
+	void removeFiles(std::vector<WriteOperation> & batch,
+			size_t begin, size_t end);
+
+	void storeExtentHashes(std::vector<WriteOperation> & batch,
+			size_t begin, size_t end);
+
+	void beginTransaction();
+
+	void endTransaction();
+
+	void rollbackTransaction();
+public:
+	SqliteDatabase(const std::string & filename);
+	virtual ~SqliteDatabase();
+
+	void storeRecord(const FileRecord & record, bool storeHash);
+
+	void removeFile(const std::string & filename);
+
+	void flush();
+
+	size_t getBacklog() const;
+
+	void loadFiles(const std::string & pattern,
+			const RecordCallback & callback);
+
+	void loadExtents(const ExtentsCallback & callback);
+
+	void loadBlocks(const BlocksCallback & callback);
+
+	void storeExtentHash(const ExtentKey & key, uint64_t hash);
+
+	void loadExtentHashes(const ExtentHashCache::EntryCallback & callback);
+
+	void cleanHashes();
+
+	void storeGeneration(const std::string & root,
+			const BtrfsGeneration & generation);
+
+	bool loadGeneration(const std::string & root,
+			BtrfsGeneration & generation);
+
+	void storeVerified(const std::string & path, std::time_t time);
+
+	void loadVerified(const std::string & root,
+			const VerifiedCallback & callback);
+
+	std::string getVersion();
+};
+
+#endif /* SQLITEDATABASE_H_ */
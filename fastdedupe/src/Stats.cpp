@@ -0,0 +1,218 @@
+/*
+ * Stats.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Stats.h"
+
+#include <sys/resource.h>
+
+#include <iomanip>
+#include <sstream>
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::memory_order_relaxed;
+using std::string;
+using std::stringstream;
+
+Stats Stats::stats;
+
+Stats::Timer::Timer(Stage stage) :
+	stage(stage),
+	running(stats.isEnabled()),
+	bytes(0),
+	count(1) {
+	if (running)
+		start = steady_clock::now();
+}
+
+Stats::Timer::~Timer() {
+	if (running)
+		stats.record(stage, duration_cast<nanoseconds>(
+				steady_clock::now() - start).count(), bytes, count);
+}
+
+void Stats::Timer::setBytes(uint64_t bytes) {
+	this->bytes = bytes;
+}
+
+void Stats::Timer::setCount(uint64_t count) {
+	this->count = count;
+}
+
+Stats::Stats() :
+	enabled(false),
+	started(steady_clock::now()) {
+	for (Counters & stage : counters) {
+		stage.count = 0;
+		stage.bytes = 0;
+		stage.nanos = 0;
+		stage.maxNanos = 0;
+		for (auto & bucket : stage.buckets)
+			bucket = 0;
+	}
+	for (auto & gauge : gauges)
+		gauge = 0;
+}
+
+Stats::~Stats() {
+}
+
+Stats & Stats::getStats() {
+	return stats;
+}
+
+const char * Stats::getName(Stage stage) {
+	static const char * const names[STAGES] = {"walk", "fiemap", "hash",
+			"database", "dedupe", "throttle"};
+
+	return names[stage];
+}
+
+const char * Stats::getName(Gauge gauge) {
+	static const char * const names[GAUGES] = {"database_backlog",
+			"catalog_bytes", "hashstore_bytes"};
+
+	return names[gauge];
+}
+
+void Stats::enable() {
+	enabled.store(true);
+}
+
+void Stats::updateMax(std::atomic<uint64_t> & target, uint64_t value) {
+	uint64_t current = target.load(memory_order_relaxed);
+
+	while (value > current && ! target.compare_exchange_weak(current, value,
+			memory_order_relaxed))
+		;
+}
+
+void Stats::record(Stage stage, uint64_t nanos, uint64_t bytes,
+		uint64_t count) {
+	Counters & counter = counters[stage];
+	uint64_t micros = nanos / 1000;
+	size_t bucket = micros ? 64 - __builtin_clzll(micros) : 0;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	counter.count.fetch_add(count, memory_order_relaxed);
+	counter.bytes.fetch_add(bytes, memory_order_relaxed);
+	counter.nanos.fetch_add(nanos, memory_order_relaxed);
+	counter.buckets[bucket].fetch_add(1, memory_order_relaxed);
+	updateMax(counter.maxNanos, nanos);
+}
+
+void Stats::sample(Gauge gauge, uint64_t value) {
+	if (isEnabled())
+		updateMax(gauges[gauge], value);
+}
+
+double Stats::getElapsed() const {
+	return duration<double>(steady_clock::now() - started).count();
+}
+
+uint64_t Stats::getQuantile(Stage stage, double quantile) const {
+	uint64_t total = 0, seen = 0;
+
+	for (auto & bucket : counters[stage].buckets)
+		total += bucket.load(memory_order_relaxed);
+
+	for (size_t i = 0; i < STATS_BUCKETS; i++) {
+		seen += counters[stage].buckets[i].load(memory_order_relaxed);
+		if (total && seen >= total * quantile)
+			return (uint64_t) 1 << i;
+	}
+
+	return 0;
+}
+
+string Stats::getProgress() const {
+	double elapsed = getElapsed();
+	const Counters & hash = counters[HASH];
+	uint64_t files = hash.count.load(memory_order_relaxed);
+	uint64_t mebibytes = hash.bytes.load(memory_order_relaxed) >> 20;
+	stringstream line;
+
+	line << std::fixed << std::setprecision(1) << elapsed << "s: "
+			<< counters[WALK].count.load(memory_order_relaxed)
+			<< " files listed, " << files << " hashed ("
+			<< (elapsed > 0 ? files / elapsed : 0) << "/s), "
+			<< mebibytes << " MiB read ("
+			<< (elapsed > 0 ? mebibytes / elapsed : 0) << " MiB/s), "
+			<< counters[FIEMAP].count.load(memory_order_relaxed)
+			<< " FIEMAP, "
+			<< counters[DEDUPE].count.load(memory_order_relaxed)
+			<< " dedupe calls, database backlog "
+			<< gauges[DATABASE_BACKLOG].load(memory_order_relaxed) << " max";
+
+	return line.str();
+}
+
+/*
+ * Latencies are reported as the upper bound of their power of two
+ * bucket, in microseconds. Stages timed as a whole, like the walk,
+ * count their items but hold a single sample.
+ */
+void Stats::write(JsonWriter & json) const {
+	double elapsed = getElapsed();
+	struct rusage usage;
+
+	json.beginObject();
+	json.key("elapsed_seconds").value(elapsed);
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		json.key("peak_rss_bytes").value((uint64_t) usage.ru_maxrss * 1024);
+
+	json.key("stages").beginObject();
+	for (size_t i = 0; i < STAGES; i++) {
+		const Counters & stage = counters[i];
+		uint64_t count = stage.count.load(memory_order_relaxed);
+		uint64_t bytes = stage.bytes.load(memory_order_relaxed);
+		uint64_t nanos = stage.nanos.load(memory_order_relaxed);
+		uint64_t samples = 0;
+
+		for (auto & bucket : stage.buckets)
+			samples += bucket.load(memory_order_relaxed);
+
+		json.key(getName((Stage) i)).beginObject();
+		json.key("count").value(count);
+		json.key("bytes").value(bytes);
+		json.key("busy_seconds").value(nanos / 1e9);
+		json.key("per_second").value(elapsed > 0 ? count / elapsed : 0.0);
+		json.key("bytes_per_second").value(
+				elapsed > 0 ? bytes / elapsed : 0.0);
+		json.key("latency_us").beginObject();
+		json.key("mean").value(samples ? nanos / 1e3 / samples : 0.0);
+		json.key("p50").value(getQuantile((Stage) i, 0.5));
+		json.key("p90").value(getQuantile((Stage) i, 0.9));
+		json.key("p99").value(getQuantile((Stage) i, 0.99));
+		json.key("max").value(
+				(uint64_t) stage.maxNanos.load(memory_order_relaxed) / 1000);
+		json.key("histogram").beginArray();
+		for (size_t j = 0; j < STATS_BUCKETS; j++) {
+			uint64_t bucket = stage.buckets[j].load(memory_order_relaxed);
+
+			if (bucket)
+				json.beginArray().value((uint64_t) 1 << j).value(bucket)
+						.endArray();
+		}
+		json.endArray();
+		json.endObject();
+		json.endObject();
+	}
+	json.endObject();
+
+	json.key("max").beginObject();
+	for (size_t i = 0; i < GAUGES; i++)
+		json.key(getName((Gauge) i)).value(
+				(uint64_t) gauges[i].load(memory_order_relaxed));
+	json.endObject();
+
+	json.endObject();
+}
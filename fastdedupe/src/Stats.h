@@ -0,0 +1,114 @@
+/*
+ * Stats.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include "JsonWriter.h"
+
+//Latency buckets by powers of two of microseconds
+#define STATS_BUCKETS 32
+
+/*
+ * Counters and latency histograms of each stage of a run, plus the
+ * highest value seen of a few gauges. Updates are relaxed atomics behind
+ * a single flag: while disabled no clock is read and nothing is written.
+ */
+class Stats {
+public:
+	enum Stage {
+		WALK,
+		FIEMAP,
+		HASH,
+		DATABASE,
+		DEDUPE,
+		//Time spent waiting on the I/O limits
+		THROTTLE,
+		STAGES
+	};
+
+	enum Gauge {
+		DATABASE_BACKLOG,
+		CATALOG_BYTES,
+		HASHSTORE_BYTES,
+		GAUGES
+	};
+
+	//Times its scope into a stage when stats are enabled
+	class Timer {
+	private:
+		const Stage stage;
+		const bool running;
+		std::chrono::steady_clock::time_point start;
+		uint64_t bytes;
+		uint64_t count;
+	public:
+		Timer(Stage stage);
+
+		~Timer();
+
+		void setBytes(uint64_t bytes);
+
+		//Items done in the scope, one by default
+		void setCount(uint64_t count);
+	};
+
+private:
+	struct Counters {
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> nanos;
+		std::atomic<uint64_t> maxNanos;
+		std::atomic<uint64_t> buckets[STATS_BUCKETS];
+	};
+
+	static Stats stats;
+	std::atomic<bool> enabled;
+	const std::chrono::steady_clock::time_point started;
+	Counters counters[STAGES];
+	std::atomic<uint64_t> gauges[GAUGES];
+
+	Stats();
+
+	static const char * getName(Stage stage);
+
+	static const char * getName(Gauge gauge);
+
+	static void updateMax(std::atomic<uint64_t> & target, uint64_t value);
+
+	//Upper bound in microseconds of the bucket holding quantile
+	uint64_t getQuantile(Stage stage, double quantile) const;
+
+public:
+	static Stats & getStats();
+
+	virtual ~Stats();
+
+	void enable();
+
+	bool isEnabled() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void record(Stage stage, uint64_t nanos, uint64_t bytes,
+			uint64_t count = 1);
+
+	void sample(Gauge gauge, uint64_t value);
+
+	double getElapsed() const;
+
+	std::string getProgress() const;
+
+	void write(JsonWriter & json) const;
+};
+
+#endif /* STATS_H_ */
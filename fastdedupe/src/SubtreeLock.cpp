@@ -0,0 +1,87 @@
+/*
+ * SubtreeLock.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "SubtreeLock.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <map>
+#include <stdexcept>
+
+#include "Hasher.h"
+
+using std::map;
+using std::runtime_error;
+using std::set;
+using std::string;
+
+SubtreeLock::SubtreeLock(const string & database,
+		const set<string> & roots,
+		const WaitCallback & onWait) {
+	string directory = database + SUBTREE_LOCK_SUFFIX;
+	map<string, bool> paths;
+
+	if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST)
+		throw runtime_error(directory + ": " + strerror(errno));
+
+	for (const string & root : roots) {
+		paths[root] = true;
+
+		for (size_t separator = root.find('/', 1);
+				separator != string::npos;
+				separator = root.find('/', separator + 1))
+			paths.emplace(root.substr(0, separator), false);
+
+		if (root != "/")
+			paths.emplace("/", false);
+	}
+
+	try {
+		for (auto & path : paths)
+			acquire(directory, path.first, path.second, onWait);
+	} catch (...) {
+		for (int fd : descriptors)
+			close(fd);
+		throw;
+	}
+}
+
+SubtreeLock::~SubtreeLock() {
+	for (auto it = descriptors.rbegin(); it != descriptors.rend(); it++)
+		close(*it);
+}
+
+void SubtreeLock::acquire(const string & directory,
+		const string & path, bool exclusive,
+		const WaitCallback & onWait) {
+	string lockFile = directory + "/" + (string)
+			Hasher::getHasher().hashFromBytes(path.c_str(), path.length());
+	int operation = exclusive ? LOCK_EX : LOCK_SH;
+
+	int fd = open(lockFile.c_str(), O_RDONLY|O_CREAT|O_CLOEXEC, 0644);
+	if (fd == -1)
+		throw runtime_error(lockFile + ": " + strerror(errno));
+
+	descriptors.push_back(fd);
+
+	if (flock(fd, operation | LOCK_NB) == 0)
+		return;
+
+	if (errno != EWOULDBLOCK)
+		throw runtime_error(lockFile + ": " + strerror(errno));
+
+	onWait(path);
+
+	while (flock(fd, operation) == -1)
+		if (errno != EINTR)
+			throw runtime_error(lockFile + ": " + strerror(errno));
+}
@@ -0,0 +1,44 @@
+/*
+ * SubtreeLock.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef SUBTREELOCK_H_
+#define SUBTREELOCK_H_
+
+#include <functional>
+#include <set>
+#include <string>
+#include <vector>
+
+#define SUBTREE_LOCK_SUFFIX ".locks"
+
+/*
+ * Advisory locks serializing runs over overlapping subtrees of one
+ * database. Each root is locked exclusively and every ancestor shared,
+ * so /srv/a and /srv/b never wait on each other while /srv and /srv/a
+ * do. Locks are flock()s on one file per path under <database>.locks,
+ * taken in path order so concurrent runs cannot deadlock.
+ */
+class SubtreeLock {
+public:
+	typedef std::function<void(const std::string &)> WaitCallback;
+private:
+	std::vector<int> descriptors;
+
+	void acquire(const std::string & directory,
+			const std::string & path, bool exclusive,
+			const WaitCallback & onWait);
+public:
+	SubtreeLock(const std::string & database,
+			const std::set<std::string> & roots,
+			const WaitCallback & onWait);
+
+	SubtreeLock(const SubtreeLock &) = delete;
+
+	virtual ~SubtreeLock();
+};
+
+#endif /* SUBTREELOCK_H_ */
@@ -0,0 +1,262 @@
+/*
+ * Throttle.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Throttle.h"
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#include "Stats.h"
+
+using std::ifstream;
+using std::invalid_argument;
+using std::runtime_error;
+using std::string;
+using std::chrono::duration;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+//From linux/ioprio.h, which older headers lack
+#define THROTTLE_IOPRIO_WHO_PROCESS 1
+#define THROTTLE_IOPRIO_CLASS_SHIFT 13
+#define THROTTLE_PRESSURE_FILE "/proc/pressure/io"
+
+Throttle Throttle::throttle;
+volatile sig_atomic_t Throttle::reloading = 0;
+
+void Throttle::Bucket::set(double limit) {
+	this->limit = limit;
+	rate = limit;
+	tokens = limit;
+}
+
+void Throttle::Bucket::refill(double seconds) {
+	if (rate)
+		tokens = std::min(rate, tokens + rate * seconds);
+}
+
+double Throttle::Bucket::take(uint64_t amount) {
+	used += amount;
+	if (! rate)
+		return 0;
+
+	tokens -= amount;
+	return tokens < 0 ? -tokens / rate : 0;
+}
+
+void Throttle::Bucket::adjust(bool congested, double seconds, double floor) {
+	double done = used / seconds;
+
+	used = 0;
+	if (congested) {
+		double lowest = limit ? std::min(limit, floor) : floor;
+
+		if (! rate)
+			tokens = 0;
+		rate = std::max(lowest, (rate ? std::min(rate, done) : done) / 2);
+		tokens = std::min(tokens, rate);
+	} else if (rate) {
+		rate *= 1.25;
+		if (limit && rate >= limit)
+			rate = limit;
+		//Well above what is asked for, the rate no longer limits
+		else if (! limit && rate > done * 2)
+			rate = 0;
+	}
+}
+
+Throttle::Throttle() :
+	enabled(false),
+	bytes{0, 0, 0, 0},
+	operations{0, 0, 0, 0},
+	refilled(steady_clock::now()),
+	adjusted(refilled),
+	averageLatency(0),
+	stalled(0),
+	controlTime(0) {
+}
+
+Throttle::~Throttle() {
+}
+
+Throttle & Throttle::getThrottle() {
+	return throttle;
+}
+
+void Throttle::onSignal(int) {
+	reloading = 1;
+}
+
+uint64_t Throttle::readStalled() {
+	ifstream pressure(THROTTLE_PRESSURE_FILE);
+	string line;
+
+	//some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+	while (std::getline(pressure, line)) {
+		size_t total = line.find("total=");
+
+		if (line.compare(0, 5, "some ") == 0 && total != string::npos)
+			return std::stoull(line.substr(total + 6));
+	}
+
+	return 0;
+}
+
+void Throttle::apply(const Limits & limits) {
+	this->limits = limits;
+	bytes.set(limits.bytes);
+	operations.set(limits.operations);
+	averageLatency = 0;
+	stalled = limits.pressure ? readStalled() : 0;
+
+	enabled = limits.bytes || limits.operations || limits.pressure ||
+			limits.latency || ! controlFile.empty();
+}
+
+void Throttle::reload() {
+	struct stat statData;
+	Limits loaded = limits;
+
+	reloading = 0;
+	controlTime = stat(controlFile.c_str(), &statData) == 0 ?
+			statData.st_mtim.tv_sec * 1000000000LL +
+			statData.st_mtim.tv_nsec : 0;
+	reader(loaded);
+	apply(loaded);
+}
+
+bool Throttle::isCongested(double seconds) {
+	bool congested = false;
+
+	if (limits.pressure) {
+		uint64_t total = readStalled();
+
+		//Microseconds stalled per second, as a percentage
+		congested = total && (total - stalled) / (seconds * 1e4) >
+				limits.pressure;
+		stalled = total;
+	}
+	if (limits.latency && averageLatency > limits.latency)
+		congested = true;
+
+	return congested;
+}
+
+void Throttle::adjust(time_point now) {
+	double elapsed = duration<double>(now - adjusted).count();
+	struct stat statData;
+
+	adjusted = now;
+	if (! controlFile.empty() && (reloading ||
+			(stat(controlFile.c_str(), &statData) == 0 &&
+			statData.st_mtim.tv_sec * 1000000000LL +
+			statData.st_mtim.tv_nsec != controlTime))) {
+		reload();
+		return;
+	}
+
+	if (limits.pressure || limits.latency) {
+		bool congested = isCongested(elapsed);
+
+		bytes.adjust(congested, elapsed, THROTTLE_MIN_BYTES);
+		operations.adjust(congested, elapsed, THROTTLE_MIN_OPERATIONS);
+	}
+}
+
+void Throttle::setLimits(const Limits & limits) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	apply(limits);
+}
+
+void Throttle::setControlFile(const string & filename,
+		const Reader & reader) {
+	std::lock_guard<std::mutex> lock(mutex);
+	struct sigaction action;
+
+	controlFile = filename;
+	this->reader = reader;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &action, NULL);
+
+	reload();
+}
+
+void Throttle::acquire(uint64_t bytes, uint64_t operations) {
+	if (! isEnabled())
+		return;
+
+	double wait;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		time_point now = steady_clock::now();
+		double elapsed = duration<double>(now - refilled).count();
+
+		if (now - adjusted >= seconds(1))
+			adjust(now);
+
+		refilled = now;
+		this->bytes.refill(elapsed);
+		this->operations.refill(elapsed);
+		wait = std::max(this->bytes.take(bytes),
+				this->operations.take(operations));
+	}
+
+	if (wait > 0) {
+		Stats::Timer timer(Stats::THROTTLE);
+		std::this_thread::sleep_for(duration<double>(wait));
+	}
+}
+
+void Throttle::observe(steady_clock::duration latency) {
+	double milliseconds = duration<double, std::milli>(latency).count();
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (limits.latency)
+		averageLatency = averageLatency ?
+				averageLatency * 0.8 + milliseconds * 0.2 : milliseconds;
+}
+
+void Throttle::setPriority(const string & priority) {
+	size_t colon = priority.find(':');
+	string name = priority.substr(0, colon);
+	int type = name == "realtime" ? 1 : name == "best-effort" ? 2 :
+			name == "idle" ? 3 : 0;
+	int level = type == 3 ? 0 : 4;
+
+	if (colon != string::npos && type != 3) {
+		size_t end = 0;
+
+		try {
+			level = std::stoi(priority.substr(colon + 1), &end);
+		} catch (std::logic_error &) {
+			type = 0;
+		}
+		if (colon + 1 + end != priority.size() || level < 0 || level > 7)
+			type = 0;
+	} else if (colon != string::npos) {
+		type = 0;
+	}
+
+	if (! type)
+		throw invalid_argument("Invalid I/O priority '" + priority + "'");
+
+	if (syscall(SYS_ioprio_set, THROTTLE_IOPRIO_WHO_PROCESS, 0,
+			type << THROTTLE_IOPRIO_CLASS_SHIFT | level) == -1)
+		throw runtime_error(string("ioprio_set: ") + strerror(errno));
+}
@@ -0,0 +1,122 @@
+/*
+ * Throttle.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+//Floor of the rates lowered by the backoff, per second
+#define THROTTLE_MIN_BYTES 1024*1024
+#define THROTTLE_MIN_OPERATIONS 16
+
+/*
+ * Token buckets shared by the I/O of the whole process: bytes read and
+ * deduped, and operations, reads, FIEMAP and dedupe calls. A caller over
+ * the rate sleeps off its debt, so every job gets its share. With a
+ * pressure or a latency target the rates in force are halved each second
+ * the target is missed and grow back by a quarter otherwise; a rate
+ * without a cap starts from what was done in the last second. Limits may
+ * come from a control file, read again on SIGHUP or when it changes.
+ * While nothing is set acquire() is a relaxed load.
+ */
+class Throttle {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	struct Limits {
+		//Per second, 0 for none
+		uint64_t bytes = 0;
+		uint64_t operations = 0;
+		//Percent of time some task stalled on I/O, /proc/pressure/io
+		double pressure = 0;
+		//Milliseconds per read, averaged
+		double latency = 0;
+	};
+
+	//Fills in the limits from the control file
+	typedef std::function<void(Limits & limits)> Reader;
+private:
+	struct Bucket {
+		double limit;
+		//In force, 0 for none
+		double rate;
+		double tokens;
+		uint64_t used;
+
+		void set(double limit);
+
+		void refill(double seconds);
+
+		//Seconds to wait before the next one
+		double take(uint64_t amount);
+
+		void adjust(bool congested, double seconds, double floor);
+	};
+
+	static Throttle throttle;
+	static volatile sig_atomic_t reloading;
+	std::atomic<bool> enabled;
+	std::mutex mutex;
+	Limits limits;
+	Bucket bytes;
+	Bucket operations;
+	time_point refilled;
+	time_point adjusted;
+	double averageLatency;
+	uint64_t stalled;
+	std::string controlFile;
+	//mtime of the control file in nanoseconds
+	int64_t controlTime;
+	Reader reader;
+
+	Throttle();
+
+	static void onSignal(int signal);
+
+	//Microseconds some task stalled on I/O since boot, 0 without PSI
+	static uint64_t readStalled();
+
+	void apply(const Limits & limits);
+
+	void reload();
+
+	bool isCongested(double seconds);
+
+	void adjust(time_point now);
+public:
+	static Throttle & getThrottle();
+
+	virtual ~Throttle();
+
+	bool isEnabled() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void setLimits(const Limits & limits);
+
+	//Read now, and again on SIGHUP or once its mtime changes
+	void setControlFile(const std::string & filename, const Reader & reader);
+
+	//Waits until the bytes and operations fit in the rates
+	void acquire(uint64_t bytes, uint64_t operations = 1);
+
+	//Time a read took, for the latency target
+	void observe(std::chrono::steady_clock::duration latency);
+
+	//As ionice: idle, best-effort[:0-7] or realtime[:0-7]
+	static void setPriority(const std::string & priority);
+};
+
+#endif /* THROTTLE_H_ */
@@ -0,0 +1,140 @@
+/*
+ * Trace.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Trace.h"
+
+#include <unistd.h>
+
+#include <stdexcept>
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::runtime_error;
+using std::string;
+using std::vector;
+
+#define TRACE_BATCH 4096
+
+//Events of one thread, handed over by batches and when it exits
+struct ThreadEvents {
+	vector<Trace::Event> events;
+	const uint32_t thread;
+
+	ThreadEvents() :
+		thread(Trace::getTrace().nextThread()) {
+		events.reserve(TRACE_BATCH);
+	}
+
+	~ThreadEvents() {
+		flush();
+	}
+
+	void flush() {
+		if (! events.empty())
+			Trace::getTrace().write(events, thread);
+		events.clear();
+	}
+};
+
+static thread_local ThreadEvents threadEvents;
+
+Trace Trace::trace;
+
+Trace::Scope::Scope(const char * name, uint64_t value) :
+	name(name),
+	value(value),
+	running(trace.isEnabled()),
+	start(running ? trace.now() : 0) {
+}
+
+Trace::Scope::~Scope() {
+	if (running)
+		trace.add(Event{name, start, trace.now() - start, value});
+}
+
+Trace::Trace() :
+	enabled(false),
+	started(steady_clock::now()),
+	json(out),
+	threads(0) {
+}
+
+Trace::~Trace() {
+}
+
+Trace & Trace::getTrace() {
+	return trace;
+}
+
+uint64_t Trace::now() const {
+	return duration_cast<nanoseconds>(steady_clock::now() - started).count();
+}
+
+uint32_t Trace::nextThread() {
+	return threads.fetch_add(1) + 1;
+}
+
+void Trace::add(const Event & event) {
+	threadEvents.events.push_back(event);
+
+	if (threadEvents.events.size() >= TRACE_BATCH)
+		threadEvents.flush();
+}
+
+void Trace::start(const string & filename) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	out.open(filename);
+	if (! out.is_open())
+		throw runtime_error("Could not write '" + filename + "'");
+	//Timestamps of long runs need more than the default six digits
+	out.precision(15);
+
+	json.beginObject();
+	json.key("displayTimeUnit").value("ms");
+	json.key("traceEvents").beginArray();
+
+	enabled.store(true);
+}
+
+void Trace::stop() {
+	if (! isEnabled())
+		return;
+
+	threadEvents.flush();
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	enabled.store(false);
+	json.endArray();
+	json.endObject();
+	out << "\n";
+	out.close();
+}
+
+//Timestamps in microseconds, as the format wants
+void Trace::write(const vector<Event> & events, uint32_t thread) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (! isEnabled())
+		return;
+
+	for (const Event & event : events) {
+		json.beginObject();
+		json.key("name").value(event.name);
+		json.key("cat").value("fastdedupe");
+		json.key("ph").value("X");
+		json.key("ts").value(event.start / 1e3);
+		json.key("dur").value(event.duration / 1e3);
+		json.key("pid").value((uint64_t) getpid());
+		json.key("tid").value((uint64_t) thread);
+		json.key("args").beginObject().key("value").value(event.value)
+				.endObject();
+		json.endObject();
+	}
+}
@@ -0,0 +1,115 @@
+/*
+ * Trace.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "JsonWriter.h"
+
+/*
+ * TRACE_SCOPE(name) and TRACE_SCOPE_ARG(name, value) time the rest of
+ * their scope as a Chrome trace event, and fire the USDT probes
+ * fastdedupe:name_start, with value, and fastdedupe:name_done for
+ * bpftrace. Without FASTDEDUPE_TRACE they compile to nothing.
+ */
+#ifdef FASTDEDUPE_TRACE
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name) DTRACE_PROBE(fastdedupe, name)
+#define TRACE_PROBE_ARG(name, value) DTRACE_PROBE1(fastdedupe, name, value)
+#else
+#define TRACE_PROBE(name)
+#define TRACE_PROBE_ARG(name, value)
+#endif
+
+#define TRACE_SCOPE_ARG(name, value) \
+	const uint64_t traceValue_##name = (value); \
+	TRACE_PROBE_ARG(name##_start, traceValue_##name); \
+	struct TraceDone_##name { \
+		~TraceDone_##name() { TRACE_PROBE(name##_done); } \
+	} traceDone_##name; \
+	Trace::Scope traceScope_##name(#name, traceValue_##name)
+
+#define TRACE_SCOPE(name) TRACE_SCOPE_ARG(name, 0)
+
+#else
+
+#define TRACE_SCOPE_ARG(name, value)
+#define TRACE_SCOPE(name)
+
+#endif
+
+/*
+ * Writes the events of every thread to a Chrome trace-event file. Each
+ * thread buffers its events and hands them over in batches, or when it
+ * exits.
+ */
+class Trace {
+public:
+	struct Event {
+		const char * name;
+		uint64_t start;
+		uint64_t duration;
+		uint64_t value;
+	};
+
+	class Scope {
+	private:
+		const char * const name;
+		const uint64_t value;
+		const bool running;
+		uint64_t start;
+	public:
+		Scope(const char * name, uint64_t value);
+
+		~Scope();
+	};
+
+private:
+	static Trace trace;
+	std::atomic<bool> enabled;
+	const std::chrono::steady_clock::time_point started;
+	std::mutex mutex;
+	std::ofstream out;
+	JsonWriter json;
+	std::atomic<uint32_t> threads;
+
+	Trace();
+
+	uint64_t now() const;
+
+	void add(const Event & event);
+
+public:
+	static Trace & getTrace();
+
+	virtual ~Trace();
+
+	bool isEnabled() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+
+	void start(const std::string & filename);
+
+	//Threads still running lose the events they have not handed over
+	void stop();
+
+	void write(const std::vector<Event> & events, uint32_t thread);
+
+	uint32_t nextThread();
+};
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,366 @@
+/*
+ * Watcher.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#include "Watcher.h"
+
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <cerrno>
+#include <stdexcept>
+
+#include "FilesystemHelper.h"
+
+using std::runtime_error;
+using std::set;
+using std::string;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+#define WATCHER_BUFFER_SIZE 64*1024
+#define WATCHER_MAX_HANDLES 65536
+
+#define WATCHER_INOTIFY_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | \
+	IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+#ifdef FAN_REPORT_DFID_NAME
+#define WATCHER_FANOTIFY_EVENTS (FAN_CLOSE_WRITE | FAN_MODIFY | FAN_CREATE | \
+	FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+#endif
+
+Watcher::Watcher(const set<string> & roots) :
+	roots(roots),
+	fd(-1),
+	fanotify(false),
+	overflowed(false),
+	unwatched(0) {
+	fanotify = startFanotify();
+	if (! fanotify)
+		startInotify();
+}
+
+Watcher::~Watcher() {
+	for (auto & mount : mounts)
+		close(mount.second);
+	if (fd != -1)
+		close(fd);
+}
+
+int Watcher::getDescriptor() const {
+	return fd;
+}
+
+bool Watcher::usesFanotify() const {
+	return fanotify;
+}
+
+size_t Watcher::getUnwatched() const {
+	return unwatched;
+}
+
+//Falls back quietly when the kernel or the privileges are missing
+bool Watcher::startFanotify() {
+#ifdef FAN_REPORT_DFID_NAME
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+			FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if (fd == -1)
+		return false;
+
+	for (const string & root : roots) {
+		struct statfs info;
+
+		if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				WATCHER_FANOTIFY_EVENTS, AT_FDCWD, root.c_str()) == -1 ||
+				statfs(root.c_str(), &info) == -1) {
+			for (auto & mount : mounts)
+				close(mount.second);
+			mounts.clear();
+			close(fd);
+			fd = -1;
+			return false;
+		}
+
+		std::pair<int, int> fsid(info.f_fsid.__val[0], info.f_fsid.__val[1]);
+		bool known = false;
+
+		for (auto & mount : mounts)
+			known |= mount.first == fsid;
+		if (known)
+			continue;
+
+		int mountFd = open(root.c_str(), O_RDONLY | O_CLOEXEC);
+		if (mountFd == -1)
+			throw runtime_error(root + ": " + strerror(errno));
+		mounts.emplace_back(fsid, mountFd);
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void Watcher::startInotify() {
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		throw runtime_error(string("inotify_init1: ") + strerror(errno));
+
+	for (const string & root : roots) {
+		struct stat info;
+
+		if (stat(root.c_str(), &info) == -1)
+			continue;
+
+		if (S_ISDIR(info.st_mode)) {
+			watchTree(root);
+		} else {
+			//Events of the siblings are dropped by add()
+			string parent = root.substr(0, root.rfind('/'));
+			int watch = inotify_add_watch(fd,
+					parent.empty() ? "/" : parent.c_str(),
+					WATCHER_INOTIFY_EVENTS);
+
+			if (watch != -1)
+				watches[watch] = parent;
+			else
+				unwatched++;
+		}
+	}
+}
+
+//Also called for directories created or moved in, to watch them too
+void Watcher::watchTree(const string & directory) {
+	std::vector<string> stack{directory};
+
+	while (! stack.empty()) {
+		string path = stack.back();
+		stack.pop_back();
+
+		int watch = inotify_add_watch(fd, path.c_str(),
+				WATCHER_INOTIFY_EVENTS);
+		if (watch == -1) {
+			if (errno == ENOSPC)
+				unwatched++;
+			continue;
+		}
+		//A directory moved inside the roots keeps its watch
+		string & watched = watches[watch];
+		if (path == directory && ! watched.empty() && watched != path)
+			renamed.insert(watch);
+		watched = path;
+
+		DIR * dirStream = opendir(path.c_str());
+		if (dirStream == NULL)
+			continue;
+
+		for (struct dirent * entity = readdir(dirStream); entity != NULL;
+				entity = readdir(dirStream)) {
+			if (! strcmp(entity->d_name, ".") ||
+					! strcmp(entity->d_name, ".."))
+				continue;
+
+			string child = path + "/" + entity->d_name;
+			struct stat info;
+
+			if (entity->d_type == DT_DIR || (entity->d_type == DT_UNKNOWN &&
+					lstat(child.c_str(), &info) == 0 &&
+					S_ISDIR(info.st_mode)))
+				stack.push_back(child);
+		}
+		closedir(dirStream);
+	}
+}
+
+//Drops the watches on a directory moved away and on those below it
+void Watcher::unwatchTree(const string & directory) {
+	for (auto watch = watches.begin(); watch != watches.end(); ) {
+		if (! FilesystemHelper::isUnder(watch->second, {directory})) {
+			watch++;
+			continue;
+		}
+
+		inotify_rm_watch(fd, watch->first);
+		renamed.erase(watch->first);
+		watch = watches.erase(watch);
+	}
+}
+
+//Path of the directory behind a handle, empty once it is gone
+string Watcher::resolve(int fsid0, int fsid1, void * handle) {
+	struct file_handle * fileHandle = (struct file_handle *) handle;
+	string key((const char *) handle,
+			sizeof(struct file_handle) + fileHandle->handle_bytes);
+	key.append((const char *) &fsid0, sizeof(fsid0));
+	key.append((const char *) &fsid1, sizeof(fsid1));
+
+	auto cached = handlePaths.find(key);
+	if (cached != handlePaths.end())
+		return cached->second;
+
+	int mountFd = -1;
+	for (auto & mount : mounts)
+		if (mount.first == std::make_pair(fsid0, fsid1))
+			mountFd = mount.second;
+	if (mountFd == -1)
+		return "";
+
+	int directoryFd = open_by_handle_at(mountFd, fileHandle,
+			O_PATH | O_CLOEXEC);
+	if (directoryFd == -1)
+		return "";
+
+	char link[PATH_MAX];
+	string proc = "/proc/self/fd/" + std::to_string(directoryFd);
+	ssize_t length = readlink(proc.c_str(), link, sizeof(link));
+	close(directoryFd);
+
+	if (length <= 0 || (size_t) length >= sizeof(link))
+		return "";
+
+	string path(link, length);
+	if (handlePaths.size() >= WATCHER_MAX_HANDLES)
+		handlePaths.clear();
+	handlePaths.emplace(key, path);
+
+	return path;
+}
+
+void Watcher::readFanotify() {
+#ifdef FAN_REPORT_DFID_NAME
+	alignas(struct fanotify_event_metadata) char buffer[WATCHER_BUFFER_SIZE];
+
+	for (ssize_t length; (length = ::read(fd, buffer, sizeof(buffer))) > 0; ) {
+		struct fanotify_event_metadata * event =
+				(struct fanotify_event_metadata *) buffer;
+
+		for (; FAN_EVENT_OK(event, length);
+				event = FAN_EVENT_NEXT(event, length)) {
+			if (event->vers != FANOTIFY_METADATA_VERSION)
+				throw runtime_error("Unexpected fanotify metadata version");
+
+			if (event->mask & FAN_Q_OVERFLOW) {
+				overflowed = true;
+				continue;
+			}
+
+			struct fanotify_event_info_fid * info =
+					(struct fanotify_event_info_fid *) (event + 1);
+			if ((char *) (info + 1) > (char *) event + event->event_len ||
+					info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+				continue;
+
+			struct file_handle * handle = (struct file_handle *) info->handle;
+			const char * name = (const char *) handle->f_handle +
+					handle->handle_bytes;
+			bool directory = event->mask & FAN_ONDIR;
+
+			//Paths cached below a renamed or deleted directory are stale
+			if (directory && (event->mask & (FAN_MOVED_FROM | FAN_DELETE)))
+				handlePaths.clear();
+
+			string parent = resolve(info->fsid.val[0], info->fsid.val[1],
+					handle);
+			if (parent.empty())
+				continue;
+
+			add(strcmp(name, ".") ? parent + "/" + name : parent, directory);
+		}
+	}
+#endif
+}
+
+void Watcher::readInotify() {
+	alignas(struct inotify_event) char buffer[WATCHER_BUFFER_SIZE];
+
+	for (ssize_t length; (length = ::read(fd, buffer, sizeof(buffer))) > 0; ) {
+		for (char * next = buffer; next < buffer + length; ) {
+			struct inotify_event * event = (struct inotify_event *) next;
+			next += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				overflowed = true;
+				continue;
+			}
+
+			auto watch = watches.find(event->wd);
+			if (watch == watches.end())
+				continue;
+			if (event->mask & IN_IGNORED) {
+				renamed.erase(watch->first);
+				watches.erase(watch);
+				continue;
+			}
+
+			string path = event->len ?
+					watch->second + "/" + event->name : watch->second;
+			//Self events are on the watched directory, without IN_ISDIR
+			bool directory = event->mask & (IN_ISDIR | IN_MOVE_SELF);
+
+			//Comes after IN_MOVED_TO, without it the directory left the
+			//roots and the paths stored below it are stale
+			if ((event->mask & IN_MOVE_SELF) && ! renamed.erase(event->wd))
+				unwatchTree(path);
+
+			if (directory && (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+					FilesystemHelper::isUnder(path, roots))
+				watchTree(path);
+
+			add(path, directory);
+		}
+	}
+}
+
+void Watcher::read() {
+	if (fanotify)
+		readFanotify();
+	else
+		readInotify();
+}
+
+void Watcher::add(const string & path, bool directory) {
+	if (! FilesystemHelper::isUnder(path, roots))
+		return;
+
+	Pending & entry = pending[path];
+	entry.changed = steady_clock::now();
+	entry.directory |= directory;
+
+	if (pending.size() > WATCHER_MAX_PENDING) {
+		overflowed = true;
+		pending.clear();
+	}
+}
+
+bool Watcher::takeSettled(set<string> & files, set<string> & directories) {
+	time_point settled = steady_clock::now() - seconds(WATCHER_SETTLE_SECONDS);
+
+	if (overflowed) {
+		overflowed = false;
+		pending.clear();
+		return true;
+	}
+
+	for (auto it = pending.begin(); it != pending.end(); ) {
+		if (it->second.changed > settled) {
+			it++;
+			continue;
+		}
+
+		(it->second.directory ? directories : files).insert(it->first);
+		it = pending.erase(it);
+	}
+
+	return false;
+}
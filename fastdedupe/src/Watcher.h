@@ -0,0 +1,96 @@
+/*
+ * Watcher.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef WATCHER_H_
+#define WATCHER_H_
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//Paths changing this recently are left for a later batch
+#define WATCHER_SETTLE_SECONDS 2
+//Past this many pending paths a full walk is cheaper
+#define WATCHER_MAX_PENDING 1000000
+
+/*
+ * Collects the paths changed below a set of roots. fanotify watches the
+ * whole filesystem of each root and reports a directory handle and a
+ * name per event (FAN_REPORT_DFID_NAME, CAP_SYS_ADMIN); without it every
+ * directory gets an inotify watch. Lost events, a queue overflow or too
+ * many pending paths, are reported so the caller walks everything.
+ */
+class Watcher {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+private:
+	struct Pending {
+		time_point changed;
+		bool directory;
+	};
+
+	const std::set<std::string> roots;
+	int fd;
+	bool fanotify;
+	bool overflowed;
+	size_t unwatched;
+	std::map<std::string, Pending> pending;
+
+	//fanotify: one open directory per watched filesystem, by fsid
+	std::vector<std::pair<std::pair<int, int>, int>> mounts;
+	std::unordered_map<std::string, std::string> handlePaths;
+
+	//inotify: path of each watched directory
+	std::unordered_map<int, std::string> watches;
+	//Moved inside the roots, their IN_MOVE_SELF is expected
+	std::set<int> renamed;
+
+	bool startFanotify();
+
+	void startInotify();
+
+	void watchTree(const std::string & directory);
+
+	void unwatchTree(const std::string & directory);
+
+	std::string resolve(int fsid0, int fsid1, void * handle);
+
+	void readFanotify();
+
+	void readInotify();
+
+	void add(const std::string & path, bool directory);
+public:
+	Watcher(const std::set<std::string> & roots);
+
+	Watcher(const Watcher &) = delete;
+
+	virtual ~Watcher();
+
+	int getDescriptor() const;
+
+	bool usesFanotify() const;
+
+	//Directories inotify could not watch, past the user limit
+	size_t getUnwatched() const;
+
+	//Drains the events ready on the descriptor
+	void read();
+
+	/*
+	 * Hands over the paths quiet for WATCHER_SETTLE_SECONDS, returns
+	 * true instead when events were lost since the last call.
+	 */
+	bool takeSettled(std::set<std::string> & files,
+			std::set<std::string> & directories);
+};
+
+#endif /* WATCHER_H_ */
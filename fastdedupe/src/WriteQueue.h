@@ -0,0 +1,80 @@
+/*
+ * WriteQueue.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: adam
+ */
+
+#ifndef WRITEQUEUE_H_
+#define WRITEQUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+/*
+ * Unbounded lock-free multi-producer single-consumer queue.
+ * Producers only exchange the head pointer, the consumer owns
+ * the tail. pop() may transiently return false while a producer
+ * is between the exchange and the link, callers just retry.
+ */
+template <typename T>
+class WriteQueue {
+private:
+	struct Node {
+		std::atomic<Node *> next;
+		T value;
+
+		Node() : next(NULL) {
+		}
+
+		Node(T && value) : next(NULL), value(std::move(value)) {
+		}
+	};
+
+	std::atomic<Node *> head;
+	Node * tail;
+	std::atomic<size_t> count;
+
+public:
+	WriteQueue() :
+		head(new Node()), count(0) {
+		tail = head.load();
+	}
+
+	WriteQueue(const WriteQueue &) = delete;
+
+	virtual ~WriteQueue() {
+		T value;
+		while (pop(value));
+		delete tail;
+	}
+
+	void push(T && value) {
+		Node * node = new Node(std::move(value));
+
+		count.fetch_add(1, std::memory_order_relaxed);
+		Node * previous = head.exchange(node,
+				std::memory_order_acq_rel);
+		previous->next.store(node, std::memory_order_release);
+	}
+
+	bool pop(T & value) {
+		Node * next = tail->next.load(std::memory_order_acquire);
+
+		if (next == NULL)
+			return false;
+
+		value = std::move(next->value);
+		delete tail;
+		tail = next;
+		count.fetch_sub(1, std::memory_order_relaxed);
+
+		return true;
+	}
+
+	size_t size() const {
+		return count.load(std::memory_order_relaxed);
+	}
+};
+
+#endif /* WRITEQUEUE_H_ */
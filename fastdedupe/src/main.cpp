@@ -4,18 +4,43 @@
  *  Created on: May 17, 2020
  *      Author: adam
  */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 
+#include "BlockIndex.h"
+#include "Daemon.h"
 #include "Database.h"
+#include "DedupePlanner.h"
+#include "DirectoryTree.h"
+#include "ExtentsIndex.h"
 #include "File.h"
+#include "FileCatalog.h"
 #include "FilesystemHelper.h"
 #include "Hasher.h"
 #include "HashStore.h"
+#include "JsonWriter.h"
+#include "LogDatabase.h"
+#include "RollingScan.h"
+#include "ShardedDatabase.h"
+#include "Snapshot.h"
+#include "SnapshotDatabase.h"
+#include "Stats.h"
+#include "SubtreeLock.h"
+#include "Throttle.h"
+#include "Trace.h"
+#include "Watcher.h"
 
 typedef Hasher::hash hash;
 
@@ -34,55 +59,295 @@ using std::vector;
 
 #define BUFFER_SIZE 500
 
+struct Options {
+	string dbFile = "files.db";
+	string importFile;
+	string exportFile;
+	string planFile;
+	size_t shards = 0;
+	string shardKey = "hash";
+	set<string> files;
+	bool recursive = false;
+	bool updateExtents = false;
+	bool dedupe = false;
+	bool gc = false;
+	bool global = false;
+	size_t jobs = 1;
+	uint64_t maxBytes = 0;
+	size_t maxGroups = 0;
+	double timeBudget = 0;
+	uint64_t ioBudget = 0;
+	Throttle::Limits ioLimits;
+	string ioPriority;
+	string throttleFile;
+	uint32_t blockSize = 0;
+	string statsFile;
+	string traceFile;
+	bool progress = false;
+	bool daemon = false;
+	bool watch = false;
+	double reconcile = 86400;
+	string socketFile;
+	string request;
+};
+
+//Start of the run, or of the current request in daemon mode, and the
+//bytes of the files hashed since
+auto started = std::chrono::steady_clock::now();
+std::atomic<uint64_t> hashedBytes(0);
+
 Database * db;
+FileCatalog *catalog;
 HashStore *hs;
 
 int showError(const string & program) {
 	cout<<"Usage: "<<program<<
-			"[--db-file file] [--update-extents] [--dedupe] "
-			"[--input input] [--recursive] file1 file2\n";
+			"[--db-file file] [--update-extents] [--dedupe] [--global] "
+			"[--gc] [--import file] [--export file] [--plan file] "
+			"[--shards count] [--shard-by hash|directory] [--jobs count] "
+			"[--max-bytes bytes[K|M|G|T]] [--max-groups count] "
+			"[--time-budget seconds] [--io-budget bytes[K|M|G|T]] "
+			"[--block-size bytes[K|M]] "
+			"[--io-rate bytes[K|M|G]] [--iops count] "
+			"[--io-pressure percent] [--read-latency ms] "
+			"[--ioprio class[:level]] [--throttle-file file] "
+			"[--stats file] [--progress] [--trace file] "
+			"[--daemon] [--watch] [--reconcile seconds] "
+			"[--socket file] [--send request] "
+			"[--input input] [--recursive] file1 file2\n"
+			"Database files ending in " LOG_DATABASE_EXTENSION
+			" use the append-only log format, anything else SQLite.\n"
+			"--plan writes a JSON dedupe plan from the database alone, "
+			"limited to the given files if any.\n"
+			"--dedupe handles the largest groups first and stops before "
+			"--max-bytes or --max-groups would be exceeded, or once "
+			"--time-budget seconds have passed since start or once "
+			"--io-budget bytes were hashed or deduped.\n"
+			"--recursive with a budget runs a rolling scan: the given "
+			"directories are walked, their files checked and hashed, "
+			"the subdirectories and files verified longest ago first, "
+			"until the budget is spent. The next run goes on from "
+			"there, runs in turn cover everything.\n"
+			"--global also dedupes against files indexed outside the "
+			"given files, without modifying them.\n"
+			"--block-size also hashes files in aligned blocks of that "
+			"size, a power of two from 4K to 4M, and dedupes the ranges "
+			"that partially identical files share.\n"
+			"--gc also forgets the hashes cached for shared extents.\n"
+			"--io-rate and --iops cap the bytes and the reads, FIEMAP "
+			"and dedupe calls per second. Past --io-pressure percent of "
+			"time stalled on I/O in /proc/pressure/io, or --read-latency "
+			"ms per read, the rates are halved until it eases. "
+			"--ioprio sets the I/O class as ionice does: idle, "
+			"best-effort or realtime, with a level from 0 to 7.\n"
+			"--throttle-file holds lines like 'io-rate 50M', 'iops', "
+			"'io-pressure' or 'read-latency' overriding the command "
+			"line; it is read again on SIGHUP or when it changes.\n"
+			"--recursive on btrfs, with CAP_SYS_ADMIN, only looks at the "
+			"files changed since the previous run over the same files.\n"
+			"--stats writes counters and latencies of each stage as JSON, "
+			"--progress prints them every second.\n"
+			"--trace writes a Chrome trace of the hot paths, in builds "
+			"with FASTDEDUPE_TRACE.\n"
+			"--daemon keeps the whole database in memory after scanning "
+			"the given files, and answers on --socket, by default the "
+			"database file followed by " DAEMON_SOCKET_SUFFIX ". Requests "
+			"are lines: 'scan path', 'dedupe path' (scan, then dedupe "
+			"with the files outside path as references), "
+			"'duplicates file', 'stats' and 'shutdown'; each is answered "
+			"with a line of JSON.\n"
+			"--send sends one request to a daemon and prints the answer.\n"
+			"A daemon or a --plan of every file leaves a snapshot of "
+			"the database next to it, file name followed by "
+			SNAPSHOT_EXTENSION ", read instead of the database by the "
+			"next runs as long as the database did not change; runs "
+			"over given files keep it up to date.\n"
+			"--watch runs the daemon and follows changes below the given "
+			"files with fanotify when privileged, inotify otherwise, "
+			"hashing only what changed; everything is walked again every "
+			"--reconcile seconds (default a day, 0 never) and whenever "
+			"events were lost.\n";
 	return 1;
 }
 
+uint64_t parseBytes(const string & value) {
+	size_t end;
+	uint64_t bytes = std::stoull(value, &end);
+	string suffix = value.substr(end);
+	const string units = "KMGT";
+
+	if (suffix.empty())
+		return bytes;
+	if (suffix.size() != 1 || units.find(suffix[0]) == string::npos)
+		throw invalid_argument("Invalid size '" + value + "'");
+
+	return bytes << (10 * (units.find(suffix[0]) + 1));
+}
+
+//Limits of the command line, with those of the control file over them
+void readThrottleFile(const string & throttleFile,
+		const Throttle::Limits & base, Throttle::Limits & limits) {
+	ifstream input(throttleFile);
+	Throttle::Limits loaded = base;
+	string line;
+
+	try {
+		while (std::getline(input, line)) {
+			std::istringstream fields(line);
+			string key, value;
+
+			if (! (fields >> key) || key[0] == '#')
+				continue;
+			if (! (fields >> value))
+				throw invalid_argument("No value for '" + key + "'");
+
+			if (key == "io-rate")
+				loaded.bytes = parseBytes(value);
+			else if (key == "iops")
+				loaded.operations = std::stoull(value);
+			else if (key == "io-pressure")
+				loaded.pressure = std::stod(value);
+			else if (key == "read-latency")
+				loaded.latency = std::stod(value);
+			else
+				throw invalid_argument("Unknown limit '" + key + "'");
+		}
+	} catch (std::logic_error &error) {
+		cerr << "Ignoring '" << throttleFile << "': " << error.what() << "\n";
+		return;
+	}
+
+	limits = loaded;
+	cerr << "I/O limits from '" << throttleFile << "': "
+			<< limits.bytes << " bytes/s, " << limits.operations
+			<< " IOPS, pressure " << limits.pressure << "%, latency "
+			<< limits.latency << " ms\n";
+}
+
 void listFiles(set<string> &patterns,
-		map<string, File> &files,
+		FileCatalog &catalog,
 		const set<string> &filenames,
 		bool recursive) {
 	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
-	list<FileInfo> fileinfos;
+	Stats::Timer timer(Stats::WALK);
 	list<IgnoredFile> ignored;
+	auto addFile = [&catalog] (const FileInfo & info) {
+		catalog.add(info.filename, info.mTime, info.size);
+	};
 	cout << "Loading files...\n";
 	if (recursive) {
-		fsHelper.recursiveRead(filenames, fileinfos, patterns, ignored);
+		fsHelper.recursiveRead(filenames, addFile, patterns, ignored);
 	} else {
+		list<FileInfo> fileinfos;
 		fsHelper.fetchInfos(filenames, fileinfos, patterns, ignored);
+		for (const auto &info : fileinfos)
+			if (info.regType)
+				addFile(info);
 	}
+	timer.setCount(catalog.size());
 	for (const auto &item : ignored) {
 		cout << "Ignored '" << item.fullpath << "': " << item.message << "\n";
 		if (item.error == ENOENT) {
 			db->removeFile(item.fullpath);
 		}
 	}
+}
 
-	for (auto it = fileinfos.begin();
-			it!=fileinfos.end();
-			fileinfos.erase(it), it=fileinfos.begin()) {
+//Option naming the budget spent, NULL while there is some left
+const char * spentBudget(const Options & options, uint64_t bytes = 0) {
+	std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - started;
 
-		if (it->regType) {
-			const auto &entry = files.emplace(it->filename,
-						File(*hs, it->mTime, it->size));
-			entry.first->second.setFilename(entry.first->first);
+	if (options.timeBudget > 0 && elapsed.count() >= options.timeBudget)
+		return "--time-budget";
+	if (options.ioBudget && hashedBytes + bytes >= options.ioBudget)
+		return "--io-budget";
+	return NULL;
+}
+
+/*
+ * Brings the given files, or the whole catalog, up to date from several
+ * threads; clean files are skipped unless their extents are refreshed.
+ * Returns false when the budget ran out first, updated then tells the
+ * files it got through.
+ */
+bool hashFiles(FileCatalog &catalog,
+		const vector<FileId> *files,
+		bool updateExtentsFlag,
+		size_t jobs,
+		const Options *budget = NULL,
+		vector<uint8_t> *updated = NULL) {
+	const size_t total = files ? files->size() : catalog.size();
+	std::atomic<size_t> next(0);
+	std::atomic<bool> stopped(false);
+	std::mutex outputMutex;
+	std::exception_ptr failure;
+	auto worker = [&] () {
+		try {
+			for (size_t i = next++; i < total; i = next++) {
+				FileId id = files ? (*files)[i] : i;
+
+				if (catalog.hasFlag(id, FileCatalog::REMOVED))
+					continue;
+				if (budget && spentBudget(*budget)) {
+					stopped = true;
+					break;
+				}
+
+				File file(*hs, id);
+				bool clean = catalog.hasFlag(id, FileCatalog::CLEAN);
+				try {
+					file.update(updateExtentsFlag);
+					if (! clean)
+						hashedBytes += catalog.getSize(id);
+					if (updated)
+						(*updated)[i] = true;
+					std::lock_guard<std::mutex> lock(outputMutex);
+					cout << file;
+				} catch (invalid_argument &error) {
+					std::lock_guard<std::mutex> lock(outputMutex);
+					cout << "Ignoring file '" << file.getFilename() << "': "
+							<< error.what()
+							<< "\n";
+					catalog.remove(id);
+				}
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(outputMutex);
+			if (! failure)
+				failure = std::current_exception();
+			next = total;
 		}
-	}
+	};
+
+	vector<std::thread> workers;
+	for (size_t i = 1; i < jobs; i++)
+		workers.emplace_back(worker);
+	worker();
+	for (std::thread & thread : workers)
+		thread.join();
+
+	if (failure)
+		std::rethrow_exception(failure);
+
+	if (db->getBacklog())
+		cout << "Waiting for " << db->getBacklog()
+				<< " pending database writes...\n";
+	db->flush();
+
+	return ! stopped;
 }
 
-void updateFiles(map<string, File> &files,
+bool updateFiles(FileCatalog &catalog,
 		const set<string> &patterns,
-		bool updateExtentsFlag) {
+		const vector<FileId> *files,
+		bool updateExtentsFlag,
+		size_t jobs,
+		const Options *budget = NULL) {
 
 	list<string> dbIgnored;
 	cout << "Reading from database...\n";
-	db->updateFiles(files, dbIgnored, patterns);
+	db->updateFiles(*hs, dbIgnored, patterns);
 
 	for (auto iterator = dbIgnored.begin();
 			iterator != dbIgnored.end();
@@ -96,75 +361,1234 @@ void updateFiles(map<string, File> &files,
 		db->removeFile(filename);
 	}
 
-	auto it = files.begin();
-	while (it != files.end()) {
-		auto cur = it;
-		it++;
+	return hashFiles(catalog, files, updateExtentsFlag, jobs, budget);
+}
+
+void runAction(const DedupeAction &action) {
+	map<string, string> failures;
+	try {
+		File(*hs, action.source).dedupe(action.destinations, failures);
+	} catch (exception &error) {
+		cerr << "Could not dedupe: " << error.what() << "\n";
+	}
+	for (auto &failure : failures) {
+		cout << "Could not dedupe '" << failure.first << "': "
+				<< failure.second << "\n";
+	}
+}
+
+//Files of a subtree are left out of the per file plan
+void markSubtree(const DedupeAction &action) {
+	FileCatalog &catalog = hs->getCatalog();
+
+	catalog.setFlag(action.source, FileCatalog::SUBTREE_SOURCE, true);
+	for (FileId file : action.destinations)
+		catalog.setFlag(file, FileCatalog::SUBTREE_COPY, true);
+}
+
+//Ranges shared with other files, reported and deduped as they come
+void runRange(const RangeAction &range) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	map<string, string> failures;
+	try {
+		fsHelper.dedupeRange(catalog->getFilename(range.source),
+				range.sourceOffset, catalog->getFilename(range.destination),
+				range.destinationOffset, range.length, failures);
+	} catch (exception &error) {
+		cerr << "Could not dedupe: " << error.what() << "\n";
+	}
+	for (auto &failure : failures) {
+		cout << "Could not dedupe '" << failure.first << "': "
+				<< failure.second << "\n";
+	}
+}
+
+void loadBlocks(BlockIndex &blocks) {
+	db->loadBlocks([&blocks] (const Hash & extentsHash,
+			const BlockHashes & hashes) {
+		FileId file = hs->getFile(extentsHash);
+
+		if (file != NO_FILE &&
+				! catalog->hasFlag(file, FileCatalog::REFERENCE))
+			blocks.add(file, hashes);
+	});
+}
+
+struct DedupeTotals {
+	size_t groups;
+	uint64_t bytes;
+};
+
+DedupeTotals doDedupe(const Options & options, const set<string> &patterns) {
+	cout << "\nFetching duplicates...\n";
+	FileCatalog &catalog = hs->getCatalog();
+	DirectoryTree tree(catalog, patterns);
+	vector<SubtreeAction> subtrees;
+	DedupePlanner planner(*hs);
+	DedupeAction action;
+	size_t groups = 0, subtree = 0;
+	uint64_t bytes = 0;
+	const char * limit = NULL;
+	size_t stopped = 0;
+
+	auto getLimit = [&] (uint64_t expected) -> const char * {
+		if (options.maxGroups && groups >= options.maxGroups)
+			return "--max-groups";
+		if (const char * budget = spentBudget(options, bytes + expected))
+			return budget;
+		if (options.maxBytes && bytes + expected > options.maxBytes)
+			return "--max-bytes";
+		return NULL;
+	};
+
+	tree.plan(subtrees);
+	for (; subtree < subtrees.size(); subtree++) {
+		const SubtreeAction &unit = subtrees[subtree];
+		vector<DedupeAction> actions;
+
+		if ((limit = getLimit(unit.expectedBytes)))
+			break;
+
+		if (groups == 0)
+			cout << "\nDeduplicating:\n";
+		groups++;
+		bytes += unit.expectedBytes;
+
+		cout << tree.getPath(unit.source) << "/ (" << unit.files
+				<< " files, " << unit.expectedBytes << " bytes to free)\n";
+		for (uint32_t destination : unit.destinations)
+			cout << "  " << tree.getPath(destination) << "/\n";
+
+		tree.expand(unit, actions);
+		for (const DedupeAction &fileAction : actions) {
+			markSubtree(fileAction);
+			runAction(fileAction);
+		}
+		cout << "\n";
+	}
+
+	if (! limit)
+		planner.start();
+	while (! limit && ! (limit = getLimit(0)) && planner.next(action)) {
+		if ((limit = getLimit(action.expectedBytes))) {
+			stopped = 1;
+			break;
+		}
+
+		if (groups == 0)
+			cout << "\nDeduplicating:\n";
+		groups++;
+		bytes += action.expectedBytes;
+
+		cout << catalog.getFilename(action.source) << " ("
+				<< action.expectedBytes << " bytes to free)\n";
+		for (FileId file : action.destinations) {
+			cout << "  " << catalog.getFilename(file) << "\n";
+		}
+		runAction(action);
+		cout << "\n";
+	}
+
+	/*
+	 * Destinations keep their stored extents hash after a range dedupe,
+	 * their block hashes stay attached until the file is hashed again.
+	 */
+	vector<RangeAction> ranges;
+	size_t range = 0;
+	if (! limit && options.blockSize) {
+		BlockIndex blocks(catalog, options.blockSize);
+		FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+		FileId sourceFile = NO_FILE, destinationFile = NO_FILE;
+		vector<FiemapData> sourceExtents, destinationExtents;
+
+		loadBlocks(blocks);
+		blocks.match(ranges);
+
+		for (; range < ranges.size(); range++) {
+			const RangeAction &shared = ranges[range];
+
+			if ((limit = getLimit(shared.length)))
+				break;
+
+			try {
+				if (sourceFile != shared.source) {
+					sourceFile = shared.source;
+					sourceExtents = fsHelper.getFiemapData(
+							catalog.getFilename(sourceFile),
+							catalog.getSize(sourceFile));
+				}
+				if (destinationFile != shared.destination) {
+					destinationFile = shared.destination;
+					destinationExtents = fsHelper.getFiemapData(
+							catalog.getFilename(destinationFile),
+							catalog.getSize(destinationFile));
+				}
+			} catch (exception &error) {
+				sourceFile = destinationFile = NO_FILE;
+				continue;
+			}
+
+			if (BlockIndex::isShared(sourceExtents, shared.sourceOffset,
+					destinationExtents, shared.destinationOffset,
+					shared.length))
+				continue;
+
+			if (groups == 0)
+				cout << "\nDeduplicating:\n";
+			groups++;
+			bytes += shared.length;
+
+			cout << catalog.getFilename(shared.source) << " @"
+					<< shared.sourceOffset << " (" << shared.length
+					<< " bytes to free)\n  "
+					<< catalog.getFilename(shared.destination) << " @"
+					<< shared.destinationOffset << "\n";
+			runRange(shared);
+			destinationFile = NO_FILE;
+			cout << "\n";
+		}
+	}
+
+	if (limit && subtree < subtrees.size())
+		cout << "Stopped at " << limit << " after " << groups
+				<< " groups (" << bytes << " bytes), "
+				<< subtrees.size() - subtree << " subtrees left\n";
+	else if (limit && range < ranges.size())
+		cout << "Stopped at " << limit << " after " << groups
+				<< " groups (" << bytes << " bytes), "
+				<< ranges.size() - range << " ranges left\n";
+	else if (limit)
+		cout << "Stopped at " << limit << " after " << groups
+				<< " groups (" << bytes << " bytes), "
+				<< planner.pending() + stopped << " groups left\n";
+	else if (groups == 0)
+		cout << "\nNo duplicates pending deduplication\n";
+
+	return DedupeTotals{groups, bytes};
+}
+
+void loadFromDatabase(const set<string> &patterns) {
+	FileCatalog &catalog = hs->getCatalog();
+
+	cout << "Reading from database...\n";
+	for (const string &pattern : patterns) {
+		db->loadFiles(pattern, [&catalog] (const FileRecord &record) {
+			//Nested patterns return some files twice
+			if (catalog.find(record.filename) != NO_FILE)
+				return;
+
+			FileId id = catalog.add(record.filename, record.mTime,
+					record.size);
+			File(*hs, id).update(record.mTime, record.extentsHash,
+					record.dataHash, record.hashVersion);
+		});
+	}
+}
+
+/*
+ * Reads the catalog and the hash store of the whole database from its
+ * snapshot, unless the database changed since it was taken.
+ */
+bool readSnapshot(const string &snapshotFile,
+		std::unique_ptr<FileCatalog> &loadedCatalog,
+		std::unique_ptr<HashStore> &loadedStore, string &version) {
+	version = db->getVersion();
+	loadedCatalog.reset(new FileCatalog());
+	loadedStore.reset(new HashStore(db, loadedCatalog.get()));
+
+	if (! ifstream(snapshotFile).is_open())
+		return false;
+
+	try {
+		SnapshotReader snapshot(snapshotFile);
+
+		if (version.empty() || snapshot.getVersion() != version) {
+			cout << "Database changed since its snapshot\n";
+			return false;
+		}
+
+		cout << "Reading snapshot...\n";
+		loadedCatalog->load(snapshot);
+		loadedStore->load(snapshot);
+	} catch (runtime_error &error) {
+		cout << "Ignoring snapshot: " << error.what() << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+//Takes the whole database from its snapshot as the resident catalog
+bool loadSnapshot(const string &snapshotFile) {
+	std::unique_ptr<FileCatalog> loadedCatalog;
+	std::unique_ptr<HashStore> loadedStore;
+	string version;
+
+	if (! readSnapshot(snapshotFile, loadedCatalog, loadedStore, version))
+		return false;
+
+	delete hs;
+	delete catalog;
+	catalog = loadedCatalog.release();
+	hs = loadedStore.release();
+	cout << "Loaded " << catalog->size() << " files from the snapshot\n";
+
+	return true;
+}
+
+/*
+ * Reads the records of the database from its snapshot for the rest of
+ * the run, which then keeps it up to date. The resident catalog only
+ * gets the files the run looks at, as without a snapshot.
+ */
+SnapshotDatabase * mirrorSnapshot(const string &snapshotFile) {
+	std::unique_ptr<FileCatalog> loadedCatalog;
+	std::unique_ptr<HashStore> loadedStore;
+	string version;
+
+	if (! readSnapshot(snapshotFile, loadedCatalog, loadedStore, version))
+		return NULL;
+
+	cout << "Read " << loadedCatalog->size() << " records from the "
+			"snapshot\n";
+	SnapshotDatabase * mirror = new SnapshotDatabase(db,
+			loadedCatalog.release(), loadedStore.release(), version);
+
+	db = mirror;
+	delete hs;
+	hs = new HashStore(db, catalog);
+
+	return mirror;
+}
+
+//For the next run over the database, unless another one wrote
+void saveSnapshot(const string &snapshotFile,
+		const FileCatalog &savedCatalog, const HashStore &savedStore) {
+	string version = db->getVersion();
+
+	if (version.empty()) {
+		cout << "Database changed by another run, no snapshot taken\n";
+		return;
+	}
+
+	cout << "Writing snapshot...\n";
+	try {
+		SnapshotWriter snapshot(snapshotFile, version);
+
+		savedCatalog.save(snapshot);
+		savedStore.save(snapshot);
+		snapshot.commit();
+	} catch (runtime_error &error) {
+		cout << "Could not write snapshot: " << error.what() << "\n";
+	}
+}
+
+/*
+ * Adds the files indexed outside the patterns that have the same data as
+ * a file already loaded, flagged as references. Files whose mtime or
+ * size changed since they were indexed are left out.
+ */
+void loadReferences(const set<string> &patterns) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	FileCatalog &catalog = hs->getCatalog();
+	size_t count = 0, stale = 0;
+
+	cout << "Reading references from database...\n";
+	db->loadFiles("", [&] (const FileRecord &record) {
+		if (! hs->hasDataHash(record.dataHash) ||
+				FilesystemHelper::isUnder(record.filename, patterns) ||
+				catalog.find(record.filename) != NO_FILE)
+			return;
 
 		try {
-			cur->second.update(updateExtentsFlag);
-			cout << cur->second;
-		} catch (invalid_argument &error) {
-			cout << "Ignoring file '" << cur->first << "': "
-					<< error.what()
-					<< "\n";
-			files.erase(cur);
+			FileInfo info = fsHelper.getInfo(record.filename);
+
+			if (! info.regType || info.mTime != record.mTime ||
+					(record.size && (size_t) info.size != record.size)) {
+				stale++;
+				return;
+			}
+
+			FileId id = catalog.add(record.filename, info.mTime, info.size);
+			catalog.setFlag(id, FileCatalog::REFERENCE, true);
+			File(*hs, id).update(record.mTime, record.extentsHash,
+					record.dataHash, record.hashVersion);
+			count++;
+		} catch (int error) {
+			stale++;
+		}
+	});
+
+	cout << "Using " << count << " references, ignored " << stale
+			<< " changed since indexed\n";
+}
+
+void writePlan(const string &planFile, const string &dbFile,
+		const set<string> &patterns) {
+	FileCatalog &catalog = hs->getCatalog();
+	ExtentsIndex layouts;
+
+	db->loadExtents([&layouts] (const Hash &extentsHash,
+			const vector<FiemapData> &extents) {
+		layouts.add(extentsHash, extents);
+	});
+
+	cout << "Planning...\n";
+	DirectoryTree tree(catalog, patterns);
+	vector<SubtreeAction> subtrees;
+	DedupePlanner planner(*hs, &layouts);
+	vector<DedupeAction> actions, fileActions;
+
+	tree.plan(subtrees);
+	for (size_t i = 0; i < subtrees.size(); i++) {
+		size_t first = actions.size();
+
+		tree.expand(subtrees[i], actions);
+		for (size_t j = first; j < actions.size(); j++) {
+			DedupeAction &action = actions[j];
+			size_t count;
+			const FiemapData * ranges = layouts.find(
+					catalog.getExtentsHash(action.source), count);
+
+			//The database does not always know sizes, the layout does
+			if (! action.expectedBytes && ranges) {
+				for (size_t k = 0; k < count; k++)
+					action.expectedBytes += ranges[k].length;
+				action.expectedBytes *= action.destinations.size();
+			}
+			action.freedBytes = action.expectedBytes;
+
+			action.subtree = i;
+			markSubtree(action);
 		}
 	}
 
-	db->cleanHashes();
+	planner.plan(fileActions);
+	actions.insert(actions.end(), fileActions.begin(), fileActions.end());
+	planner.estimateSavings(actions);
+
+	//Files of a subtree are reported with it
+	vector<DedupeAction> subtreeTotals(subtrees.size(),
+			DedupeAction{NO_FILE, {}, 0, 0, 0, true});
+	fileActions.clear();
+	for (const DedupeAction &action : actions) {
+		if (action.subtree == SIZE_MAX) {
+			fileActions.push_back(action);
+			continue;
+		}
+
+		DedupeAction &total = subtreeTotals[action.subtree];
+		total.expectedBytes += action.expectedBytes;
+		total.freedBytes += action.freedBytes;
+		total.exact &= action.exact;
+	}
+	actions.swap(fileActions);
+
+	ofstream out(planFile);
+	if (! out.is_open())
+		throw runtime_error("Could not write '" + planFile + "'");
+
+	uint64_t expected = 0, freed = 0, inexact = 0;
+	for (const DedupeAction &action : actions) {
+		expected += action.expectedBytes;
+		freed += action.freedBytes;
+		inexact += ! action.exact;
+	}
+	for (const DedupeAction &total : subtreeTotals) {
+		expected += total.expectedBytes;
+		freed += total.freedBytes;
+		inexact += ! total.exact;
+	}
+
+	//Removed files keep their place in a catalog read from a snapshot
+	uint64_t files = 0;
+	for (FileId id = 0; id < catalog.size(); id++)
+		files += ! catalog.hasFlag(id, FileCatalog::REMOVED);
+
+	JsonWriter json(out);
+	json.beginObject()
+		.key("database").value(dbFile)
+		.key("files").value(files)
+		.key("layouts").value((uint64_t) layouts.size())
+		.key("subtrees").value((uint64_t) subtrees.size())
+		.key("groups").value((uint64_t) actions.size())
+		.key("inexact_groups").value(inexact)
+		.key("expected_bytes").value(expected)
+		.key("freed_bytes").value(freed)
+		.key("subtree_actions").beginArray();
+
+	for (size_t i = 0; i < subtrees.size(); i++) {
+		json.beginObject()
+			.key("source").value(tree.getPath(subtrees[i].source))
+			.key("files").value((uint64_t) subtrees[i].files)
+			.key("expected_bytes").value(subtreeTotals[i].expectedBytes)
+			.key("freed_bytes").value(subtreeTotals[i].freedBytes)
+			.key("exact").value(subtreeTotals[i].exact)
+			.key("destinations").beginArray();
+		for (uint32_t destination : subtrees[i].destinations)
+			json.value(tree.getPath(destination));
+		json.endArray().endObject();
+	}
+
+	json.endArray()
+		.key("actions").beginArray();
+
+	for (const DedupeAction &action : actions) {
+		json.beginObject()
+			.key("data_hash").value((string) catalog.getDataHash(action.source))
+			.key("source").value(catalog.getFilename(action.source))
+			.key("source_extents").value((uint64_t) action.extentCount)
+			.key("expected_bytes").value(action.expectedBytes)
+			.key("freed_bytes").value(action.freedBytes)
+			.key("exact").value(action.exact)
+			.key("destinations").beginArray();
+		for (FileId file : action.destinations)
+			json.value(catalog.getFilename(file));
+		json.endArray().endObject();
+	}
+
+	json.endArray().endObject();
+
+	if (! out.good())
+		throw runtime_error("Could not write '" + planFile + "'");
+
+	cout << "Planned " << subtrees.size() << " subtrees and "
+			<< actions.size() << " groups freeing "
+			<< freed << " bytes (" << expected << " by size), "
+			<< inexact << " without a stored layout\n";
 }
 
-void doDedupe() {
-	cout << "\nFetching duplicates...\n";
-	map<File*, set<File*> > candidates;
-	hs->getDedupeCandidates(candidates);
-	if (candidates.size())
-		cout << "\nDeduplicating:\n";
+set<string> getRoots(const set<string> & filenames) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	set<string> roots;
+
+	for (const string & filename : filenames) {
+		try {
+			roots.insert(fsHelper.getRealPath(filename));
+		} catch (int error) {
+			roots.insert(filename);
+		}
+	}
+
+	return roots;
+}
+
+//Samples the database backlog every second, printing progress if asked
+class Ticker {
+private:
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool done;
+	std::thread thread;
+
+public:
+	Ticker(bool print) :
+		done(false) {
+		thread = std::thread([this, print] {
+			Stats &stats = Stats::getStats();
+			std::unique_lock<std::mutex> lock(mutex);
+
+			while (! wakeup.wait_for(lock, std::chrono::seconds(1),
+					[this] { return done; })) {
+				stats.sample(Stats::DATABASE_BACKLOG, db->getBacklog());
+				if (print)
+					cerr << stats.getProgress() << "\n";
+			}
+		});
+	}
+
+	~Ticker() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		wakeup.notify_one();
+		thread.join();
+	}
+};
+
+//Structures only grow between stages, sampled from the main thread
+void sampleMemory() {
+	Stats &stats = Stats::getStats();
+
+	if (! stats.isEnabled())
+		return;
+
+	stats.sample(Stats::CATALOG_BYTES, catalog->memoryUsage());
+	stats.sample(Stats::HASHSTORE_BYTES, hs->memoryUsage());
+}
+
+void writeStats(const string &statsFile) {
+	ofstream out(statsFile);
+	if (! out.is_open())
+		throw runtime_error("Could not write '" + statsFile + "'");
+
+	JsonWriter json(out);
+	Stats::getStats().write(json);
+	out << "\n";
+}
+
+struct ScanTotals {
+	size_t files;
+	size_t changed;
+	size_t removed;
+};
+
+//Drops a file the filesystem no longer has from the resident catalog
+void forgetFile(FileId id) {
+	if (catalog->hasFlag(id, FileCatalog::INDEXED))
+		hs->removeFile(id);
 	else
-		cout << "\nNo duplicates pending deduplication\n";
+		db->removeFile(catalog->getFilename(id));
+	catalog->remove(id);
+}
+
+/*
+ * Adds a file found on disk to the resident catalog, queuing it in
+ * changed when it is new, modified or back after being removed.
+ */
+FileId noteFile(const FileInfo &info, vector<FileId> &changed) {
+	FileId id = catalog->add(info.filename, info.mTime, info.size);
+
+	//Same test as a run against the database, the mtime
+	if (catalog->hasFlag(id, FileCatalog::CLEAN) &&
+			! catalog->hasFlag(id, FileCatalog::REMOVED) &&
+			catalog->getMTime(id) == info.mTime) {
+		catalog->setSize(id, info.size);
+		return id;
+	}
+
+	if (catalog->hasFlag(id, FileCatalog::INDEXED))
+		hs->removeFile(id);
+	catalog->setMTime(id, info.mTime);
+	catalog->setSize(id, info.size);
+	catalog->setFlag(id, FileCatalog::REMOVED, false);
+	catalog->setFlag(id, FileCatalog::CLEAN, false);
+	catalog->setFlag(id, FileCatalog::NEW_FILE, true);
+	changed.push_back(id);
+
+	return id;
+}
+
+/*
+ * Brings the resident catalog in line with the files under roots: new
+ * and modified files are hashed, files gone are forgotten. Files below
+ * a directory that could not be read are kept as they were.
+ */
+ScanTotals rescan(const Options & options, const set<string> &roots) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	ScanTotals totals{0, 0, 0};
+	vector<bool> seen(catalog->size());
+	vector<FileId> changed;
+	set<string> patterns, unreadable;
+	list<IgnoredFile> ignored;
+
+	cout << "Scanning...\n";
+	{
+		Stats::Timer timer(Stats::WALK);
+
+		fsHelper.recursiveRead(roots, [&] (const FileInfo &info) {
+			FileId id = noteFile(info, changed);
+
+			if (id >= seen.size())
+				seen.resize(id + 1);
+			seen[id] = true;
+			totals.files++;
+		}, patterns, ignored);
+		timer.setCount(totals.files);
+	}
 
-	for (auto &entry : candidates) {
-		cout << entry.first->getFilename() << "\n";
-		for (auto &file : entry.second) {
-			cout << "  " << file->getFilename() << "\n";
+	for (const IgnoredFile &item : ignored) {
+		if (item.error == ENOENT)
+			continue;
+		cout << "Ignored '" << item.fullpath << "': " << item.message << "\n";
+		unreadable.insert(item.fullpath);
+	}
+
+	//Decided once per directory, roots naming a file are checked apart
+	vector<int8_t> under(catalog->getDirectoryCount(), -1);
+	for (FileId id = 0; id < catalog->size(); id++) {
+		if ((id < seen.size() && seen[id]) ||
+				catalog->hasFlag(id, FileCatalog::REMOVED))
+			continue;
+
+		int8_t &inRoots = under[catalog->getDirectoryIndex(id)];
+		if (inRoots < 0) {
+			const string &directory = catalog->getDirectory(id);
+
+			inRoots = FilesystemHelper::isUnder(directory, roots) &&
+					! FilesystemHelper::isUnder(directory, unreadable);
+		}
+
+		if (inRoots) {
+			forgetFile(id);
+			totals.removed++;
 		}
-		map<string, string> failures;
+	}
+	for (const string &root : roots) {
+		FileId id = catalog->find(root);
+
+		if (id != NO_FILE && (id >= seen.size() || ! seen[id]) &&
+				! catalog->hasFlag(id, FileCatalog::REMOVED) &&
+				! unreadable.count(root)) {
+			forgetFile(id);
+			totals.removed++;
+		}
+	}
+
+	hashFiles(*catalog, &changed, false, options.jobs);
+	totals.changed = changed.size();
+
+	return totals;
+}
+
+/*
+ * Applies the paths a watcher reported: files are looked at one by one
+ * and directories, created, moved or deleted, walked again.
+ */
+ScanTotals applyChanges(const Options & options, const set<string> &files,
+		const set<string> &directories) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	ScanTotals totals{0, 0, 0};
+	vector<FileId> changed;
+
+	for (const string &filename : files) {
+		FileId id = catalog->find(filename);
+
 		try {
-			entry.first->dedupe(entry.second, failures);
-		} catch (exception &error) {
-			cerr << "Could not dedupe: " << error.what() << "\n";
+			FileInfo info = fsHelper.getInfo(filename);
+
+			if (info.regType && info.size > fsHelper.getMinSize()) {
+				noteFile(info, changed);
+				totals.files++;
+				continue;
+			}
+		} catch (int error) {
+			if (error != ENOENT)
+				continue;
 		}
-		for (auto &failure : failures) {
-			cout << "Could not dedupe '" << failure.first << "': "
-					<< failure.second << "\n";
+
+		//Gone, or no longer a file worth indexing
+		if (id != NO_FILE && ! catalog->hasFlag(id, FileCatalog::REMOVED)) {
+			forgetFile(id);
+			totals.removed++;
 		}
-		cout << "\n";
 	}
+
+	hashFiles(*catalog, &changed, false, options.jobs);
+	totals.changed = changed.size();
+
+	if (! directories.empty()) {
+		ScanTotals walked = rescan(options, directories);
+
+		totals.files += walked.files;
+		totals.changed += walked.changed;
+		totals.removed += walked.removed;
+	}
+
+	return totals;
+}
+
+/*
+ * Forgets the files the given directories no longer hold, and those
+ * below subdirectories gone from them. What they gained comes from
+ * findChanged() apart.
+ */
+size_t forgetVanished(const set<string> &directories) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	enum : int8_t { UNKNOWN = -1, KEPT, CHANGED, GONE };
+	vector<int8_t> state(catalog->getDirectoryCount(), UNKNOWN);
+	size_t removed = 0;
+
+	for (FileId id = 0; id < catalog->size(); id++) {
+		if (catalog->hasFlag(id, FileCatalog::REMOVED))
+			continue;
+
+		int8_t &directory = state[catalog->getDirectoryIndex(id)];
+		if (directory == UNKNOWN) {
+			const string &path = catalog->getDirectory(id);
+
+			if (directories.count(path)) {
+				directory = CHANGED;
+			} else if (FilesystemHelper::isUnder(path, directories)) {
+				try {
+					directory = fsHelper.getInfo(path).dirType ? KEPT : GONE;
+				} catch (int error) {
+					directory = error == ENOENT ? GONE : KEPT;
+				}
+			} else {
+				directory = KEPT;
+			}
+		}
+
+		bool gone = directory == GONE;
+		if (directory == CHANGED) {
+			try {
+				fsHelper.getInfo(catalog->getFilename(id));
+			} catch (int error) {
+				gone = error == ENOENT;
+			}
+		}
+
+		if (gone) {
+			forgetFile(id);
+			removed++;
+		}
+	}
+
+	return removed;
+}
+
+/*
+ * Run against the database on btrfs: the catalog is loaded from it and
+ * only what changed since the generation stored for each root is looked
+ * at. Returns false, with nothing loaded, when a root does not allow it.
+ */
+bool scanChanged(const Options & options, const set<string> &roots,
+		const map<string, BtrfsGeneration> &generations) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	set<string> files, directories, added;
+
+	if (! options.recursive || options.updateExtents ||
+			generations.size() != roots.size())
+		return false;
+
+	cout << "Loading changed files...\n";
+	{
+		Stats::Timer timer(Stats::WALK);
+
+		for (const string &root : roots) {
+			const BtrfsGeneration &current = generations.at(root);
+			BtrfsGeneration stored;
+
+			//Another filesystem or subvolume there now, or a rollback
+			if (! db->loadGeneration(root, stored) ||
+					stored.uuid != current.uuid ||
+					stored.generation > current.generation ||
+					! fsHelper.findChanged(root, stored.generation, files,
+							directories, added))
+				return false;
+		}
+		timer.setCount(files.size());
+	}
+
+	loadFromDatabase(roots);
+	size_t removed = forgetVanished(directories);
+	ScanTotals totals = applyChanges(options, files, added);
+
+	cout << "Changed since last run: " << totals.changed << " files, "
+			<< removed + totals.removed << " removed\n";
+	return true;
+}
+
+//Rolling scan of the roots within the budgets of options
+void scanStalest(const Options & options, const set<string> &roots,
+		set<string> &patterns) {
+	RollingScan scan(*db, *hs, roots, [&options] (
+			const vector<FileId> &files, vector<uint8_t> &updated) {
+		return hashFiles(*catalog, &files, options.updateExtents,
+				options.jobs, &options, &updated);
+	}, [&options] () {
+		return spentBudget(options);
+	});
+	bool done = scan.run(patterns);
+
+	sampleMemory();
+
+	if (! done) {
+		const char * limit = spentBudget(options);
+
+		cout << "Stopped at " << (limit ? limit : "the budget")
+				<< " after verifying " << scan.getVerified()
+				<< " files, the rest is left for the next run\n";
+	} else {
+		cout << "Verified all that was left, " << scan.getVerified()
+				<< " files\n";
+	}
+}
+
+void clearPlanFlags() {
+	for (FileId id = 0; id < catalog->size(); id++) {
+		catalog->setFlag(id, FileCatalog::REFERENCE, false);
+		catalog->setFlag(id, FileCatalog::SUBTREE_SOURCE, false);
+		catalog->setFlag(id, FileCatalog::SUBTREE_COPY, false);
+	}
+}
+
+/*
+ * Files outside roots take part as references, as with --global, and
+ * the flags a dedupe leaves behind are cleared for the next request.
+ * References indexed without their size, by older databases, are looked
+ * up as loadReferences does.
+ */
+DedupeTotals dedupeUnder(const Options & options, const set<string> &roots) {
+	FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+	vector<int8_t> under(catalog->getDirectoryCount(), -1);
+	DedupeTotals totals;
+
+	for (FileId id = 0; id < catalog->size(); id++) {
+		int8_t &inRoots = under[catalog->getDirectoryIndex(id)];
+
+		if (inRoots < 0)
+			inRoots = FilesystemHelper::isUnder(catalog->getDirectory(id),
+					roots);
+		catalog->setFlag(id, FileCatalog::REFERENCE, ! inRoots);
+
+		if (inRoots || catalog->getSize(id) ||
+				catalog->hasFlag(id, FileCatalog::REMOVED))
+			continue;
+		try {
+			FileInfo info = fsHelper.getInfo(catalog->getFilename(id));
+
+			if (info.regType && info.mTime == catalog->getMTime(id))
+				catalog->setSize(id, info.size);
+		} catch (int error) {
+			//Left without a size, the planner skips it as any stale file
+		}
+	}
+	for (const string &root : roots) {
+		FileId id = catalog->find(root);
+
+		if (id != NO_FILE)
+			catalog->setFlag(id, FileCatalog::REFERENCE, false);
+	}
+
+	try {
+		totals = doDedupe(options, roots);
+	} catch (...) {
+		clearPlanFlags();
+		throw;
+	}
+	clearPlanFlags();
+
+	return totals;
+}
+
+//Copies sharing extents are listed together
+void writeDuplicates(const string &filename, JsonWriter &json) {
+	FileId id = catalog->find(
+			FilesystemHelper::getFilesystemHelper().getRealPath(filename));
+	HashStore::DuplicateGroup group;
+
+	if (id == NO_FILE || catalog->hasFlag(id, FileCatalog::REMOVED) ||
+			! catalog->hasFlag(id, FileCatalog::CLEAN))
+		throw invalid_argument("'" + filename + "' is not indexed");
+
+	if (! hs->getDuplicateGroup(catalog->getDataHash(id), group)) {
+		group.assign(1, {});
+		for (FileId file = hs->getFile(catalog->getExtentsHash(id));
+				file != NO_FILE; file = catalog->getNextSameExtents(file))
+			group.back().push_back(file);
+	}
+
+	json.beginObject()
+		.key("file").value(catalog->getFilename(id))
+		.key("size").value((uint64_t) catalog->getSize(id))
+		.key("data_hash").value((string) catalog->getDataHash(id))
+		.key("copies").beginArray();
+	for (const vector<FileId> &files : group) {
+		json.beginArray();
+		for (FileId file : files)
+			json.value(catalog->getFilename(file));
+		json.endArray();
+	}
+	json.endArray().endObject();
 }
 
-int process(const string & db_file,
-		const set<string> & filenames, bool recursive,
-		bool updateExtentsFlag, bool dedupe) {
+void writeDaemonStats(const Daemon &daemon, JsonWriter &json) {
+	uint64_t files = 0;
+
+	for (FileId id = 0; id < catalog->size(); id++)
+		files += ! catalog->hasFlag(id, FileCatalog::REMOVED);
+
+	json.beginObject()
+		.key("files").value(files)
+		.key("catalog_bytes").value((uint64_t) catalog->memoryUsage())
+		.key("hashstore_bytes").value((uint64_t) hs->memoryUsage())
+		.key("database_backlog").value((uint64_t) db->getBacklog())
+		.key("requests").value((uint64_t) daemon.getRequests())
+		.key("run");
+	Stats::getStats().write(json);
+	json.endObject();
+}
+
+/*
+ * Keeps the catalog and hash indices of the whole database resident and
+ * answers requests on a socket, so callers skip reloading them. Requests
+ * run one at a time, each under the subtree locks a run would take; a
+ * dedupe scans its path first, as a run does.
+ */
+void runDaemon(const Options & options) {
+	const string socketFile = options.socketFile.empty() ?
+			options.dbFile + DAEMON_SOCKET_SUFFIX : options.socketFile;
+	Daemon daemon(socketFile);
+
+	auto scan = [&options] (const string &path, JsonWriter &json,
+			bool dedupe) {
+		if (path.empty())
+			throw invalid_argument("A path is required");
 
-	db = new Database(db_file);
-	hs = new HashStore(db);
+		set<string> roots = getRoots({path});
+		SubtreeLock lock(options.dbFile, roots, [] (const string &path) {
+			cout << "Waiting for another run on '" << path << "'...\n";
+		});
 
-	set<string> patterns;
-	map<string, File> files;
+		started = std::chrono::steady_clock::now();
+		hashedBytes = 0;
+		ScanTotals scanned = rescan(options, roots);
+		sampleMemory();
 
-	listFiles(patterns, files, filenames, recursive);
+		json.beginObject()
+			.key("files").value((uint64_t) scanned.files)
+			.key("changed").value((uint64_t) scanned.changed)
+			.key("removed").value((uint64_t) scanned.removed);
+		if (dedupe) {
+			DedupeTotals deduped = dedupeUnder(options, roots);
 
-	updateFiles(files, patterns, updateExtentsFlag);
+			json.key("groups").value((uint64_t) deduped.groups)
+				.key("bytes").value(deduped.bytes);
+		}
+		json.key("seconds").value(std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - started).count());
+		json.endObject();
+	};
+
+	daemon.on("scan", [&scan] (const string &path, JsonWriter &json) {
+		scan(path, json, false);
+	});
+	daemon.on("dedupe", [&scan] (const string &path, JsonWriter &json) {
+		scan(path, json, true);
+	});
+	daemon.on("duplicates", writeDuplicates);
+	daemon.on("stats", [&daemon] (const string &, JsonWriter &json) {
+		writeDaemonStats(daemon, json);
+	});
+
+	//Started first, what changes during the initial walk is seen again
+	const set<string> roots = getRoots(options.files);
+	std::unique_ptr<Watcher> watcher;
+	if (options.watch) {
+		watcher.reset(new Watcher(roots));
+		cout << "Watching with "
+				<< (watcher->usesFanotify() ? "fanotify" : "inotify") << "\n";
+		if (watcher->getUnwatched())
+			cout << watcher->getUnwatched() << " directories over the "
+					"inotify watch limit, left to --reconcile\n";
+	}
+
+	if (! loadSnapshot(options.dbFile + SNAPSHOT_EXTENSION))
+		loadFromDatabase(set<string>{""});
+	hs->setBlockSize(options.blockSize);
+	hs->loadExtentHashes();
+	sampleMemory();
+
+	auto lastWalk = std::chrono::steady_clock::now();
+	if (options.files.size()) {
+		SubtreeLock lock(options.dbFile, roots, [] (const string &path) {
+			cout << "Waiting for another run on '" << path << "'...\n";
+		});
+
+		rescan(options, roots);
+		sampleMemory();
+		lastWalk = std::chrono::steady_clock::now();
+	}
 
-	if (dedupe) doDedupe();
+	if (watcher) {
+		daemon.onReadable(watcher->getDescriptor(), [&watcher] {
+			watcher->read();
+		});
+		daemon.onTick([&] {
+			set<string> files, directories;
+			auto now = std::chrono::steady_clock::now();
+			bool walk = watcher->takeSettled(files, directories) ||
+					(options.reconcile > 0 &&
+					std::chrono::duration<double>(now - lastWalk).count() >=
+							options.reconcile);
+
+			if (! walk && files.empty() && directories.empty())
+				return;
+
+			try {
+				SubtreeLock lock(options.dbFile, roots,
+						[] (const string &path) {
+					cout << "Waiting for another run on '" << path
+							<< "'...\n";
+				});
+				ScanTotals totals;
+
+				started = now;
+				hashedBytes = 0;
+				if (walk) {
+					cout << "Reconciling...\n";
+					totals = rescan(options, roots);
+					lastWalk = std::chrono::steady_clock::now();
+				} else {
+					totals = applyChanges(options, files, directories);
+				}
+				sampleMemory();
+
+				if (walk || totals.changed || totals.removed)
+					cout << totals.changed << " files changed, "
+							<< totals.removed << " removed\n";
+			} catch (exception &error) {
+				cerr << "Could not apply changes: " << error.what() << "\n";
+			}
+		});
+	}
+
+	cout << "Listening on '" << socketFile << "'\n";
+	daemon.run();
+	cout << "Stopping\n";
+	saveSnapshot(options.dbFile + SNAPSHOT_EXTENSION, *catalog, *hs);
+}
+
+int process(const Options & options) {
+	Throttle &throttle = Throttle::getThrottle();
+
+	if (! options.statsFile.empty() || options.progress || options.daemon)
+		Stats::getStats().enable();
+
+	throttle.setLimits(options.ioLimits);
+	if (! options.throttleFile.empty())
+		throttle.setControlFile(options.throttleFile,
+				[&options] (Throttle::Limits &limits) {
+			readThrottleFile(options.throttleFile, options.ioLimits, limits);
+		});
+
+	if (! options.traceFile.empty())
+		Trace::getTrace().start(options.traceFile);
+
+	db = options.shards ?
+			ShardedDatabase::create(options.dbFile, options.shards,
+					ShardedDatabase::parseKey(options.shardKey)) :
+			Database::open(options.dbFile);
+	catalog = new FileCatalog();
+	hs = new HashStore(db, catalog);
+
+	//Stopped before the database goes away
+	std::unique_ptr<Ticker> ticker(Stats::getStats().isEnabled() ?
+			new Ticker(options.progress) : NULL);
+
+	if (! options.importFile.empty()) {
+		cout << "Importing '" << options.importFile << "'...\n";
+		Database * source = Database::open(options.importFile);
+		size_t count = source->copyTo(*db);
+		delete source;
+		cout << "Imported " << count << " files\n";
+	}
+
+	SnapshotDatabase * mirror = NULL;
+	if (! options.daemon && options.files.size())
+		mirror = mirrorSnapshot(options.dbFile + SNAPSHOT_EXTENSION);
+
+	if (options.daemon) {
+		runDaemon(options);
+	} else if (! options.planFile.empty()) {
+		set<string> patterns = options.files.size() ?
+				getRoots(options.files) : set<string>{""};
+
+		if (options.files.size()) {
+			loadFromDatabase(patterns);
+		} else if (! loadSnapshot(options.dbFile + SNAPSHOT_EXTENSION)) {
+			//Holding every record, it can leave one for the next runs
+			loadFromDatabase(patterns);
+			saveSnapshot(options.dbFile + SNAPSHOT_EXTENSION, *catalog, *hs);
+		}
+		if (options.global && options.files.size())
+			loadReferences(patterns);
+		sampleMemory();
+		writePlan(options.planFile, options.dbFile, patterns);
+	} else if (options.files.size()) {
+		FilesystemHelper &fsHelper = FilesystemHelper::getFilesystemHelper();
+		set<string> patterns, roots = getRoots(options.files);
+		map<string, BtrfsGeneration> generations;
+		bool scheduled = options.recursive &&
+				(options.timeBudget > 0 || options.ioBudget);
+		SubtreeLock lock(options.dbFile, roots,
+				[] (const string & path) {
+			cout << "Waiting for another run on '" << path << "'...\n";
+		});
+
+		//Read before looking at anything, changes made meanwhile are
+		//seen again by the next run
+		for (const string &root : roots) {
+			BtrfsGeneration generation;
+
+			if (options.recursive &&
+					fsHelper.getGeneration(root, generation))
+				generations.emplace(root, generation);
+		}
+
+		hs->setBlockSize(options.blockSize);
+		hs->loadExtentHashes();
+
+		if (scheduled) {
+			scanStalest(options, roots, patterns);
+		} else if (scanChanged(options, roots, generations)) {
+			patterns = roots;
+		} else {
+			listFiles(patterns, *catalog, options.files, options.recursive);
+			sampleMemory();
+
+			updateFiles(*catalog, patterns, NULL, options.updateExtents,
+					options.jobs);
+		}
+		sampleMemory();
+
+		//Parts of the roots may be stale after a rolling scan
+		if (! scheduled)
+			for (auto &generation : generations)
+				db->storeGeneration(generation.first, generation.second);
+
+		if (options.dedupe) {
+			if (options.global)
+				loadReferences(patterns);
+			doDedupe(options, patterns);
+		}
+	}
+
+	if (options.gc) {
+		cout << "\nCleaning unreferenced hashes...\n";
+		db->cleanHashes();
+	}
+
+	if (! options.exportFile.empty()) {
+		cout << "Exporting to '" << options.exportFile << "'...\n";
+		Database * destination = Database::open(options.exportFile);
+		size_t count = db->copyTo(*destination);
+		delete destination;
+		cout << "Exported " << count << " files\n";
+	}
+
+	//Kept for the next run, unless nothing was written
+	if (mirror && db->getVersion() != mirror->getSnapshotVersion())
+		saveSnapshot(options.dbFile + SNAPSHOT_EXTENSION,
+				mirror->getCatalog(), mirror->getStore());
+
+	sampleMemory();
+	ticker.reset();
+	if (! options.statsFile.empty())
+		writeStats(options.statsFile);
 
 	delete hs;
+	delete catalog;
 	delete db;
 
+	//After the database writer has handed over its events
+	Trace::getTrace().stop();
+
 	return 0;
 }
 
+uint32_t parseBlockSize(const string & value) {
+	uint64_t size = parseBytes(value);
+
+	if (size < 4096 || size > HASHER_BUFFER_SIZE || (size & (size - 1)))
+		throw invalid_argument("Invalid block size '" + value + "'");
+
+	return size;
+}
+
 void readInput(const string & input_filename,
 		set<string> & files) {
 	ifstream input(input_filename);
@@ -184,34 +1608,223 @@ void readInput(const string & input_filename,
 }
 
 int main(int argc, char **argv) {
-	bool updateExtents=false,
-			error=false,
-			dedupe=false,
-			recursive=false,
+	bool error=false,
 			file_as_input=false;
-	string db_file="files.db";
 	string input_file;
-	set <string> files;
+	Options options;
 
 	for (int i = 1; i<argc; i++) {
 		string argument(argv[i]);
 		int pending = argc -i -1;
 
 		if (argument=="--update-extents") {
-			updateExtents=true;
+			options.updateExtents=true;
 		} else if (argument=="--db-file") {
 			if (pending >= 1) {
-				db_file=argv[i+1];
+				options.dbFile=argv[i+1];
 				i++;
 			} else {
 				cerr<<"--db-file requires an argument.\n";
 				error=true;
 				break;
 			}
+		} else if (argument=="--import" || argument=="--export"
+				|| argument=="--plan" || argument=="--stats"
+				|| argument=="--trace" || argument=="--socket"
+				|| argument=="--send" || argument=="--ioprio"
+				|| argument=="--throttle-file") {
+			if (pending >= 1) {
+				(argument=="--import" ? options.importFile :
+						argument=="--export" ? options.exportFile :
+						argument=="--plan" ? options.planFile :
+						argument=="--stats" ? options.statsFile :
+						argument=="--socket" ? options.socketFile :
+						argument=="--send" ? options.request :
+						argument=="--ioprio" ? options.ioPriority :
+						argument=="--throttle-file" ? options.throttleFile :
+						options.traceFile)=argv[i+1];
+				i++;
+			} else {
+				cerr<<argument<<" requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--shards") {
+			if (pending >= 1) {
+				try {
+					options.shards=std::stoul(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--shards requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--jobs") {
+			if (pending >= 1) {
+				try {
+					options.jobs=std::stoul(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--jobs requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--max-bytes") {
+			if (pending >= 1) {
+				try {
+					options.maxBytes=parseBytes(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--max-bytes requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--max-groups") {
+			if (pending >= 1) {
+				try {
+					options.maxGroups=std::stoul(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--max-groups requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--time-budget") {
+			if (pending >= 1) {
+				try {
+					options.timeBudget=std::stod(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--time-budget requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--io-budget") {
+			if (pending >= 1) {
+				try {
+					options.ioBudget=parseBytes(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--io-budget requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--io-rate" || argument=="--iops"
+				|| argument=="--io-pressure" || argument=="--read-latency") {
+			if (pending >= 1) {
+				try {
+					if (argument=="--io-rate")
+						options.ioLimits.bytes=parseBytes(argv[i+1]);
+					else if (argument=="--iops")
+						options.ioLimits.operations=std::stoull(argv[i+1]);
+					else if (argument=="--io-pressure")
+						options.ioLimits.pressure=std::stod(argv[i+1]);
+					else
+						options.ioLimits.latency=std::stod(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<argument<<" requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--block-size") {
+			if (pending >= 1) {
+				try {
+					options.blockSize=parseBlockSize(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--block-size requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--shard-by") {
+			if (pending >= 1) {
+				options.shardKey=argv[i+1];
+				i++;
+			} else {
+				cerr<<"--shard-by requires an argument.\n";
+				error=true;
+				break;
+			}
 		} else if (argument=="--dedupe") {
-			dedupe=true;
+			options.dedupe=true;
+		} else if (argument=="--daemon") {
+			options.daemon=true;
+		} else if (argument=="--watch") {
+			options.daemon=true;
+			options.watch=true;
+		} else if (argument=="--reconcile") {
+			if (pending >= 1) {
+				try {
+					options.reconcile=std::stod(argv[i+1]);
+				} catch (std::logic_error &) {
+					cerr<<"Invalid value '"<<argv[i+1]<<"' for "
+							<<argument<<".\n";
+					error=true;
+					break;
+				}
+				i++;
+			} else {
+				cerr<<"--reconcile requires an argument.\n";
+				error=true;
+				break;
+			}
+		} else if (argument=="--global") {
+			options.global=true;
+		} else if (argument=="--progress") {
+			options.progress=true;
+		} else if (argument=="--gc") {
+			options.gc=true;
 		} else if (argument=="--recursive") {
-			recursive=true;
+			options.recursive=true;
 		} else if (argument=="--input") {
 			if (pending >= 1) {
 				if (file_as_input) {
@@ -229,7 +1842,7 @@ int main(int argc, char **argv) {
 				break;
 			}
 		} else if (argument.substr(0, 1) != "-" ){
-			files.insert(argument);
+			options.files.insert(argument);
 		} else {
 			cerr<<"Unrecognized option '"<<argument<<"'.\n";
 			error=true;
@@ -238,13 +1851,51 @@ int main(int argc, char **argv) {
 	}
 
 	if (file_as_input) {
-		readInput(input_file, files);
+		readInput(input_file, options.files);
 	}
 
-	if (error || files.size()==0) {
+#ifndef FASTDEDUPE_TRACE
+	if (! options.traceFile.empty()) {
+		cerr<<"--trace requires a build with FASTDEDUPE_TRACE.\n";
+		error=true;
+	}
+#endif
+
+	if (options.watch && options.files.empty()) {
+		cerr<<"--watch requires files to watch.\n";
+		error=true;
+	}
+
+	if (error || (options.files.size()==0 && options.importFile.empty()
+			&& options.exportFile.empty() && options.planFile.empty()
+			&& ! options.gc && ! options.daemon && options.request.empty())) {
 		return showError(argv[0]);
 	}
 
-	return process(db_file, files, recursive, updateExtents, dedupe);
+	if (! options.request.empty()) {
+		try {
+			string response = Daemon::request(options.socketFile.empty() ?
+					options.dbFile + DAEMON_SOCKET_SUFFIX : options.socketFile,
+					options.request);
+
+			cout << response;
+			return response.compare(0, 9, "{\"error\":") == 0;
+		} catch (exception &error) {
+			cerr << error.what() << "\n";
+			return 1;
+		}
+	}
+
+	if (! options.ioPriority.empty()) {
+		//Before any thread starts, they inherit it
+		try {
+			Throttle::setPriority(options.ioPriority);
+		} catch (exception &error) {
+			cerr << error.what() << "\n";
+			return 1;
+		}
+	}
+
+	return process(options);
 
 }